@@ -36,17 +36,541 @@
 
 /* MySQL API headers */
 #include <mysql.h>
+#include <errmsg.h>
 extern void my_thread_end(void);
 
 /* Common system headers */
 #include <stdio.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
+#include <float.h>
 
 #define MAX_ERROR_MSG	1024
 #define MAX_IDENTIFIER	1024
+#define LAYOUT_CACHE_SIZE 64    /* Column layouts cached per handle. */
+#define HISTOGRAM_BUCKETS 25    /* Latency buckets up to 2^24 microseconds. */
+#define ERRNO_SLOTS       16    /* Distinct error numbers counted. */
+#define DIGEST_STRIPES    16    /* Separately locked parts of a digest table. */
+#define EXPLAIN_QUEUE     16    /* Max. slow queries waiting for EXPLAIN. */
+#define EXPORT_CHUNK      65536 /* Output buffer size of ns_mysql export. */
+#define ROW_CHUNK         65536 /* Row data block of a buffered result. */
+#define MEMORY_STEP       65536 /* Result memory added to the pool at once. */
+#define ASYNC_ABORT_WAIT  5     /* Seconds to wait for a killed submitted query. */
+#define ASYNC_SLICE       1000  /* Retry interval (usec) of the MySQL nonblocking API. */
+#define WIRE_INTERVAL     60    /* Min. seconds between samples of the server bytes sent. */
+
+/*
+ * MySQL 8.0 replaced my_bool by the C99 bool type.
+ */
+#if !defined(MARIADB_BASE_VERSION) && MYSQL_VERSION_ID >= 80001
+typedef bool my_bool;
+#endif
+
+/*
+ * Nonblocking query API: MariaDB provides the mysql_*_start/_cont
+ * functions, MySQL 8.0.16 and newer the mysql_*_nonblocking functions.
+ */
+#if defined(MARIADB_BASE_VERSION)
+# define HAVE_ASYNC_QUERY 1
+#elif MYSQL_VERSION_ID >= 80016
+# define HAVE_ASYNC_QUERY 1
+#endif
+
+/*
+ * TLS session resumption: MySQL 8.0.29 and newer can export the session
+ * of a connection and offer it on the next connect.
+ */
+#if !defined(MARIADB_BASE_VERSION) && MYSQL_VERSION_ID >= 80029
+# define HAVE_SSL_SESSION_DATA 1
+#endif
+
+/*
+ * Choice of the protocol compression algorithm (zlib, zstd): MySQL 8.0.18
+ * and newer. Older and MariaDB clients support zlib only.
+ */
+#if !defined(MARIADB_BASE_VERSION) && MYSQL_VERSION_ID >= 80018
+# define HAVE_COMPRESSION_ALGORITHMS 1
+#endif
+
+/*
+ * Escaping for a given quote character: MySQL 5.7.6 and newer, where
+ * mysql_real_escape_string fails in NO_BACKSLASH_ESCAPES mode.
+ */
+#if !defined(MARIADB_BASE_VERSION) && MYSQL_VERSION_ID >= 50706
+# define HAVE_ESCAPE_QUOTE 1
+#endif
+
+/*
+ * How result sets are retrieved from the server: "store" reads the
+ * full result into client memory (mysql_store_result), "use" streams
+ * rows from the server as they are fetched (mysql_use_result).
+ */
+typedef enum {
+    RESULT_STORE,
+    RESULT_USE,
+    RESULT_CURSOR
+} ResultMode;
+
+/*
+ * TLS requirement of the connections (pool parameter sslmode).
+ */
+typedef enum {
+    SSLMODE_DEFAULT,                /* As the client library defaults. */
+    SSLMODE_DISABLED,
+    SSLMODE_PREFERRED,
+    SSLMODE_REQUIRED,
+    SSLMODE_VERIFY_CA,
+    SSLMODE_VERIFY_IDENTITY
+} SslMode;
+
+/*
+ * Representation of binary column values in the row set.
+ */
+typedef enum {
+    BINARY_NONE,                    /* Raw bytes. */
+    BINARY_HEX,
+    BINARY_BASE64
+} BinaryEncoding;
+
+/*
+ * Output formats of ns_mysql export.
+ */
+typedef enum {
+    EXPORT_CSV,
+    EXPORT_TSV,
+    EXPORT_JSON,
+    EXPORT_NDJSON
+} ExportFormat;
+
+/*
+ * Result shapes of ns_mysql select_json.
+ */
+typedef enum {
+    JSON_OBJECT,                    /* Array of objects. */
+    JSON_ARRAY,                     /* Array of arrays. */
+    JSON_COLUMNAR                   /* Object of column arrays. */
+} JsonShape;
+
+/*
+ * Result shapes of ns_mysql select_all.
+ */
+typedef enum {
+    ALL_ROWS,                       /* List of row lists. */
+    ALL_DICTS,                      /* List of dicts. */
+    ALL_FLAT,                       /* List of all values. */
+    ALL_COLUMNS                     /* Dict of column value lists. */
+} AllShape;
+
+/*
+ * Latency histogram with logarithmic buckets: bucket i counts durations
+ * of at most 2^i microseconds, longer durations count only in "count".
+ */
+typedef struct Histogram {
+    unsigned long   count;
+    unsigned long   sum;            /* Microseconds. */
+    unsigned long   buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+typedef enum {
+    STATS_DML,
+    STATS_SELECT,
+    STATS_EXEC,
+    STATS_KINDS
+} StatsKind;
+
+/*
+ * Driver statistics. Each handle updates its own block without locking,
+ * since a handle is used by one thread at a time; the pool totals are
+ * computed when the statistics are requested.
+ */
+typedef struct Stats {
+    Histogram       queries[STATS_KINDS]; /* Query execution time. */
+    Histogram       fetch;          /* Row fetching time per result. */
+    Histogram       connect;        /* Connection setup time, full handshake. */
+    Histogram       connectResumed; /* Same, TLS session resumed. */
+    unsigned long   rows;           /* Rows fetched. */
+    unsigned long   bytes;          /* Bytes of fetched column values. */
+    unsigned long   connectErrors;
+    unsigned long   pings;          /* Connection checks. */
+    unsigned long   reconnects;     /* Lost connections reopened. */
+    unsigned long   retries;        /* Statements repeated after reconnect. */
+    unsigned long   compressedBytes; /* Bytes fetched over compressed */
+    unsigned long   wireBytes;      /* connections, and sent by the server on them. */
+    unsigned long   warmups;        /* Connections opened at server start. */
+    unsigned long   warmupTime;     /* Duration of the warm-up (usec). */
+    unsigned long   otherErrors;    /* Errors not fitting in errnos. */
+    struct {
+        unsigned int    code;
+        unsigned long   count;
+    } errnos[ERRNO_SLOTS];
+} Stats;
+
+/*
+ * Cost of the queries sharing one normalized SQL text (digest).
+ */
+typedef struct Digest {
+    uint64_t        hash;           /* FNV-1a of the normalized text. */
+    unsigned long   calls;
+    unsigned long   time;           /* Total time in microseconds. */
+    unsigned long   maxTime;
+    unsigned long   rows;           /* Rows fetched or affected. */
+    unsigned long   bytes;
+} Digest;
+
+/*
+ * One stripe of the digest table of a pool, selected by digest hash.
+ */
+typedef struct DigestTable {
+    Ns_Mutex        lock;
+    Tcl_HashTable   entries;        /* Digest by normalized SQL text. */
+    int             size;
+} DigestTable;
+
+/*
+ * Digest entry copied out of the tables for "ns_mysql digest top".
+ */
+typedef struct DigestRow {
+    const char     *pool;
+    Tcl_Obj        *queryObj;
+    Digest          digest;
+    unsigned long   key;
+} DigestRow;
+
+/*
+ * Slow query waiting for its EXPLAIN in the explain thread. The
+ * connection parameters are copied from the handle, which may be
+ * closed by then. The datasource is the one the query ran on, a
+ * replica when it was routed there.
+ */
+typedef struct ExplainJob {
+    struct ExplainJob *nextPtr;
+    struct Pool    *poolPtr;
+    char           *driver;
+    char           *datasource;
+    char           *database;
+    char           *user;
+    char           *password;
+    char           *sql;
+    Tcl_DString     entry;          /* Log entry, completed by the thread. */
+} ExplainJob;
+
+/*
+ * Connections of a pool opened by the warm-up threads at server start.
+ */
+typedef struct WarmupJob {
+    struct Pool    *poolPtr;
+    const char     *driver;
+    const char     *datasource;
+    const char     *user;
+    const char     *password;
+    int             n;              /* Connections to open. */
+    int             next;           /* Next one to open, under pool lock. */
+    int             nthreads;
+    Ns_Thread      *threads;
+    Ns_Time         start;
+    Ns_Time         end;            /* Last connection done. */
+} WarmupJob;
+
+/*
+ * Block of row data of a buffered result.
+ */
+typedef struct RowChunk {
+    struct RowChunk *nextPtr;
+    size_t          size;
+    size_t          used;
+    char            data[1];
+} RowChunk;
+
+/*
+ * Result set in the result cache of a pool. Column metadata, values
+ * and table keys are stored in the same allocation as the entry.
+ * Buffered results (read under a memory limit, never cached) use the
+ * same structure, with the rows in separate allocations.
+ */
+typedef struct CacheEntry {
+    Tcl_HashEntry  *hPtr;           /* NULL once removed from the cache. */
+    struct CacheEntry *prevPtr;     /* LRU list, most recently used first. */
+    struct CacheEntry *nextPtr;
+    int             refCount;       /* Cache and handles reading the entry. */
+    size_t          size;
+    Ns_Time         expires;
+    unsigned long   generation;     /* Write generation when the query started. */
+    unsigned int    ncols;
+    unsigned long   nrows;
+    MYSQL_FIELD    *fields;         /* Names, tables and types of the columns. */
+    char          **values;         /* nrows * ncols, NULL for SQL NULL. */
+    unsigned long  *lengths;
+    int             ntables;
+    char           *tables;         /* Table keys, each NUL terminated. */
+    bool            buffered;       /* Private result of one handle. */
+    RowChunk       *chunks;         /* Row data of a buffered result. */
+} CacheEntry;
+
+/*
+ * State of a query submitted with "ns_mysql submit".
+ */
+typedef enum {
+    ASYNC_IDLE,
+    ASYNC_QUERY,                    /* Sending query, waiting for reply. */
+    ASYNC_STORE                     /* Reading the result set. */
+} AsyncState;
+
+/*
+ * Query of "ns_mysql fanout" running in its own thread.
+ */
+typedef struct FanoutJob {
+    struct FanoutJob *nextPtr;      /* Queue of the fanout threads. */
+    Ns_DbHandle    *handle;
+    char           *sql;
+    bool            started;
+    bool            done;
+    int             status;         /* Return code of DbExec. */
+    Tcl_WideInt     count;          /* Rows fetched or affected. */
+    Tcl_DString     columns;        /* Column names as Tcl list. */
+    Tcl_DString     rows;           /* Rows as Tcl list of lists. */
+    Tcl_DString     error;          /* Error message. */
+    char            code[6];        /* Error code. */
+} FanoutJob;
+
+/*
+ * Read replica of a pool and its state as seen by the handles of the
+ * pool.
+ */
+typedef struct Replica {
+    char           *datasource;     /* "host:port:database" */
+    long            lag;            /* Seconds behind primary, -1 unknown. */
+    Ns_Time         checked;        /* Time of the last lag check. */
+    Ns_Time         failedUntil;    /* Not used before this time. */
+} Replica;
+
+/*
+ * Source of the data of "ns_mysql load_data", read by the LOAD DATA
+ * LOCAL INFILE handler of the connection.
+ */
+typedef struct Infile {
+    Tcl_Channel     chan;           /* Channel, or NULL for data. */
+    const unsigned char *data;
+    TCL_SIZE_T      length;
+    TCL_SIZE_T      offset;         /* Read position in data. */
+    Tcl_WideInt     bytes;          /* Bytes sent to the server. */
+} Infile;
+
+/*
+ * Options of "ns_mysql load_data".
+ */
+typedef struct LoadOptions {
+    bool            csv;            /* CSV instead of the LOAD DATA defaults. */
+    bool            replace;
+    bool            ignore;
+    int             ignoreLines;
+    const char     *charset;
+    const char     *lineEnd;
+    Tcl_Obj        *columnsObj;
+} LoadOptions;
+
+/*
+ * Session variable set on a handle, restored after a reconnect.
+ */
+typedef struct SessionVar {
+    struct SessionVar *nextPtr;
+    char           *key;            /* Variable name, lowercase. */
+    char           *sql;            /* SET statement with its assignment. */
+} SessionVar;
+
+/*
+ * Per-pool driver configuration, read once from the pool section
+ * "ns/db/pool/<poolname>" when the first handle of the pool is opened.
+ */
+typedef struct Pool {
+    const char     *name;
+    Ns_Mutex        lock;           /* Lock around the fields below. */
+    struct Context *firstCtxPtr;    /* Open handles of the pool. */
+    ResultMode      resultMode;
+    BinaryEncoding  binaryEncoding; /* Default for binary columns in rows. */
+    bool            multiStatements; /* Connect with CLIENT_MULTI_STATEMENTS. */
+    int             stmtCacheSize;  /* Max. prepared statements per handle. */
+    unsigned long   stmtHits;       /* Statement and layout cache */
+    unsigned long   stmtMisses;     /* counters of already closed */
+    unsigned long   layoutHits;     /* handles. */
+    unsigned long   layoutMisses;
+    Stats           retired;        /* Statistics of closed handles. */
+    Stats           baseline;       /* Totals at last reset. */
+    int             digestSize;     /* Max. digests, 0 when disabled. */
+    DigestTable    *digests;        /* DIGEST_STRIPES tables or NULL. */
+    unsigned long   slowThreshold;  /* Slow query time (usec), 0 when disabled. */
+    int             slowSampling;   /* Log every n-th slow query. */
+    int             slowRateLimit;  /* Max. entries per second, 0 unlimited. */
+    bool            slowExplain;    /* Add EXPLAIN of slow SELECTs. */
+    int             slowFd;         /* Slow query log file or -1. */
+    unsigned long   slowSeen;       /* Slow queries, for sampling. */
+    time_t          slowSecond;     /* Rate limiting interval and */
+    int             slowCount;      /* entries written in it. */
+    unsigned long   slowSuppressed; /* Entries dropped by rate limit. */
+    size_t          cacheMax;       /* Result cache size, 0 when disabled. */
+    Ns_Time         cacheTtl;       /* Default time to live of entries. */
+    Ns_Mutex        cacheLock;      /* Lock around the result cache. */
+    Tcl_HashTable   cache;          /* Entries by database and SQL. */
+    struct CacheEntry *firstCachePtr; /* LRU list of entries. */
+    struct CacheEntry *lastCachePtr;
+    size_t          cacheSize;      /* Bytes of all entries. */
+    unsigned long   cacheHits;
+    unsigned long   cacheMisses;
+    unsigned long   cacheStores;
+    unsigned long   cacheEvictions;
+    unsigned long   cacheExpired;
+    unsigned long   cacheInvalidated;
+    int             nreplicas;
+    Replica        *replicas;       /* State under lock. */
+    int             replicaMaxLag;  /* Max. lag (seconds) of a usable replica. */
+    Ns_Time         replicaInterval; /* Lag check and retry interval. */
+    const char     *replicaLagQuery;
+    bool            readYourWrites; /* Pin handle to primary after writes. */
+    bool            localInfile;    /* Allow ns_mysql load_data. */
+    unsigned long   prefetchRows;   /* Rows per fetch in cursor mode. */
+    bool            memLimits;      /* Some result memory limit is set. */
+    size_t          memSoft;        /* Result memory limits per handle */
+    size_t          memHard;        /* and for all handles of the pool, */
+    size_t          poolMemSoft;    /* 0 when not set. */
+    size_t          poolMemHard;
+    size_t          memUsed;        /* Result memory of all handles. */
+    size_t          memPeak;
+    unsigned long   memSoftCount;   /* Results over a soft limit. */
+    unsigned long   memHardCount;   /* Results aborted at a hard limit. */
+    Ns_Time         pingInterval;   /* Check connections idle this long. */
+    bool            reconnect;      /* Reopen lost connections, retry reads. */
+    const char     *charset;        /* Connection character set or NULL. */
+    TCL_SIZE_T      sessionInitc;   /* Statements run on new connections. */
+    const char    **sessionInitv;
+    unsigned long   lostGeneration; /* Incremented on each lost connection. */
+    SslMode         sslMode;
+    const char     *sslCa;          /* TLS files and ciphers, NULL */
+    const char     *sslCaPath;      /* when not set. */
+    const char     *sslCert;
+    const char     *sslKey;
+    const char     *sslCipher;
+    bool            sslSessions;    /* Resume TLS sessions. */
+    unsigned int    connectTimeout; /* Seconds, 0 for library default. */
+    unsigned int    readTimeout;
+    unsigned int    writeTimeout;
+    const char     *compression;    /* Compression algorithms or NULL. */
+    unsigned int    zstdLevel;      /* 0 for library default. */
+    bool            compressBulk;   /* Compress only bulk transfers. */
+    int             warmup;         /* Connections opened at server start. */
+    int             warmupThreads;  /* Max. threads opening them. */
+    unsigned int    warmupTimeout;  /* Their connect timeout (seconds). */
+    const char     *warmSource;     /* Datasource of the warm connections. */
+    MYSQL         **warmConns;      /* Warm connections not yet taken */
+    int             nwarm;          /* by a handle. */
+} Pool;
+
+/*
+ * Server-side prepared statement, cached per handle with LRU eviction.
+ */
+typedef struct Stmt {
+    MYSQL_STMT     *stmt;
+    Tcl_HashEntry  *hPtr;           /* Cache entry, NULL when not cached. */
+    struct Stmt    *prevPtr;        /* LRU list, most recently used first. */
+    struct Stmt    *nextPtr;
+} Stmt;
+
+/*
+ * Column key layout of a result set as used for the keys of the row
+ * Ns_Set, identified by the names and tables of the result fields.
+ */
+typedef struct Layout {
+    uint32_t        hash;
+    unsigned int    ncols;
+    bool            tablenames;     /* Keys include the table names. */
+    TCL_SIZE_T     *offsets;        /* Key offsets in keys. */
+    TCL_SIZE_T     *lengths;        /* Key lengths. */
+    Tcl_DString     keys;           /* Keys, each NUL terminated. */
+} Layout;
+
+/*
+ * Result buffers of a prepared statement. Columns are bound as strings,
+ * or for typed fetches as native integers, doubles and byte arrays.
+ */
+typedef struct Bindings {
+    unsigned int    ncols;
+    MYSQL_BIND     *binds;
+    unsigned long  *lengths;
+    my_bool        *nulls;
+    my_bool        *errors;
+    bool           *binary;         /* Column holds binary data. */
+    bool            rebind;         /* Buffers were grown after binding. */
+} Bindings;
+
+/*
+ * Per-handle driver state, kept in handle->context.
+ */
+typedef struct Context {
+    Pool           *poolPtr;
+    struct Context *prevPtr;        /* List of open handles of the pool. */
+    struct Context *nextPtr;
+    ResultMode      resultMode;     /* Mode for the next query. */
+    BinaryEncoding  binaryEncoding; /* Encoding of binary columns in rows. */
+    bool            streaming;      /* Open result is unbuffered. */
+    Tcl_HashTable   stmts;          /* Prepared statements by SQL text. */
+    Stmt           *firstStmtPtr;   /* Most recently used statement. */
+    Stmt           *lastStmtPtr;    /* Least recently used statement. */
+    unsigned long   stmtHits;
+    unsigned long   stmtMisses;
+    Layout         *layouts[LAYOUT_CACHE_SIZE]; /* Direct-mapped by hash. */
+    unsigned long   layoutHits;
+    unsigned long   layoutMisses;
+    unsigned long   maxPacket;      /* Server max_allowed_packet, 0 if unknown. */
+    AsyncState      asyncState;     /* State of a submitted query. */
+    int             asyncWait;      /* Events the library waits for. */
+    int             asyncErr;       /* Submitted query failed. */
+    MYSQL_RES      *asyncRes;       /* Result of a submitted query. */
+    char           *asyncSql;       /* SQL text of a submitted query. */
+    Ns_Time         asyncStart;     /* Submit time of the query. */
+    Stats           stats;
+    unsigned long   fetchTime;      /* Fetch time of open result (usec). */
+    bool            queryPending;   /* Last query waits for its result */
+    unsigned long   queryTime;      /* to be released. */
+    unsigned long   queryRows;      /* stats.rows/bytes at query time. */
+    unsigned long   queryBytes;
+    Tcl_DString     digestSql;      /* Normalized SQL of last query. */
+    char           *slowSql;        /* SQL of last query, when slow, */
+    char           *slowDb;         /* its database and the datasource */
+    const char     *slowSource;     /* it ran on. */
+    char           *database;       /* Current database. */
+    bool            cacheNext;      /* Next query may use the result cache. */
+    Ns_Time         cacheTtl;
+    unsigned long   cacheGeneration; /* Write generation before the query. */
+    CacheEntry     *cachePtr;       /* Cached result being read. */
+    unsigned long   cacheRow;       /* Next row of cachePtr. */
+    Tcl_DString     txnTables;      /* Tables written in open transaction. */
+    MYSQL          *primary;        /* Connection to the primary. */
+    MYSQL         **replicaConns;   /* Replica connections, opened lazily. */
+    char          **replicaDbs;     /* Current database of replica connections. */
+    int             replica;        /* Replica in use, -1 for the primary. */
+    int             nextReplica;    /* Round-robin position. */
+    bool            pinPrimary;     /* Route all statements to the primary. */
+    Infile         *infilePtr;      /* Source of a running load_data. */
+    MYSQL_STMT     *cursor;         /* Statement of an open cursor. */
+    Bindings        cursorBind;
+    char          **cursorValues;   /* Values of the current cursor row. */
+    size_t          memUsed;        /* Memory of the buffered result. */
+    size_t          memPending;     /* Part not yet added to the pool. */
+    size_t          memPeak;
+    bool            memWarned;      /* Soft limit reported for this result. */
+    Ns_Time         lastUsed;       /* Start of the last query. */
+    unsigned long   lostGeneration; /* Pool lostGeneration when last checked. */
+    SessionVar     *firstVarPtr;    /* Session variables, in order set. */
+    MYSQL          *compressConn;   /* Compressed connection for bulk transfers. */
+    char           *compressDb;     /* Its current database. */
+    bool            compressNext;   /* Next query is a bulk transfer. */
+    bool            compressing;    /* Open result is read compressed. */
+    bool            compressUsed[2]; /* Primary and bulk connection used */
+    unsigned long   wireMark[2];    /* compressed, and server bytes sent. */
+    Ns_Time         wireTime;       /* Last sample of wireMark. */
+} Context;
 
 static const char *DbType(Ns_DbHandle *handle);
 static int         DbServerInit(const char *server, const char *module, const char *driver);
@@ -61,6 +585,157 @@ static int         DbCancel(Ns_DbHandle *handle);
 static int         DbExec(Ns_DbHandle *handle, char *sql);
 static Ns_Set     *DbBindRow(Ns_DbHandle *handle);
 
+static int         DbResetHandle(Ns_DbHandle *handle);
+
+static MYSQL      *Connect(Ns_DbHandle *handle, const char *datasource, bool localInfile, bool compress,
+                           unsigned int timeout);
+static void        ConnectOptions(MYSQL *mysql, const Pool *poolPtr, bool compress);
+static bool        CompressUsable(Ns_DbHandle *handle);
+static void        WireSample(Context *ctx);
+static void        WireBytes(Context *ctx, MYSQL *mysql, int i);
+#ifdef HAVE_SSL_SESSION_DATA
+static char       *SslSessionGet(const char *datasource);
+static void        SslSessionPut(MYSQL *mysql, const char *datasource);
+#endif
+static bool        SslResumed(MYSQL *mysql);
+static Pool       *GetPool(const char *poolname);
+static void        FreeResult(Ns_DbHandle *handle, bool kill);
+static int         BufferResult(Ns_DbHandle *handle, const char *sql);
+static int         MemoryCharge(Ns_DbHandle *handle, size_t bytes, const char *sql, Tcl_DString *dsPtr);
+static void        MemoryRelease(Context *ctx);
+static int         MemoryCmd(Tcl_Interp *interp, bool reset);
+static int         DrainResults(Ns_DbHandle *handle);
+static int         Batch(Tcl_Interp *interp, Ns_DbHandle *handle, Tcl_Obj *sqlListObj);
+static Tcl_Obj    *ResultObj(Ns_DbHandle *handle, MYSQL_RES *result, const char *sql, Tcl_DString *dsPtr);
+static Tcl_Obj    *RowObj(const MYSQL_FIELD *fields, unsigned int ncols, char **values,
+                          const unsigned long *lengths);
+static Ns_Set     *CursorOpen(Ns_DbHandle *handle, const char *sql);
+static int         FetchRow(Ns_DbHandle *handle, const MYSQL_FIELD **fieldsPtr, unsigned int *ncolsPtr,
+                            char ***valuesPtr, unsigned long **lengthsPtr);
+static int         RunSelect(Tcl_Interp *interp, Ns_DbHandle *handle, const char *sql, ResultMode mode);
+static int         Export(Tcl_Interp *interp, Ns_DbHandle *handle, const char *sql, ExportFormat format,
+                          Tcl_Channel chan, Ns_Conn *conn);
+static bool        ExportWrite(Tcl_DString *dsPtr, Tcl_Channel chan, Ns_Conn *conn, bool stream);
+static void        ExportCsv(Tcl_DString *dsPtr, const char *value, unsigned long length);
+static void        ExportTsv(Tcl_DString *dsPtr, const char *value, unsigned long length);
+static void        JsonAppend(Tcl_DString *dsPtr, const char *value, unsigned long length);
+static void        JsonValue(Tcl_DString *dsPtr, const MYSQL_FIELD *fieldPtr, const char *value,
+                             unsigned long length, BinaryEncoding encoding);
+static TCL_SIZE_T *JsonKeys(Tcl_DString *dsPtr, const MYSQL_FIELD *fields, unsigned int ncols);
+static int         SelectJson(Tcl_Interp *interp, Ns_DbHandle *handle, const char *sql, JsonShape shape);
+static int         SelectAll(Tcl_Interp *interp, Ns_DbHandle *handle, const char *sql, AllShape shape);
+static void        EncodeBinary(Tcl_DString *dsPtr, BinaryEncoding encoding, const unsigned char *value,
+                                unsigned long length);
+static int         AsyncSubmit(Tcl_Interp *interp, Ns_DbHandle *handle, const char *sql);
+static int         AsyncWait(Ns_DbHandle *handle, const Ns_Time *timeoutPtr);
+static void        AsyncAbort(Ns_DbHandle *handle);
+static int         AsyncPending(Ns_DbHandle *handle);
+static bool        HandleBusy(Tcl_Interp *interp, Ns_DbHandle *handle);
+static int         Fanout(Tcl_Interp *interp, Tcl_Obj *listObj, Tcl_Obj *timeoutObj);
+static Ns_ThreadProc FanoutThread;
+static int         FanoutRun(FanoutJob *jobPtr);
+static int         GetHandle(Tcl_Interp *interp, Tcl_Obj *handleObj, Ns_DbHandle **handlePtr);
+static unsigned long Elapsed(const Ns_Time *startPtr);
+static void        HistogramAdd(Histogram *histPtr, unsigned long usec);
+static void        StatsQuery(Ns_DbHandle *handle, StatsKind kind, const char *sql, const Ns_Time *startPtr);
+static void        StatsError(Stats *statsPtr, unsigned int code);
+static void        HistogramSum(Histogram *toPtr, const Histogram *fromPtr, int sign);
+static void        StatsSum(Stats *toPtr, const Stats *fromPtr, int sign);
+static Tcl_Obj    *HistogramObj(const Histogram *histPtr);
+static Tcl_Obj    *StatsObj(const Stats *statsPtr);
+static void        HistogramPrometheus(Tcl_DString *dsPtr, const char *name, const char *labels,
+                                       const Histogram *histPtr);
+static void        StatsPrometheus(Tcl_DString *dsPtr, int npools, const char **names, const Stats *stats);
+static void        PrometheusLabel(Tcl_DString *dsPtr, const char *value);
+static int         StatsCmd(Tcl_Interp *interp, bool reset, bool prometheus);
+static void        DigestPlaceholder(Tcl_DString *dsPtr, char c);
+static void        DigestNormalize(const char *sql, Tcl_DString *dsPtr);
+static void        DigestAdd(Pool *poolPtr, const Tcl_DString *sqlPtr, unsigned long usec,
+                             unsigned long rows, unsigned long bytes);
+static void        QueryDone(Ns_DbHandle *handle, unsigned long usec, unsigned long rows, unsigned long bytes);
+static void        FlushQuery(Ns_DbHandle *handle);
+static int         DigestCompare(const void *a, const void *b);
+static int         DigestTop(Tcl_Interp *interp, int n, const char *by);
+static void        DigestReset(void);
+static bool        SlowQuery(Pool *poolPtr, unsigned long *suppressedPtr);
+static void        SlowLog(Ns_DbHandle *handle, const char *sql, unsigned long usec,
+                           unsigned long rows, unsigned long bytes);
+static void        SlowWrite(const Pool *poolPtr, const Tcl_DString *dsPtr);
+static Ns_ThreadProc ExplainThread;
+static bool        CacheLookup(Ns_DbHandle *handle, const char *sql);
+static void        CacheStore(Ns_DbHandle *handle, const char *sql, const CacheEntry *resultPtr);
+static void        CacheWrite(Ns_DbHandle *handle, const char *sql);
+static void        ParseTables(Ns_DbHandle *handle, const char *sql, Tcl_DString *dsPtr);
+static const char *SqlSpace(const char *p);
+static const char *SqlSkip(const char *p);
+static const char *SqlWord(const char *p, char *word, size_t size);
+static const char *SqlIdentifier(const char *p, char *name, size_t size, bool *quotedPtr);
+static void        CacheKey(Tcl_DString *dsPtr, const Context *ctx, const char *sql);
+static void        CacheTableKey(Tcl_DString *dsPtr, const char *datasource, const char *db,
+                                 TCL_SIZE_T dbLength, const char *table, TCL_SIZE_T tableLength);
+static void        CacheBump(const Tcl_DString *tablesPtr);
+static bool        CacheValid(const CacheEntry *entryPtr);
+static void        CacheLink(Pool *poolPtr, CacheEntry *entryPtr);
+static void        CacheUnlink(Pool *poolPtr, CacheEntry *entryPtr);
+static void        CacheRemove(Pool *poolPtr, CacheEntry *entryPtr);
+static void        CacheRelease(Pool *poolPtr, CacheEntry *entryPtr);
+static void        CacheFree(CacheEntry *entryPtr);
+static size_t      FieldsSize(const MYSQL_FIELD *fields, unsigned int ncols);
+static char       *CopyFields(MYSQL_FIELD *to, const MYSQL_FIELD *fields, unsigned int ncols, char *p);
+static void        CacheFlush(Pool *poolPtr);
+static int         RunQuery(Ns_DbHandle *handle, const char *sql);
+static void        RouteQuery(Ns_DbHandle *handle, const char *sql);
+static void        RoutePrimary(Ns_DbHandle *handle);
+static void        RouteWrite(Ns_DbHandle *handle);
+static bool        ReadOnly(const char *sql);
+static int         CheckConnection(Ns_DbHandle *handle);
+static bool        ConnectionLost(Ns_DbHandle *handle);
+static int         Reconnect(Ns_DbHandle *handle);
+static int         SessionInit(Ns_DbHandle *handle, MYSQL *mysql);
+static void        SessionTrack(Context *ctx, const char *sql);
+static void        SessionVarSet(Context *ctx, const char *key, const char *assignment, size_t length);
+static WarmupJob  *WarmupStart(const char *poolname, const char *driver);
+static void        WarmupWait(WarmupJob *jobPtr);
+static Ns_ThreadProc WarmupThread;
+static bool        ReplicaUsable(Ns_DbHandle *handle, int i);
+static void        ReplicaFailed(Ns_DbHandle *handle, int i);
+static long        ReplicaLag(MYSQL *mysql, const char *query);
+static void        KillQuery(Ns_DbHandle *handle);
+static bool        ParseResultMode(const char *value, ResultMode *modePtr);
+static Ns_Set     *BindColumns(Ns_DbHandle *handle, const MYSQL_FIELD *fields, unsigned int ncols);
+static Layout     *GetLayout(Context *ctx, const MYSQL_FIELD *fields, unsigned int ncols);
+static bool        LayoutMatches(const Layout *layoutPtr, const MYSQL_FIELD *fields, unsigned int ncols);
+static void        FreeLayout(Layout *layoutPtr);
+static int         BulkInsert(Tcl_Interp *interp, Ns_DbHandle *handle, Tcl_Obj *tableObj,
+                              Tcl_Obj *columnsObj, Tcl_Obj *rowsObj, bool ignore, const char *onDup,
+                              const char *null);
+static unsigned long GetMaxPacket(Ns_DbHandle *handle);
+static void        AppendIdentifier(Tcl_DString *dsPtr, const char *name);
+static void        AppendTable(Tcl_DString *dsPtr, const char *name);
+static bool        IsByteArray(const Tcl_Obj *objPtr);
+static int         LoadBytes(Tcl_Interp *interp, Tcl_Obj *dataObj, const char *charset, Tcl_DString *dsPtr,
+                             Infile *infilePtr);
+static int         LoadData(Tcl_Interp *interp, Ns_DbHandle *handle, const char *table, Infile *infilePtr,
+                            const LoadOptions *optionsPtr);
+static int         InfileInit(void **ptr, const char *filename, void *userdata);
+static int         InfileRead(void *ptr, char *buf, unsigned int length);
+static void        InfileEnd(void *ptr);
+static int         InfileError(void *ptr, char *msg, unsigned int length);
+static void        AppendLiteral(Tcl_DString *dsPtr, MYSQL *mysql, const char *value, TCL_SIZE_T length);
+static Stmt       *PrepareStmt(Tcl_Interp *interp, Ns_DbHandle *handle, const char *sql);
+static void        ReleaseStmt(Context *ctx, Stmt *stmtPtr);
+static void        FreeStmt(Context *ctx, Stmt *stmtPtr);
+static void        FlushStmts(Context *ctx);
+static int         ExecuteStmt(Tcl_Interp *interp, Ns_DbHandle *handle, Stmt *stmtPtr, const char *sql,
+                               Tcl_Obj *valuesObj, const char *null, bool typed);
+static int         StmtRows(Tcl_Interp *interp, Ns_DbHandle *handle, MYSQL_STMT *stmt, bool typed);
+static int         StmtError(Tcl_Interp *interp, Ns_DbHandle *handle, MYSQL_STMT *stmt);
+static int         BindResult(MYSQL_STMT *stmt, Bindings *bindPtr, const MYSQL_FIELD *fields, unsigned int ncols, bool typed);
+static int         FetchBound(MYSQL_STMT *stmt, Bindings *bindPtr);
+static const char *BoundValue(MYSQL_STMT *stmt, Bindings *bindPtr, unsigned int i, unsigned long *lengthPtr);
+static Tcl_Obj    *BoundObj(MYSQL_STMT *stmt, Bindings *bindPtr, unsigned int i);
+static bool        IsBinaryField(const MYSQL_FIELD *fieldPtr);
+static void        FreeBindings(Bindings *bindPtr);
 static void        Log(Ns_DbHandle *handle, MYSQL *mysql);
 static void        InitThread(void);
 static Ns_TlsCleanup CleanupThread;
@@ -71,6 +746,43 @@ NS_EXPORT NsDb_DriverInitProc Ns_DbDriverInit;
 
 static Ns_Tls tls;                  /* For the thread exit callback. */
 static int include_tablenames = 0;  /* Include tablename in resultset. */
+static Tcl_HashTable pools;         /* Pool configurations by poolname. */
+static Ns_Mutex poolsLock;          /* Lock around pools table. */
+
+static Ns_Mutex fanoutLock;         /* Lock and condition for */
+static Ns_Cond  fanoutCond;         /* completion of fanout jobs. */
+static Ns_Cond  fanoutQueueCond;    /* Signaled on new queued jobs. */
+static FanoutJob *firstFanoutPtr;   /* Queue of the fanout threads. */
+static FanoutJob *lastFanoutPtr;
+static int      fanoutQueued;
+static int      fanoutThreads;      /* Running fanout threads, */
+static int      fanoutIdle;         /* waiting for a job, */
+static int      fanoutMax = 16;     /* and the limit. */
+
+static Ns_Mutex explainLock;        /* Lock and condition around */
+static Ns_Cond  explainCond;        /* the explain queue. */
+static ExplainJob *firstExplainPtr; /* Queue of the explain thread, */
+static ExplainJob *lastExplainPtr;  /* in order of arrival. */
+static int      explainQueued;
+static bool     explainRunning;
+
+static Ns_Mutex cacheLock;          /* Lock around the write generations. */
+static Tcl_HashTable cacheTables;   /* Last write generation by table key. */
+static unsigned long cacheGeneration;
+static bool     cacheEnabled;       /* Some pool has a result cache. */
+
+#ifdef HAVE_SSL_SESSION_DATA
+static Ns_Mutex sslLock;            /* Lock around sslSessions. */
+static Tcl_HashTable sslSessions;   /* Last TLS session by datasource. */
+#endif
+
+static const char *resultModes[] = { "store", "use", "cursor", NULL };
+static const char *binaryEncodings[] = { "none", "hex", "base64", NULL };
+static const char *sslModes[] = {
+    "default", "disabled", "preferred", "required", "verify_ca", "verify_identity", NULL
+};
+static const char *exportFormats[] = { "csv", "tsv", "json", "ndjson", NULL };
+static const char *statsKinds[] = { "dml", "select", "exec", NULL };
 
 
 static Ns_DbProc mysqlProcs[] = {
@@ -87,6 +799,7 @@ static Ns_DbProc mysqlProcs[] = {
     { DbFn_Cancel,       (ns_funcptr_t) DbCancel },
     { DbFn_Exec,         (ns_funcptr_t) DbExec },
     { DbFn_BindRow,      (ns_funcptr_t) DbBindRow },
+    { DbFn_ResetHandle,  (ns_funcptr_t) DbResetHandle },
     { 0, NULL }
 };
 
@@ -94,7 +807,7 @@ static Ns_DbProc mysqlProcs[] = {
 NS_EXPORT int   Ns_ModuleVersion = 1;
 
 NS_EXPORT int
-Ns_DbDriverInit(const char *driver, const char *UNUSED(path))
+Ns_DbDriverInit(const char *driver, const char *path)
 {
     static int once = 0;
 
@@ -114,6 +827,20 @@ Ns_DbDriverInit(const char *driver, const char *UNUSED(path))
             return NS_ERROR;
         }
         Ns_TlsAlloc(&tls, CleanupThread);
+        Tcl_InitHashTable(&pools, TCL_STRING_KEYS);
+        Ns_MutexSetName2(&poolsLock, "nsdbmysql", "pools");
+        Ns_MutexSetName2(&fanoutLock, "nsdbmysql", "fanout");
+        Ns_CondInit(&fanoutCond);
+        Ns_CondInit(&fanoutQueueCond);
+        fanoutMax = Ns_ConfigIntRange(path, "fanoutthreads", 16, 1, 1024);
+        Ns_MutexSetName2(&explainLock, "nsdbmysql", "explain");
+        Ns_CondInit(&explainCond);
+        Ns_MutexSetName2(&cacheLock, "nsdbmysql", "cache");
+        Tcl_InitHashTable(&cacheTables, TCL_STRING_KEYS);
+#ifdef HAVE_SSL_SESSION_DATA
+        Ns_MutexSetName2(&sslLock, "nsdbmysql", "ssl");
+        Tcl_InitHashTable(&sslSessions, TCL_STRING_KEYS);
+#endif
         Ns_RegisterAtExit(AtExit, NULL);
         Ns_RegisterProcInfo((ns_funcptr_t)AtExit, "nsdbmysql:cleanshutdown", NULL);
     }
@@ -134,13 +861,10 @@ DbType(Ns_DbHandle *UNUSED(handle))
 static int
 DbOpenDb(Ns_DbHandle *handle)
 {
-    MYSQL           *dbh;
-    char            *datasource;
-    char            *host = NULL;
-    char            *database = NULL;
-    char            *port = NULL;
-    char            *unix_port = NULL;
-    unsigned int    tcp_port = 0u;
+    MYSQL          *dbh;
+    Context        *ctx;
+    Pool           *poolPtr;
+    Ns_Time         start;
 
     if (handle == NULL || handle->datasource == NULL) {
         Ns_Log(Error, "nsdbmysql: Invalid connection.");
@@ -149,43 +873,81 @@ DbOpenDb(Ns_DbHandle *handle)
 
     InitThread();
 
-    /* handle->datasource = "host:port:database" */
-    datasource = host = ns_strcopy(handle->datasource);
-    port = strchr(host, ':');
-    if (port != NULL) {
-        *port++ = '\0';
-        database = strchr(port, ':');
-        if (database != NULL) {
-            *database++ = '\0';
-        }
+    poolPtr = GetPool(handle->poolname);
+
+    /*
+     * Take a connection opened at server start, if any is left. Its
+     * setup time is already accounted to the pool. It may have idled
+     * since, so it is checked first; a dead one is replaced by a new
+     * connection.
+     */
+    dbh = NULL;
+    Ns_MutexLock(&poolPtr->lock);
+    if (poolPtr->nwarm > 0 && STREQ(handle->datasource, poolPtr->warmSource)) {
+        dbh = poolPtr->warmConns[--poolPtr->nwarm];
     }
-    if (port == NULL || database == NULL) {
-        Ns_Log(Error, "nsdbmysql: %s: invalid datasource %s", handle->driver, handle->datasource);
-        ns_free(datasource);
-        return NS_ERROR;
+    Ns_MutexUnlock(&poolPtr->lock);
+    if (dbh != NULL && mysql_ping(dbh) != 0) {
+        Ns_Log(Notice, "nsdbmysql: pool %s: warm connection lost: %s", poolPtr->name, mysql_error(dbh));
+        mysql_close(dbh);
+        dbh = NULL;
     }
 
-    if (port[0] == '/') {
-        unix_port = port;
+    if (dbh != NULL) {
+        ctx = ns_calloc(1u, sizeof(Context));
+        Ns_GetTime(&ctx->lastUsed);
     } else {
-        tcp_port = (unsigned int) strtol(port, NULL, 10);
+        Ns_GetTime(&start);
+        dbh = Connect(handle, handle->datasource, poolPtr->localInfile,
+                      poolPtr->compression != NULL && !poolPtr->compressBulk, 0u);
+        if (dbh != NULL && SessionInit(handle, dbh) != NS_OK) {
+            mysql_close(dbh);
+            dbh = NULL;
+        }
+        if (dbh == NULL) {
+            Ns_MutexLock(&poolPtr->lock);
+            poolPtr->retired.connectErrors++;
+            Ns_MutexUnlock(&poolPtr->lock);
+            return NS_ERROR;
+        }
+        ctx = ns_calloc(1u, sizeof(Context));
+        HistogramAdd(SslResumed(dbh) ? &ctx->stats.connectResumed : &ctx->stats.connect, Elapsed(&start));
+        Ns_GetTime(&ctx->lastUsed);
     }
-
-    dbh = mysql_init(NULL);
-    if (dbh == NULL) {
-        Ns_Log(Error, "nsdbmysql: %s: mysql_init() failed", handle->driver);
-        ns_free(datasource);
-        return NS_ERROR;
+    ctx->lostGeneration = poolPtr->lostGeneration;
+    Ns_GetTime(&ctx->wireTime);
+    Tcl_DStringInit(&ctx->digestSql);
+    Tcl_DStringInit(&ctx->txnTables);
+    ctx->primary = dbh;
+    ctx->replica = -1;
+    if (poolPtr->nreplicas > 0) {
+        ctx->replicaConns = ns_calloc((size_t) poolPtr->nreplicas, sizeof(MYSQL *));
+        ctx->replicaDbs = ns_calloc((size_t) poolPtr->nreplicas, sizeof(char *));
+    }
+    ctx->database = strchr(handle->datasource, ':');
+    ctx->database = ns_strdup(ctx->database != NULL && strchr(ctx->database + 1, ':') != NULL
+                              ? strchr(ctx->database + 1, ':') + 1 : "");
+    ctx->poolPtr = poolPtr;
+    ctx->resultMode = ctx->poolPtr->resultMode;
+    ctx->binaryEncoding = ctx->poolPtr->binaryEncoding;
+    Tcl_InitHashTable(&ctx->stmts, TCL_STRING_KEYS);
+    if (poolPtr->localInfile) {
+        /*
+         * Serve LOAD DATA LOCAL only from the source of load_data, never
+         * from files the server asks for.
+         */
+        mysql_set_local_infile_handler(dbh, InfileInit, InfileRead, InfileEnd, InfileError, ctx);
     }
 
-    if (mysql_real_connect(dbh, host, handle->user, handle->password, database, tcp_port, unix_port, 0) == 0) {
-        Log(handle, dbh);
-        mysql_close(dbh);
-        ns_free(datasource);
-        return NS_ERROR;
+    Ns_MutexLock(&ctx->poolPtr->lock);
+    ctx->nextPtr = ctx->poolPtr->firstCtxPtr;
+    if (ctx->nextPtr != NULL) {
+        ctx->nextPtr->prevPtr = ctx;
     }
+    ctx->poolPtr->firstCtxPtr = ctx;
+    Ns_MutexUnlock(&ctx->poolPtr->lock);
 
-    ns_free(datasource);
+    handle->context = (void *) ctx;
     handle->connection = (void *) dbh;
     handle->connected = NS_TRUE;
 
@@ -195,6 +957,9 @@ DbOpenDb(Ns_DbHandle *handle)
 static int
 DbCloseDb(Ns_DbHandle *handle)
 {
+    Context        *ctx;
+    int             i;
+
     if (handle == NULL || handle->connection == NULL) {
         Ns_Log(Error, "nsdbmysql: Invalid connection.");
         return NS_ERROR;
@@ -202,7 +967,77 @@ DbCloseDb(Ns_DbHandle *handle)
 
     InitThread();
 
+    ctx = (Context *) handle->context;
+    if (ctx != NULL) {
+        Pool *poolPtr = ctx->poolPtr;
+
+        /*
+         * Prepared statements die with the connection.
+         */
+        FlushStmts(ctx);
+        Tcl_DeleteHashTable(&ctx->stmts);
+        if (ctx->asyncRes != NULL) {
+            mysql_free_result(ctx->asyncRes);
+        }
+        ns_free(ctx->asyncSql);
+        FlushQuery(handle);
+        Tcl_DStringFree(&ctx->digestSql);
+        if (ctx->cachePtr != NULL) {
+            CacheRelease(poolPtr, ctx->cachePtr);
+        }
+        MemoryRelease(ctx);
+        while (ctx->firstVarPtr != NULL) {
+            SessionVar *varPtr = ctx->firstVarPtr;
+
+            ctx->firstVarPtr = varPtr->nextPtr;
+            ns_free(varPtr->key);
+            ns_free(varPtr->sql);
+            ns_free(varPtr);
+        }
+        CacheBump(&ctx->txnTables);
+        Tcl_DStringFree(&ctx->txnTables);
+        ns_free(ctx->database);
+        RoutePrimary(handle);
+        WireSample(ctx);
+        for (i = 0; i < poolPtr->nreplicas; i++) {
+            if (ctx->replicaConns[i] != NULL) {
+                mysql_close(ctx->replicaConns[i]);
+            }
+            ns_free(ctx->replicaDbs[i]);
+        }
+        ns_free(ctx->replicaConns);
+        ns_free(ctx->replicaDbs);
+        if (ctx->compressConn != NULL) {
+            mysql_close(ctx->compressConn);
+        }
+        ns_free(ctx->compressDb);
+        for (i = 0; i < LAYOUT_CACHE_SIZE; i++) {
+            if (ctx->layouts[i] != NULL) {
+                FreeLayout(ctx->layouts[i]);
+            }
+        }
+
+        Ns_MutexLock(&poolPtr->lock);
+        if (ctx->prevPtr != NULL) {
+            ctx->prevPtr->nextPtr = ctx->nextPtr;
+        } else {
+            poolPtr->firstCtxPtr = ctx->nextPtr;
+        }
+        if (ctx->nextPtr != NULL) {
+            ctx->nextPtr->prevPtr = ctx->prevPtr;
+        }
+        poolPtr->stmtHits += ctx->stmtHits;
+        poolPtr->stmtMisses += ctx->stmtMisses;
+        poolPtr->layoutHits += ctx->layoutHits;
+        poolPtr->layoutMisses += ctx->layoutMisses;
+        StatsSum(&poolPtr->retired, &ctx->stats, 1);
+        Ns_MutexUnlock(&poolPtr->lock);
+    }
+
     mysql_close((MYSQL *) handle->connection);
+    ns_free(handle->context);
+    handle->context = NULL;
+    handle->connection = NULL;
     handle->connected = NS_FALSE;
     return NS_OK;
 }
@@ -210,7 +1045,8 @@ DbCloseDb(Ns_DbHandle *handle)
 static int
 DbDML(Ns_DbHandle *handle, char *sql)
 {
-    int             rc;
+    int             rc, status;
+    Ns_Time         start;
 
     if (sql == NULL) {
         Ns_Log(Error, "nsdbmysql: no sql.");
@@ -224,25 +1060,44 @@ DbDML(Ns_DbHandle *handle, char *sql)
 
     InitThread();
 
-    rc = mysql_query((MYSQL *) handle->connection, sql);
-    Log(handle, (MYSQL *) handle->connection);
+    if (AsyncPending(handle)) {
+        return NS_ERROR;
+    }
 
-    if (rc) {
+    RouteWrite(handle);
+    if (CheckConnection(handle) != NS_OK) {
         return NS_ERROR;
     }
 
-    return NS_OK;
+    Ns_GetTime(&start);
+    rc = mysql_query((MYSQL *) handle->connection, sql);
+    Log(handle, (MYSQL *) handle->connection);
+    if (rc == 0) {
+        SessionTrack((Context *) handle->context, sql);
+    } else if (ConnectionLost(handle)) {
+        /*
+         * The statement may have been executed, so it is not repeated;
+         * the handle is usable again for the next one.
+         */
+        (void) Reconnect(handle);
+    }
+
+    status = (rc == 0) ? DrainResults(handle) : NS_ERROR;
+    StatsQuery(handle, STATS_DML, sql, &start);
+    CacheWrite(handle, sql);
+
+    return status;
 }
 
 static Ns_Set  *
 DbSelect(Ns_DbHandle *handle, char *sql)
 {
-    MYSQL_RES      *result;   
-    MYSQL_FIELD    *fields;
+    MYSQL_RES      *result;
+    Context        *ctx;
     int             rc;
-    size_t          i;
     unsigned int    numcols;
-    Tcl_DString    key;
+    Ns_Time         start;
+    bool            cache;
 
     if (sql == NULL) {
         Ns_Log(Error, "nsdbmysql: no sql.");
@@ -256,58 +1111,96 @@ DbSelect(Ns_DbHandle *handle, char *sql)
 
     InitThread();
 
-    rc = mysql_query((MYSQL *) handle->connection, sql);
+    ctx = (Context *) handle->context;
+
+    if (AsyncPending(handle)) {
+        return NULL;
+    }
+
+    cache = ctx->cacheNext && ctx->poolPtr->cacheMax > 0u;
+    ctx->cacheNext = NS_FALSE;
+    if (cache && CacheLookup(handle, sql)) {
+        return BindColumns(handle, ctx->cachePtr->fields, ctx->cachePtr->ncols);
+    }
+
+    if (CheckConnection(handle) != NS_OK) {
+        return NULL;
+    }
+
+    if (ctx->resultMode == RESULT_CURSOR && !cache) {
+        return CursorOpen(handle, sql);
+    }
+
+    Ns_GetTime(&start);
+    rc = RunQuery(handle, sql);
     Log(handle, (MYSQL *) handle->connection);
 
     if (rc) {
+        StatsQuery(handle, STATS_SELECT, sql, &start);
+        RoutePrimary(handle);
         return NULL;
     }
 
-    result = mysql_store_result((MYSQL *) handle->connection);
+    /*
+     * Results for the cache are buffered as well, so that the memory
+     * limits apply while they are read.
+     */
+    if ((ctx->resultMode == RESULT_STORE && ctx->poolPtr->memLimits) || cache) {
+        StatsQuery(handle, STATS_SELECT, sql, &start);
+        rc = BufferResult(handle, sql);
+        if (rc == NS_END_DATA) {
+            Ns_Log(Error, "DbSelect(%s):  Query did not return rows:  %s", handle->datasource, sql);
+            RoutePrimary(handle);
+        }
+        if (rc != NS_OK) {
+            return NULL;
+        }
+        if (cache) {
+            CacheStore(handle, sql, ctx->cachePtr);
+        }
+        return BindColumns(handle, ctx->cachePtr->fields, ctx->cachePtr->ncols);
+    }
+
+    if (ctx->resultMode == RESULT_USE) {
+        result = mysql_use_result((MYSQL *) handle->connection);
+    } else {
+        result = mysql_store_result((MYSQL *) handle->connection);
+    }
     Log(handle, (MYSQL *) handle->connection);
+    StatsQuery(handle, STATS_SELECT, sql, &start);
 
     if (result == NULL) {
+        RoutePrimary(handle);
         return NULL;
     }
 
     handle->statement = (void *) result;
     handle->fetchingRows = NS_TRUE;
+    ctx->streaming = (ctx->resultMode == RESULT_USE);
 
     numcols = mysql_num_fields((MYSQL_RES *) handle->statement);
     Log(handle, (MYSQL *) handle->connection);
 
     if (numcols == 0u) {
         Ns_Log(Error, "DbSelect(%s):  Query did not return rows:  %s", handle->datasource, sql);
-        mysql_free_result((MYSQL_RES *) handle->statement);
-        handle->statement = NULL;
-        handle->fetchingRows = NS_FALSE;
+        FreeResult(handle, NS_FALSE);
         return NULL;
     }
 
-    numcols = mysql_num_fields((MYSQL_RES *) handle->statement);
-    fields = mysql_fetch_fields((MYSQL_RES *) handle->statement);
-
-    for (i = 0; i < numcols; i++) {
-        Tcl_DStringInit(&key);
-
-        if (include_tablenames && strlen(fields[i].table) > 0) {
-            Ns_DStringVarAppend(&key, fields[i].table, ".", NULL);
-        }
-
-        Tcl_DStringAppend(&key, fields[i].name, TCL_INDEX_NONE);
-        Ns_SetPut((Ns_Set *) handle->row, Ns_DStringValue(&key), NULL);
-        Tcl_DStringFree(&key);
-    }
-
-    return (Ns_Set *) handle->row;
+    return BindColumns(handle, mysql_fetch_fields(result), numcols);
 }
 
 static int
 DbGetRow(Ns_DbHandle *handle, Ns_Set *row)
 {
-    MYSQL_ROW       my_row;
+    char          **values;
+    unsigned long  *lengths;
     size_t          i;
     unsigned int    numcols;
+    int             rc;
+    const Context  *ctx = (Context *) handle->context;
+    const MYSQL_FIELD *fields;
+    Tcl_DString     ds;
 
     if (handle->fetchingRows == NS_FALSE) {
         Ns_Log(Error, "DbGetRow(%s):  No rows waiting to fetch.", handle->datasource);
@@ -316,86 +1209,385 @@ DbGetRow(Ns_DbHandle *handle, Ns_Set *row)
 
     InitThread();
 
-    numcols = mysql_num_fields((MYSQL_RES *) handle->statement);
-    Log(handle, (MYSQL *) handle->connection);
-
-    if (numcols == 0) {
-        mysql_free_result((MYSQL_RES *) handle->statement);
-        handle->statement = NULL;
-        handle->fetchingRows = NS_FALSE;
-        return NS_ERROR;
+    rc = FetchRow(handle, &fields, &numcols, &values, &lengths);
+    if (rc != NS_OK) {
+        return rc;
     }
 
     if (numcols != Ns_SetSize(row)) {
         Ns_Log(Error, "DbGetRow: Number of columns in row (%ld)"
                       " not equal to number of columns in row fetched (%d).",
                       Ns_SetSize(row), numcols);
-        mysql_free_result((MYSQL_RES *) handle->statement);
-        handle->statement = NULL;
-        handle->fetchingRows = NS_FALSE;
+        FreeResult(handle, NS_FALSE);
         return NS_ERROR;
     }
 
-    my_row = mysql_fetch_row((MYSQL_RES *) handle->statement);
-    Log(handle, (MYSQL *) handle->connection);
-
-    if (my_row == NULL) {
-        mysql_free_result((MYSQL_RES *) handle->statement);
-        handle->statement = NULL;
-        handle->fetchingRows = NS_FALSE;
-        return NS_END_DATA;
-    }
-
+    /*
+     * The row set is owned by the caller and outlives the result, so
+     * the values have to be copied. Pass the lengths the client
+     * library already has, which saves the strlen() per cell, keeps
+     * binary values with embedded NULs intact and lets the set store
+     * the value in its own buffer, reusing the space of the previous
+     * row where it fits.
+     */
+    Tcl_DStringInit(&ds);
     for (i = 0; i < numcols; i++) {
-        if (my_row[i] == NULL) {
-            Ns_SetPutValue(row, i, "");
+        if (values[i] == NULL) {
+            Ns_SetPutValueSz(row, i, "", 0);
+        } else if (ctx->binaryEncoding != BINARY_NONE && IsBinaryField(&fields[i])) {
+            Tcl_DStringSetLength(&ds, 0);
+            EncodeBinary(&ds, ctx->binaryEncoding, (const unsigned char *) values[i], lengths[i]);
+            Ns_SetPutValueSz(row, i, Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
         } else {
-            Ns_SetPutValue(row, i, my_row[i]);
+            Ns_SetPutValueSz(row, i, values[i], (TCL_SIZE_T) lengths[i]);
         }
     }
+    Tcl_DStringFree(&ds);
 
     return NS_OK;
 }
 
-static int
-DbGetRowCount(Ns_DbHandle *handle)
-{
-    if (handle != NULL && handle->connection != NULL) {
-        InitThread();
-
-        return (int)mysql_affected_rows((MYSQL *) handle->connection);
-    }
-    return NS_ERROR;
-}
-
-static int
-DbFlush(Ns_DbHandle *handle)
-{
-    return DbCancel(handle);
-}
+/*
+ *----------------------------------------------------------------------
+ *
+ * CursorOpen --
+ *
+ *      Run a query of DbSelect in cursor mode: as prepared statement
+ *      with a read-only server-side cursor, from which FetchRow reads
+ *      prefetchrows rows per round-trip. Only one batch of rows is held
+ *      in client memory, and the connection is free for other
+ *      statements between the fetches.
+ *
+ * Results:
+ *      The row set of the handle, or NULL on error.
+ *
+ * Side effects:
+ *      The statement is closed by FreeResult, which closes the cursor.
+ *
+ *----------------------------------------------------------------------
+ */
 
-static int
-DbCancel(Ns_DbHandle *handle)
+static Ns_Set *
+CursorOpen(Ns_DbHandle *handle, const char *sql)
 {
-    if (handle == NULL || handle->connection == NULL) {
-        Ns_Log(Error, "nsdbmysql: Invalid connection.");
-        return NS_ERROR;
+    Context        *ctx = (Context *) handle->context;
+    MYSQL_STMT     *stmt;
+    MYSQL_RES      *meta = NULL;
+    unsigned long   cursorType = (unsigned long) CURSOR_TYPE_READ_ONLY;
+    unsigned int    ncols;
+    Ns_Time         start;
+
+    RoutePrimary(handle);
+    stmt = mysql_stmt_init((MYSQL *) handle->connection);
+    if (stmt == NULL) {
+        Log(handle, (MYSQL *) handle->connection);
+        return NULL;
     }
 
-    InitThread();
-
-    if (handle->fetchingRows == NS_TRUE) {
-        MYSQL_RES      *result;
-
-        result = (MYSQL_RES *) handle->statement;
-        if (result != NULL) {
-            mysql_free_result(result);
+    Ns_GetTime(&start);
+    if (mysql_stmt_prepare(stmt, sql, (unsigned long) strlen(sql)) != 0
+        || mysql_stmt_attr_set(stmt, STMT_ATTR_CURSOR_TYPE, &cursorType) != 0
+        || mysql_stmt_attr_set(stmt, STMT_ATTR_PREFETCH_ROWS, &ctx->poolPtr->prefetchRows) != 0
+        || mysql_stmt_execute(stmt) != 0
+        || (meta = mysql_stmt_result_metadata(stmt)) == NULL) {
+        if (mysql_stmt_errno(stmt) != 0u) {
+            StatsError(&ctx->stats, mysql_stmt_errno(stmt));
+            (void) StmtError(NULL, handle, stmt);
+        } else {
+            Ns_Log(Error, "DbSelect(%s):  Query did not return rows:  %s", handle->datasource, sql);
         }
-        handle->statement = NULL;
-        handle->fetchingRows = NS_FALSE;
+        StatsQuery(handle, STATS_SELECT, sql, &start);
+        (void) mysql_stmt_close(stmt);
+        return NULL;
+    }
+    StatsQuery(handle, STATS_SELECT, sql, &start);
+
+    ncols = mysql_num_fields(meta);
+    if (BindResult(stmt, &ctx->cursorBind, mysql_fetch_fields(meta), ncols, NS_FALSE) != 0) {
+        (void) StmtError(NULL, handle, stmt);
+        FreeBindings(&ctx->cursorBind);
+        mysql_free_result(meta);
+        (void) mysql_stmt_close(stmt);
+        return NULL;
     }
+    ctx->cursor = stmt;
+    ctx->cursorValues = ns_calloc(ncols, sizeof(char *));
+    handle->statement = (void *) meta;
+    handle->fetchingRows = NS_TRUE;
 
-    return NS_OK;
+    return BindColumns(handle, mysql_fetch_fields(meta), ncols);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FetchRow --
+ *
+ *      Fetch the next row of the open result of the handle, either
+ *      from the server or from the result cache, for DbGetRow and
+ *      "ns_mysql fetch".
+ *
+ * Results:
+ *      NS_OK with the column metadata, values (NULL for SQL NULL) and
+ *      lengths of the row, valid until the next fetch; NS_END_DATA or
+ *      NS_ERROR.
+ *
+ * Side effects:
+ *      The result is freed after the last row or on error.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+FetchRow(Ns_DbHandle *handle, const MYSQL_FIELD **fieldsPtr, unsigned int *ncolsPtr,
+         char ***valuesPtr, unsigned long **lengthsPtr)
+{
+    Context        *ctx = (Context *) handle->context;
+    MYSQL_RES      *result = (MYSQL_RES *) handle->statement;
+    char          **values;
+    unsigned long  *lengths;
+    unsigned int    i, ncols;
+    Ns_Time         start;
+
+    if (ctx->cachePtr != NULL) {
+        const CacheEntry *entryPtr = ctx->cachePtr;
+
+        if (ctx->cacheRow >= entryPtr->nrows) {
+            FreeResult(handle, NS_FALSE);
+            return NS_END_DATA;
+        }
+        ncols = entryPtr->ncols;
+        *fieldsPtr = entryPtr->fields;
+        values = entryPtr->values + ctx->cacheRow * ncols;
+        lengths = entryPtr->lengths + ctx->cacheRow * ncols;
+        ctx->cacheRow++;
+
+    } else if (ctx->cursor != NULL) {
+        int rc;
+
+        ncols = ctx->cursorBind.ncols;
+        Ns_GetTime(&start);
+        rc = FetchBound(ctx->cursor, &ctx->cursorBind);
+        ctx->fetchTime += Elapsed(&start);
+        if (rc != 0) {
+            if (rc == MYSQL_NO_DATA) {
+                rc = NS_END_DATA;
+            } else {
+                StatsError(&ctx->stats, mysql_stmt_errno(ctx->cursor));
+                (void) StmtError(NULL, handle, ctx->cursor);
+                rc = NS_ERROR;
+            }
+            FreeResult(handle, NS_FALSE);
+            return rc;
+        }
+        for (i = 0u; i < ncols; i++) {
+            unsigned long length;
+
+            ctx->cursorValues[i] = (char *) BoundValue(ctx->cursor, &ctx->cursorBind, i, &length);
+        }
+        *fieldsPtr = mysql_fetch_fields(result);
+        values = ctx->cursorValues;
+        lengths = ctx->cursorBind.lengths;
+
+    } else {
+        ncols = mysql_num_fields(result);
+        Log(handle, (MYSQL *) handle->connection);
+
+        if (ncols == 0u) {
+            FreeResult(handle, NS_FALSE);
+            return NS_ERROR;
+        }
+
+        Ns_GetTime(&start);
+        values = mysql_fetch_row(result);
+        ctx->fetchTime += Elapsed(&start);
+        Log(handle, (MYSQL *) handle->connection);
+
+        if (values == NULL) {
+            unsigned int nErr = mysql_errno((MYSQL *) handle->connection);
+            int          rc;
+
+            /*
+             * On an unbuffered result, a NULL row may also signal an
+             * error while reading from the server.
+             */
+            if (nErr != 0u) {
+                StatsError(&ctx->stats, nErr);
+                rc = NS_ERROR;
+            } else {
+                rc = NS_END_DATA;
+            }
+            FreeResult(handle, NS_FALSE);
+            return rc;
+        }
+        *fieldsPtr = mysql_fetch_fields(result);
+        lengths = mysql_fetch_lengths(result);
+    }
+
+    for (i = 0u; i < ncols; i++) {
+        ctx->stats.bytes += lengths[i];
+        if (ctx->compressing) {
+            ctx->stats.compressedBytes += lengths[i];
+        }
+    }
+    ctx->stats.rows++;
+
+    *ncolsPtr = ncols;
+    *valuesPtr = values;
+    *lengthsPtr = lengths;
+
+    return NS_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EncodeBinary --
+ *
+ *      Append a binary value as lowercase hex digits or as base64
+ *      (RFC 4648, padded, without line breaks).
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Grows the DString.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+EncodeBinary(Tcl_DString *dsPtr, BinaryEncoding encoding, const unsigned char *value, unsigned long length)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+    static const char b64Digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    TCL_SIZE_T    offset = Tcl_DStringLength(dsPtr);
+    char         *p;
+    unsigned long i;
+
+    if (encoding == BINARY_HEX) {
+        Tcl_DStringSetLength(dsPtr, offset + (TCL_SIZE_T) (length * 2u));
+        p = Tcl_DStringValue(dsPtr) + offset;
+        for (i = 0u; i < length; i++) {
+            *p++ = hexDigits[value[i] >> 4];
+            *p++ = hexDigits[value[i] & 0x0fu];
+        }
+        return;
+    }
+
+    Tcl_DStringSetLength(dsPtr, offset + (TCL_SIZE_T) ((length + 2u) / 3u * 4u));
+    p = Tcl_DStringValue(dsPtr) + offset;
+    for (i = 0u; i + 2u < length; i += 3u) {
+        *p++ = b64Digits[value[i] >> 2];
+        *p++ = b64Digits[((value[i] & 0x03u) << 4) | (value[i + 1u] >> 4)];
+        *p++ = b64Digits[((value[i + 1u] & 0x0fu) << 2) | (value[i + 2u] >> 6)];
+        *p++ = b64Digits[value[i + 2u] & 0x3fu];
+    }
+    if (i < length) {
+        *p++ = b64Digits[value[i] >> 2];
+        if (i + 1u < length) {
+            *p++ = b64Digits[((value[i] & 0x03u) << 4) | (value[i + 1u] >> 4)];
+            *p++ = b64Digits[(value[i + 1u] & 0x0fu) << 2];
+        } else {
+            *p++ = b64Digits[(value[i] & 0x03u) << 4];
+            *p++ = '=';
+        }
+        *p = '=';
+    }
+}
+
+static int
+DbGetRowCount(Ns_DbHandle *handle)
+{
+    if (handle != NULL && handle->connection != NULL) {
+        const Context *ctx = (Context *) handle->context;
+
+        InitThread();
+
+        if (ctx != NULL && ctx->cachePtr != NULL) {
+            return (int) ctx->cachePtr->nrows;
+        }
+
+        return (int)mysql_affected_rows((MYSQL *) handle->connection);
+    }
+    return NS_ERROR;
+}
+
+static int
+DbFlush(Ns_DbHandle *handle)
+{
+    if (handle == NULL || handle->connection == NULL) {
+        Ns_Log(Error, "nsdbmysql: Invalid connection.");
+        return NS_ERROR;
+    }
+
+    InitThread();
+
+    AsyncAbort(handle);
+    if (handle->fetchingRows == NS_TRUE) {
+        FreeResult(handle, NS_FALSE);
+    }
+
+    return NS_OK;
+}
+
+static int
+DbCancel(Ns_DbHandle *handle)
+{
+    if (handle == NULL || handle->connection == NULL) {
+        Ns_Log(Error, "nsdbmysql: Invalid connection.");
+        return NS_ERROR;
+    }
+
+    InitThread();
+
+    AsyncAbort(handle);
+    if (handle->fetchingRows == NS_TRUE) {
+        FreeResult(handle, NS_TRUE);
+    }
+
+    return NS_OK;
+}
+
+static int
+DbResetHandle(Ns_DbHandle *handle)
+{
+    Context        *ctx;
+
+    if (handle == NULL || handle->context == NULL) {
+        return NS_OK;
+    }
+
+    /*
+     * Drop per-handle overrides set via ns_mysql before the handle goes
+     * back to the pool.
+     */
+    ctx = (Context *) handle->context;
+    ctx->resultMode = ctx->poolPtr->resultMode;
+    ctx->binaryEncoding = ctx->poolPtr->binaryEncoding;
+    ctx->cacheNext = NS_FALSE;
+    ctx->compressNext = NS_FALSE;
+    ctx->pinPrimary = NS_FALSE;
+
+    /*
+     * Sampling the bytes sent by the server costs a round trip, so it
+     * is done at most every WIRE_INTERVAL seconds, and when the handle
+     * is closed.
+     */
+    if (ctx->compressUsed[0] || ctx->compressUsed[1]) {
+        Ns_Time now, due, diff;
+
+        Ns_GetTime(&now);
+        due = ctx->wireTime;
+        Ns_IncrTime(&due, WIRE_INTERVAL, 0);
+        if (Ns_DiffTime(&now, &due, &diff) >= 0) {
+            ctx->wireTime = now;
+            WireSample(ctx);
+        }
+    }
+
+    return NS_OK;
 }
 
 
@@ -403,8 +1595,11 @@ static int
 DbExec(Ns_DbHandle *handle, char *sql)
 {
     MYSQL_RES      *result;
+    Context        *ctx;
     int             rc;
     unsigned int    numcols, fieldcount;
+    Ns_Time         start;
+    bool            cache;
 
     if (sql == NULL) {
         Ns_Log(Error, "nsdbmysql: no sql.");
@@ -418,22 +1613,72 @@ DbExec(Ns_DbHandle *handle, char *sql)
 
     InitThread();
 
-    rc = mysql_query((MYSQL *) handle->connection, sql);
+    ctx = (Context *) handle->context;
+
+    if (AsyncPending(handle)) {
+        return NS_ERROR;
+    }
+
+    cache = ctx->cacheNext && ctx->poolPtr->cacheMax > 0u;
+    ctx->cacheNext = NS_FALSE;
+    if (cache && CacheLookup(handle, sql)) {
+        return NS_ROWS;
+    }
+
+    if (CheckConnection(handle) != NS_OK) {
+        return NS_ERROR;
+    }
+
+    Ns_GetTime(&start);
+    rc = RunQuery(handle, sql);
     Log(handle, (MYSQL *) handle->connection);
+    if (rc == 0) {
+        SessionTrack(ctx, sql);
+    }
 
     if (rc) {
+        StatsQuery(handle, STATS_EXEC, sql, &start);
+        RoutePrimary(handle);
+        CacheWrite(handle, sql);
         return NS_ERROR;
     }
 
-    result = mysql_store_result((MYSQL *) handle->connection);
+    if ((ctx->resultMode == RESULT_STORE && ctx->poolPtr->memLimits) || cache) {
+        StatsQuery(handle, STATS_EXEC, sql, &start);
+        rc = BufferResult(handle, sql);
+        if (rc == NS_OK) {
+            if (cache) {
+                CacheStore(handle, sql, ctx->cachePtr);
+            }
+            return NS_ROWS;
+        } else if (rc == NS_ERROR) {
+            return NS_ERROR;
+        }
+        CacheWrite(handle, sql);
+        rc = DrainResults(handle);
+        RoutePrimary(handle);
+        return (rc == NS_OK) ? NS_DML : NS_ERROR;
+    }
+
+    if (ctx->resultMode == RESULT_USE) {
+        result = mysql_use_result((MYSQL *) handle->connection);
+    } else {
+        result = mysql_store_result((MYSQL *) handle->connection);
+    }
     Log(handle, (MYSQL *) handle->connection);
+    StatsQuery(handle, STATS_EXEC, sql, &start);
+    if (result == NULL) {
+        CacheWrite(handle, sql);
+    }
 
     fieldcount = mysql_field_count((MYSQL *) handle->connection);
     Log(handle, (MYSQL *) handle->connection);
 
     if (result == NULL) {
-    	if (fieldcount == 0) {	
-    	    return NS_DML;
+        rc = DrainResults(handle);
+        RoutePrimary(handle);
+    	if (fieldcount == 0) {
+    	    return (rc == NS_OK) ? NS_DML : NS_ERROR;
     	} else {
     	    Ns_Log(Error, "nsdbmysql: DbExec() has columns but result set is NULL");
     	    return NS_ERROR;
@@ -446,10 +1691,13 @@ DbExec(Ns_DbHandle *handle, char *sql)
     if (numcols != 0) {
         handle->statement = (void *) result;
         handle->fetchingRows = NS_TRUE;
+        ctx->streaming = (ctx->resultMode == RESULT_USE);
         return NS_ROWS;
     } else {
         mysql_free_result(result);
-        return NS_DML;
+        rc = DrainResults(handle);
+        RoutePrimary(handle);
+        return (rc == NS_OK) ? NS_DML : NS_ERROR;
     }
 
     /* How did we get here? */
@@ -459,110 +1707,6993 @@ DbExec(Ns_DbHandle *handle, char *sql)
 static Ns_Set  *
 DbBindRow(Ns_DbHandle *handle)
 {
-    MYSQL_FIELD    *fields;
-    unsigned int    i;
-    unsigned int    numcols;
-    Tcl_DString    key;
+    const Context  *ctx;
 
-    if (handle == NULL || handle->statement == NULL) {
+    if (handle == NULL || handle->context == NULL) {
         Ns_Log(Error, "nsdbmysql: Invalid connection.");
         return NULL;
     }
 
     InitThread();
 
-    numcols = mysql_num_fields((MYSQL_RES *) handle->statement);
+    ctx = (Context *) handle->context;
+    if (ctx->cachePtr != NULL) {
+        return BindColumns(handle, ctx->cachePtr->fields, ctx->cachePtr->ncols);
+    }
+    if (handle->statement == NULL) {
+        Ns_Log(Error, "nsdbmysql: Invalid connection.");
+        return NULL;
+    }
 
-    fields = mysql_fetch_fields((MYSQL_RES *) handle->statement);
+    return BindColumns(handle, mysql_fetch_fields((MYSQL_RES *) handle->statement),
+                       mysql_num_fields((MYSQL_RES *) handle->statement));
+}
 
-    for (i = 0; i < numcols; i++) {
-        Tcl_DStringInit(&key);
+/*
+ *----------------------------------------------------------------------
+ *
+ * BindColumns --
+ *
+ *      Add the column names of the result as keys to the row set of
+ *      the handle. The keys are taken from the layout cache, so the
+ *      names (optionally prefixed by the table name) are built only
+ *      once per distinct result layout.
+ *
+ * Results:
+ *      The row set of the handle.
+ *
+ * Side effects:
+ *      May add a layout to the cache of the handle.
+ *
+ *----------------------------------------------------------------------
+ */
 
-        if (include_tablenames && strlen(fields[i].table) > 0) {
-            Ns_DStringVarAppend(&key, fields[i].table, ".", NULL);
-        }
+static Ns_Set *
+BindColumns(Ns_DbHandle *handle, const MYSQL_FIELD *fields, unsigned int ncols)
+{
+    Ns_Set         *row = (Ns_Set *) handle->row;
+    const Layout   *layoutPtr;
+    const char     *keys;
+    unsigned int    i;
 
-        Tcl_DStringAppend(&key, fields[i].name, TCL_INDEX_NONE);
-        Ns_SetPut((Ns_Set *) handle->row, Ns_DStringValue(&key), NULL);
-        Tcl_DStringFree(&key);
+    layoutPtr = GetLayout((Context *) handle->context, fields, ncols);
+    keys = Tcl_DStringValue(&layoutPtr->keys);
+
+    for (i = 0u; i < layoutPtr->ncols; i++) {
+        (void) Ns_SetPutSz(row, keys + layoutPtr->offsets[i], layoutPtr->lengths[i], NULL, 0);
     }
 
-    return (Ns_Set *) handle->row;
+    return row;
 }
 
-/* ************************************************************ */
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetLayout --
+ *
+ *      Return the column key layout for the given result fields. The
+ *      layouts are kept in a small direct-mapped cache per handle,
+ *      indexed by a hash over the column and table names. The hash is
+ *      computed from the field metadata without copying it.
+ *
+ * Results:
+ *      Layout.
+ *
+ * Side effects:
+ *      Updates the layout hit and miss counters of the handle. A
+ *      colliding older layout is replaced.
+ *
+ *----------------------------------------------------------------------
+ */
 
-static int 
-DbList_Dbs(Tcl_Interp *interp, const char *wild, Ns_DbHandle *handle)
+static Layout *
+GetLayout(Context *ctx, const MYSQL_FIELD *fields, unsigned int ncols)
 {
-    MYSQL_RES      *result;
-    MYSQL_ROW       row;
-    unsigned int    numcols;
+    Layout         *layoutPtr;
+    uint32_t        hash = 2166136261u;
+    unsigned int    i, j, slot;
+    bool            tablenames = (include_tablenames != 0);
+
+    for (i = 0u; i < ncols; i++) {
+        for (j = 0u; j < fields[i].name_length; j++) {
+            hash = (hash ^ (unsigned char) fields[i].name[j]) * 16777619u;
+        }
+        hash = (hash ^ 0xffu) * 16777619u;
+        if (tablenames) {
+            for (j = 0u; j < fields[i].table_length; j++) {
+                hash = (hash ^ (unsigned char) fields[i].table[j]) * 16777619u;
+            }
+            hash = (hash ^ 0xfeu) * 16777619u;
+        }
+    }
+
+    slot = hash % LAYOUT_CACHE_SIZE;
+    layoutPtr = ctx->layouts[slot];
+    if (layoutPtr != NULL
+        && layoutPtr->hash == hash
+        && layoutPtr->tablenames == tablenames
+        && LayoutMatches(layoutPtr, fields, ncols)) {
+        ctx->layoutHits++;
+        return layoutPtr;
+    }
+    ctx->layoutMisses++;
+
+    if (layoutPtr != NULL) {
+        FreeLayout(layoutPtr);
+    }
+    layoutPtr = ns_malloc(sizeof(Layout));
+    layoutPtr->hash = hash;
+    layoutPtr->ncols = ncols;
+    layoutPtr->tablenames = tablenames;
+    layoutPtr->offsets = ns_malloc(sizeof(TCL_SIZE_T) * (ncols + 1u));
+    layoutPtr->lengths = ns_malloc(sizeof(TCL_SIZE_T) * (ncols + 1u));
+    Tcl_DStringInit(&layoutPtr->keys);
+
+    for (i = 0u; i < ncols; i++) {
+        Tcl_DString *dsPtr = &layoutPtr->keys;
+
+        layoutPtr->offsets[i] = Tcl_DStringLength(dsPtr);
+        if (tablenames && fields[i].table_length > 0u) {
+            Tcl_DStringAppend(dsPtr, fields[i].table, (TCL_SIZE_T) fields[i].table_length);
+            Tcl_DStringAppend(dsPtr, ".", 1);
+        }
+        Tcl_DStringAppend(dsPtr, fields[i].name, (TCL_SIZE_T) fields[i].name_length);
+        layoutPtr->lengths[i] = Tcl_DStringLength(dsPtr) - layoutPtr->offsets[i];
+        /*
+         * Keep the keys NUL separated.
+         */
+        Tcl_DStringAppend(dsPtr, "", 1);
+    }
+    ctx->layouts[slot] = layoutPtr;
+
+    return layoutPtr;
+}
+
+static bool
+LayoutMatches(const Layout *layoutPtr, const MYSQL_FIELD *fields, unsigned int ncols)
+{
+    const char     *keys = Tcl_DStringValue(&layoutPtr->keys);
     unsigned int    i;
 
-    if (handle == NULL || handle->connection == NULL) {
-        Ns_Log(Error, "nsdbmysql: Invalid connection.");
-        return NS_ERROR;
+    if (layoutPtr->ncols != ncols) {
+        return NS_FALSE;
+    }
+    for (i = 0u; i < ncols; i++) {
+        const char   *key = keys + layoutPtr->offsets[i];
+        size_t        length = (size_t) layoutPtr->lengths[i];
+
+        if (layoutPtr->tablenames && fields[i].table_length > 0u) {
+            size_t tableLength = fields[i].table_length;
+
+            if (length != tableLength + 1u + fields[i].name_length
+                || memcmp(key, fields[i].table, tableLength) != 0
+                || key[tableLength] != '.') {
+                return NS_FALSE;
+            }
+            key += tableLength + 1u;
+            length -= tableLength + 1u;
+        }
+        if (length != fields[i].name_length
+            || memcmp(key, fields[i].name, length) != 0) {
+            return NS_FALSE;
+        }
     }
+    return NS_TRUE;
+}
 
-    InitThread();
+static void
+FreeLayout(Layout *layoutPtr)
+{
+    Tcl_DStringFree(&layoutPtr->keys);
+    ns_free(layoutPtr->offsets);
+    ns_free(layoutPtr->lengths);
+    ns_free(layoutPtr);
+}
 
-    result = mysql_list_dbs((MYSQL *) handle->connection, wild);
-    Log(handle, (MYSQL *) handle->connection);
+/*
+ *----------------------------------------------------------------------
+ *
+ * Connect --
+ *
+ *      Open a new connection to the server named in the datasource,
+ *      either that of the handle or of one of the replicas of its pool,
+ *      with the credentials of the handle. Used for the handle
+ *      connections as well as for short-lived side connections. Only
+ *      the primary connections of handles are opened with localInfile,
+ *      for "ns_mysql load_data". With compress, the protocol compression
+ *      of the pool is used. A timeout (seconds) overrides the connect
+ *      timeout of the pool.
+ *
+ * Results:
+ *      MySQL connection or NULL on error.
+ *
+ * Side effects:
+ *      Errors are logged.
+ *
+ *----------------------------------------------------------------------
+ */
 
-    if (result == NULL) {
-        Tcl_AppendResult(interp, "mysql_list_dbs failed.", NULL);
-        return TCL_ERROR;
+static MYSQL *
+Connect(Ns_DbHandle *handle, const char *source, bool localInfile, bool compress, unsigned int timeout)
+{
+    MYSQL           *dbh;
+    char            *datasource;
+    char            *host = NULL;
+    char            *database = NULL;
+    char            *port = NULL;
+    char            *unix_port = NULL;
+    unsigned int    tcp_port = 0u;
+    unsigned long   flags = 0u;
+    const Pool     *poolPtr = GetPool(handle->poolname);
+    char           *session = NULL;
+
+    /* source = "host:port:database" */
+    datasource = host = ns_strcopy(source);
+    port = strchr(host, ':');
+    if (port != NULL) {
+        *port++ = '\0';
+        database = strchr(port, ':');
+        if (database != NULL) {
+            *database++ = '\0';
+        }
+    }
+    if (port == NULL || database == NULL) {
+        Ns_Log(Error, "nsdbmysql: %s: invalid datasource %s", handle->driver, source);
+        ns_free(datasource);
+        return NULL;
     }
 
-    numcols = mysql_num_fields(result);
-    Log(handle, (MYSQL *) handle->connection);
+    if (port[0] == '/') {
+        unix_port = port;
+    } else {
+        tcp_port = (unsigned int) strtol(port, NULL, 10);
+    }
 
-    while ((row = mysql_fetch_row(result)) != NULL) {
-        for (i = 0; i < numcols; i++) {
-            Tcl_AppendElement(interp, row[i]);
+    dbh = mysql_init(NULL);
+    if (dbh == NULL) {
+        Ns_Log(Error, "nsdbmysql: %s: mysql_init() failed", handle->driver);
+        ns_free(datasource);
+        return NULL;
+    }
+
+    if (poolPtr->multiStatements) {
+        flags |= CLIENT_MULTI_STATEMENTS | CLIENT_MULTI_RESULTS;
+    }
+    if (localInfile) {
+        unsigned int on = 1u;
+
+        (void) mysql_options(dbh, MYSQL_OPT_LOCAL_INFILE, &on);
+    }
+    if (poolPtr->charset != NULL) {
+        (void) mysql_options(dbh, MYSQL_SET_CHARSET_NAME, poolPtr->charset);
+    }
+    ConnectOptions(dbh, poolPtr, compress);
+    if (timeout > 0u) {
+        (void) mysql_options(dbh, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+    }
+#ifdef HAVE_SSL_SESSION_DATA
+    if (poolPtr->sslSessions && poolPtr->sslMode != SSLMODE_DISABLED) {
+        session = SslSessionGet(source);
+        if (session != NULL) {
+            (void) mysql_options(dbh, MYSQL_OPT_SSL_SESSION_DATA, session);
         }
     }
-    mysql_free_result(result);
+#endif
 
-    return TCL_OK;
-}
+    if (mysql_real_connect(dbh, host, handle->user, handle->password, database, tcp_port, unix_port, flags) == 0) {
+        Log(handle, dbh);
+        mysql_close(dbh);
+        ns_free(datasource);
+        ns_free(session);
+        return NULL;
+    }
+#ifdef HAVE_SSL_SESSION_DATA
+    if (poolPtr->sslSessions && poolPtr->sslMode != SSLMODE_DISABLED) {
+        SslSessionPut(dbh, source);
+    }
+#endif
+
+    ns_free(datasource);
+    ns_free(session);
+    return dbh;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConnectOptions --
+ *
+ *      Set the TLS, timeout and (with compress) compression options of
+ *      the pool on a connection before it is opened.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ConnectOptions(MYSQL *mysql, const Pool *poolPtr, bool compress)
+{
+    if (compress) {
+#ifdef HAVE_COMPRESSION_ALGORITHMS
+        (void) mysql_options(mysql, MYSQL_OPT_COMPRESSION_ALGORITHMS, poolPtr->compression);
+        if (poolPtr->zstdLevel > 0u) {
+            (void) mysql_options(mysql, MYSQL_OPT_ZSTD_COMPRESSION_LEVEL, &poolPtr->zstdLevel);
+        }
+#else
+        (void) mysql_options(mysql, MYSQL_OPT_COMPRESS, NULL);
+#endif
+    }
+    if (poolPtr->connectTimeout > 0u) {
+        (void) mysql_options(mysql, MYSQL_OPT_CONNECT_TIMEOUT, &poolPtr->connectTimeout);
+    }
+    if (poolPtr->readTimeout > 0u) {
+        (void) mysql_options(mysql, MYSQL_OPT_READ_TIMEOUT, &poolPtr->readTimeout);
+    }
+    if (poolPtr->writeTimeout > 0u) {
+        (void) mysql_options(mysql, MYSQL_OPT_WRITE_TIMEOUT, &poolPtr->writeTimeout);
+    }
+
+#ifdef MARIADB_BASE_VERSION
+    /*
+     * MariaDB uses TLS when TLS options are set, so "disabled" leaves
+     * them out.
+     */
+    if (poolPtr->sslMode == SSLMODE_DISABLED) {
+        return;
+    }
+#endif
+    if (poolPtr->sslCa != NULL) {
+        (void) mysql_options(mysql, MYSQL_OPT_SSL_CA, poolPtr->sslCa);
+    }
+    if (poolPtr->sslCaPath != NULL) {
+        (void) mysql_options(mysql, MYSQL_OPT_SSL_CAPATH, poolPtr->sslCaPath);
+    }
+    if (poolPtr->sslCert != NULL) {
+        (void) mysql_options(mysql, MYSQL_OPT_SSL_CERT, poolPtr->sslCert);
+    }
+    if (poolPtr->sslKey != NULL) {
+        (void) mysql_options(mysql, MYSQL_OPT_SSL_KEY, poolPtr->sslKey);
+    }
+    if (poolPtr->sslCipher != NULL) {
+        (void) mysql_options(mysql, MYSQL_OPT_SSL_CIPHER, poolPtr->sslCipher);
+    }
+
+#ifdef MARIADB_BASE_VERSION
+    /*
+     * MariaDB has no ssl mode; it enforces TLS and verifies the server
+     * certificate (including the host name) on request.
+     */
+    if (poolPtr->sslMode >= SSLMODE_REQUIRED) {
+        my_bool on = 1;
+
+        (void) mysql_options(mysql, MYSQL_OPT_SSL_ENFORCE, &on);
+        if (poolPtr->sslMode >= SSLMODE_VERIFY_CA) {
+            (void) mysql_options(mysql, MYSQL_OPT_SSL_VERIFY_SERVER_CERT, &on);
+        }
+    }
+#else
+    if (poolPtr->sslMode != SSLMODE_DEFAULT) {
+        unsigned int mode = (unsigned int) SSL_MODE_DISABLED
+            + (unsigned int) (poolPtr->sslMode - SSLMODE_DISABLED);
+
+        (void) mysql_options(mysql, MYSQL_OPT_SSL_MODE, &mode);
+    }
+#endif
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SslSessionGet, SslSessionPut, SslResumed --
+ *
+ *      Cache of the TLS session of the last connection to each
+ *      datasource. A new connection offers the session to the server,
+ *      which saves the full handshake when the server accepts it.
+ *      SslResumed tells whether this was the case for a connection.
+ *
+ * Results:
+ *      SslSessionGet: copy of the session data (to be freed by the
+ *      caller) or NULL.
+ *
+ * Side effects:
+ *      SslSessionPut replaces the cached session of the datasource.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#ifdef HAVE_SSL_SESSION_DATA
+static char *
+SslSessionGet(const char *datasource)
+{
+    Tcl_HashEntry  *hPtr;
+    char           *session = NULL;
+
+    Ns_MutexLock(&sslLock);
+    hPtr = Tcl_FindHashEntry(&sslSessions, datasource);
+    if (hPtr != NULL) {
+        session = ns_strdup(Tcl_GetHashValue(hPtr));
+    }
+    Ns_MutexUnlock(&sslLock);
+
+    return session;
+}
+
+static void
+SslSessionPut(MYSQL *mysql, const char *datasource)
+{
+    Tcl_HashEntry  *hPtr;
+    void           *data;
+    unsigned int    length = 0u;
+    char           *session;
+    int             isNew;
+
+    data = mysql_get_ssl_session_data(mysql, 0u, &length);
+    if (data == NULL) {
+        return;
+    }
+    session = ns_malloc((size_t) length + 1u);
+    memcpy(session, data, (size_t) length);
+    session[length] = '\0';
+    (void) mysql_free_ssl_session_data(mysql, data);
+
+    Ns_MutexLock(&sslLock);
+    hPtr = Tcl_CreateHashEntry(&sslSessions, datasource, &isNew);
+    if (!isNew) {
+        ns_free(Tcl_GetHashValue(hPtr));
+    }
+    Tcl_SetHashValue(hPtr, session);
+    Ns_MutexUnlock(&sslLock);
+}
+#endif
+
+static bool
+SslResumed(MYSQL *mysql)
+{
+#ifdef HAVE_SSL_SESSION_DATA
+    return mysql_get_ssl_session_reused(mysql);
+#else
+    return NS_FALSE;
+#endif
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetPool --
+ *
+ *      Return the driver configuration of the named pool, reading it
+ *      from the configuration file on first access.
+ *
+ * Results:
+ *      Pool configuration.
+ *
+ * Side effects:
+ *      May allocate a new Pool entry.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Pool *
+GetPool(const char *poolname)
+{
+    Tcl_HashEntry  *hPtr;
+    Pool           *poolPtr;
+    const char     *path, *value;
+    int             isNew, i;
+    Ns_Time         threshold;
+
+    if (poolname == NULL) {
+        poolname = "";
+    }
+
+    Ns_MutexLock(&poolsLock);
+    hPtr = Tcl_CreateHashEntry(&pools, poolname, &isNew);
+    if (isNew) {
+        poolPtr = ns_calloc(1u, sizeof(Pool));
+        poolPtr->name = Tcl_GetHashKey(&pools, hPtr);
+
+        path = Ns_ConfigGetPath(NULL, NULL, "db", "pool", poolname, (char *)0L);
+
+        Ns_MutexSetName2(&poolPtr->lock, "nsdbmysql", poolname);
+
+        poolPtr->stmtCacheSize = Ns_ConfigIntRange(path, "stmtcachesize", 32, 0, INT_MAX);
+        poolPtr->multiStatements = Ns_ConfigBool(path, "multistatements", NS_FALSE);
+
+        if (Ns_ConfigBool(path, "digest", NS_FALSE)) {
+            poolPtr->digestSize = Ns_ConfigIntRange(path, "digestsize", 1000, DIGEST_STRIPES, INT_MAX);
+            poolPtr->digests = ns_calloc((size_t)DIGEST_STRIPES, sizeof(DigestTable));
+            for (i = 0; i < DIGEST_STRIPES; i++) {
+                Ns_MutexSetName2(&poolPtr->digests[i].lock, "nsdbmysql:digest", poolname);
+                Tcl_InitHashTable(&poolPtr->digests[i].entries, TCL_STRING_KEYS);
+            }
+        }
+
+        Ns_ConfigTimeUnitRange(path, "slowquerythreshold", "0s", 0, 0, INT_MAX, 0, &threshold);
+        poolPtr->slowThreshold = (unsigned long) threshold.sec * 1000000u + (unsigned long) threshold.usec;
+        poolPtr->slowSampling = Ns_ConfigIntRange(path, "slowquerysampling", 1, 1, INT_MAX);
+        poolPtr->slowRateLimit = Ns_ConfigIntRange(path, "slowqueryratelimit", 10, 0, INT_MAX);
+        poolPtr->slowExplain = Ns_ConfigBool(path, "slowqueryexplain", NS_FALSE);
+        poolPtr->slowFd = NS_INVALID_FD;
+        value = Ns_ConfigString(path, "slowquerylog", NULL);
+        if (poolPtr->slowThreshold > 0u && value != NULL) {
+            poolPtr->slowFd = ns_open(value, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+            if (poolPtr->slowFd == NS_INVALID_FD) {
+                Ns_Log(Error, "nsdbmysql: pool %s: can't open slow query log '%s': %s",
+                       poolname, value, strerror(errno));
+            }
+        }
+
+        value = Ns_ConfigString(path, "binaryencoding", binaryEncodings[BINARY_NONE]);
+        for (i = 0; binaryEncodings[i] != NULL && !STREQ(value, binaryEncodings[i]); i++) {
+            ;
+        }
+        if (binaryEncodings[i] == NULL) {
+            Ns_Log(Warning, "nsdbmysql: pool %s: invalid binaryencoding '%s', using '%s'",
+                   poolname, value, binaryEncodings[BINARY_NONE]);
+            i = BINARY_NONE;
+        }
+        poolPtr->binaryEncoding = (BinaryEncoding) i;
+
+        value = Ns_ConfigString(path, "resultmode", resultModes[RESULT_STORE]);
+        if (!ParseResultMode(value, &poolPtr->resultMode)) {
+            Ns_Log(Warning, "nsdbmysql: pool %s: invalid resultmode '%s', using '%s'",
+                   poolname, value, resultModes[RESULT_STORE]);
+            poolPtr->resultMode = RESULT_STORE;
+        }
+
+        poolPtr->cacheMax = (size_t) Ns_ConfigIntRange(path, "resultcachesize", 0, 0, INT_MAX);
+        Ns_ConfigTimeUnitRange(path, "resultcachettl", "60s", 0, 0, INT_MAX, 0, &poolPtr->cacheTtl);
+        Ns_MutexSetName2(&poolPtr->cacheLock, "nsdbmysql:cache", poolname);
+        Tcl_InitHashTable(&poolPtr->cache, TCL_STRING_KEYS);
+        if (poolPtr->cacheMax > 0u) {
+            cacheEnabled = NS_TRUE;
+        }
+
+        value = Ns_ConfigString(path, "replicas", NULL);
+        if (value != NULL) {
+            TCL_SIZE_T   argc, r;
+            const char **argv;
+
+            if (Tcl_SplitList(NULL, value, &argc, &argv) != TCL_OK) {
+                Ns_Log(Warning, "nsdbmysql: pool %s: invalid replicas '%s'", poolname, value);
+            } else {
+                poolPtr->nreplicas = (int) argc;
+                poolPtr->replicas = ns_calloc((size_t) argc, sizeof(Replica));
+                for (r = 0; r < argc; r++) {
+                    poolPtr->replicas[r].datasource = ns_strdup(argv[r]);
+                    poolPtr->replicas[r].lag = -1;
+                }
+                Tcl_Free((char *) argv);
+            }
+        }
+        poolPtr->replicaMaxLag = Ns_ConfigIntRange(path, "replicamaxlag", 30, 0, INT_MAX);
+        Ns_ConfigTimeUnitRange(path, "replicacheckinterval", "5s", 0, 0, INT_MAX, 0,
+                               &poolPtr->replicaInterval);
+        poolPtr->replicaLagQuery = Ns_ConfigString(path, "replicalagquery", "SHOW REPLICA STATUS");
+        poolPtr->readYourWrites = Ns_ConfigBool(path, "readyourwrites", NS_TRUE);
+        poolPtr->localInfile = Ns_ConfigBool(path, "localinfile", NS_FALSE);
+        poolPtr->prefetchRows = (unsigned long) Ns_ConfigIntRange(path, "prefetchrows", 1000, 1, INT_MAX);
+        poolPtr->memSoft = (size_t) Ns_ConfigMemUnitRange(path, "memorysoftlimit", "0", 0, 0, LLONG_MAX);
+        poolPtr->memHard = (size_t) Ns_ConfigMemUnitRange(path, "memoryhardlimit", "0", 0, 0, LLONG_MAX);
+        poolPtr->poolMemSoft = (size_t) Ns_ConfigMemUnitRange(path, "poolmemorysoftlimit", "0", 0, 0, LLONG_MAX);
+        poolPtr->poolMemHard = (size_t) Ns_ConfigMemUnitRange(path, "poolmemoryhardlimit", "0", 0, 0, LLONG_MAX);
+        poolPtr->memLimits = (poolPtr->memSoft > 0u || poolPtr->memHard > 0u
+                              || poolPtr->poolMemSoft > 0u || poolPtr->poolMemHard > 0u);
+
+        Ns_ConfigTimeUnitRange(path, "pinginterval", "0s", 0, 0, INT_MAX, 0, &poolPtr->pingInterval);
+        poolPtr->reconnect = Ns_ConfigBool(path, "reconnect", NS_FALSE);
+        poolPtr->charset = Ns_ConfigString(path, "charset", NULL);
+
+        value = Ns_ConfigString(path, "sslmode", sslModes[SSLMODE_DEFAULT]);
+        for (i = 0; sslModes[i] != NULL && !STREQ(value, sslModes[i]); i++) {
+            ;
+        }
+        if (sslModes[i] == NULL) {
+            Ns_Log(Warning, "nsdbmysql: pool %s: invalid sslmode '%s', using '%s'",
+                   poolname, value, sslModes[SSLMODE_DEFAULT]);
+            i = SSLMODE_DEFAULT;
+        }
+        poolPtr->sslMode = (SslMode) i;
+#ifdef MARIADB_BASE_VERSION
+        if (poolPtr->sslMode == SSLMODE_PREFERRED) {
+            Ns_Log(Warning, "nsdbmysql: pool %s: sslmode 'preferred' is not supported"
+                   " by the MariaDB client library, using its default", poolname);
+        }
+#endif
+        poolPtr->sslCa = Ns_ConfigString(path, "sslca", NULL);
+        poolPtr->sslCaPath = Ns_ConfigString(path, "sslcapath", NULL);
+        poolPtr->sslCert = Ns_ConfigString(path, "sslcert", NULL);
+        poolPtr->sslKey = Ns_ConfigString(path, "sslkey", NULL);
+        poolPtr->sslCipher = Ns_ConfigString(path, "sslcipher", NULL);
+        poolPtr->sslSessions = Ns_ConfigBool(path, "sslsessioncache", NS_TRUE);
+        Ns_ConfigTimeUnitRange(path, "connecttimeout", "0s", 0, 0, INT_MAX, 0, &threshold);
+        poolPtr->connectTimeout = (unsigned int) threshold.sec + (threshold.usec > 0 ? 1u : 0u);
+        Ns_ConfigTimeUnitRange(path, "readtimeout", "0s", 0, 0, INT_MAX, 0, &threshold);
+        poolPtr->readTimeout = (unsigned int) threshold.sec + (threshold.usec > 0 ? 1u : 0u);
+        Ns_ConfigTimeUnitRange(path, "writetimeout", "0s", 0, 0, INT_MAX, 0, &threshold);
+        poolPtr->writeTimeout = (unsigned int) threshold.sec + (threshold.usec > 0 ? 1u : 0u);
+
+        value = Ns_ConfigString(path, "compression", NULL);
+        if (value != NULL && *value != '\0' && !STREQ(value, "uncompressed")) {
+            poolPtr->compression = value;
+        }
+        poolPtr->zstdLevel = (unsigned int) Ns_ConfigIntRange(path, "zstdcompressionlevel", 0, 0, 22);
+        value = Ns_ConfigString(path, "compressionpolicy", "always");
+        if (STREQ(value, "bulk")) {
+            poolPtr->compressBulk = NS_TRUE;
+        } else if (!STREQ(value, "always")) {
+            Ns_Log(Warning, "nsdbmysql: pool %s: invalid compressionpolicy '%s', using 'always'",
+                   poolname, value);
+        }
+        value = Ns_ConfigString(path, "sessioninit", NULL);
+        if (value != NULL
+            && Tcl_SplitList(NULL, value, &poolPtr->sessionInitc, &poolPtr->sessionInitv) != TCL_OK) {
+            Ns_Log(Warning, "nsdbmysql: pool %s: invalid sessioninit '%s'", poolname, value);
+        }
+        /*
+         * Never open more connections than the pool has handles.
+         */
+        poolPtr->warmup = Ns_ConfigIntRange(path, "warmup", 0, 0, INT_MAX);
+        i = Ns_ConfigIntRange(path, "connections", 2, 0, INT_MAX);
+        if (poolPtr->warmup > i) {
+            poolPtr->warmup = i;
+        }
+        poolPtr->warmupThreads = Ns_ConfigIntRange(path, "warmupthreads", 4, 1, 64);
+        Ns_ConfigTimeUnitRange(path, "warmuptimeout", "5s", 0, 1, INT_MAX, 0, &threshold);
+        poolPtr->warmupTimeout = (unsigned int) threshold.sec + (threshold.usec > 0 ? 1u : 0u);
+
+        Tcl_SetHashValue(hPtr, poolPtr);
+    } else {
+        poolPtr = Tcl_GetHashValue(hPtr);
+    }
+    Ns_MutexUnlock(&poolsLock);
+
+    return poolPtr;
+}
+
+static bool
+ParseResultMode(const char *value, ResultMode *modePtr)
+{
+    int i;
+
+    for (i = 0; resultModes[i] != NULL; i++) {
+        if (STREQ(value, resultModes[i])) {
+            *modePtr = (ResultMode) i;
+            return NS_TRUE;
+        }
+    }
+    return NS_FALSE;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeResult --
+ *
+ *      Release the open result set of the handle. An unbuffered result
+ *      has to be read up to its end before the connection can be used
+ *      again; mysql_free_result() drains the remaining rows. When "kill"
+ *      is set, the running statement is first aborted on the server, so
+ *      that a partially read stream does not have to be transferred.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      handle->statement is cleared.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FreeResult(Ns_DbHandle *handle, bool kill)
+{
+    Context        *ctx = (Context *) handle->context;
+
+    if (ctx != NULL && ctx->cursor != NULL) {
+        FreeBindings(&ctx->cursorBind);
+        ns_free(ctx->cursorValues);
+        ctx->cursorValues = NULL;
+        (void) mysql_stmt_close(ctx->cursor);
+        ctx->cursor = NULL;
+    }
+    if (handle->statement != NULL) {
+        if (kill && ctx != NULL && ctx->streaming) {
+            KillQuery(handle);
+        }
+        mysql_free_result((MYSQL_RES *) handle->statement);
+    }
+    if (ctx != NULL) {
+        if (handle->statement != NULL || (ctx->cachePtr != NULL && ctx->cachePtr->buffered)) {
+            HistogramAdd(&ctx->stats.fetch, ctx->fetchTime);
+            FlushQuery(handle);
+            ctx->fetchTime = 0u;
+        }
+        ctx->streaming = NS_FALSE;
+        ctx->compressing = NS_FALSE;
+        if (ctx->cachePtr != NULL) {
+            CacheRelease(ctx->poolPtr, ctx->cachePtr);
+            ctx->cachePtr = NULL;
+        }
+        MemoryRelease(ctx);
+    }
+    handle->statement = NULL;
+    handle->fetchingRows = NS_FALSE;
+
+    (void) DrainResults(handle);
+    if (ctx != NULL) {
+        RoutePrimary(handle);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BufferResult --
+ *
+ *      Read the result of the last query into memory of the handle,
+ *      like mysql_store_result(), but row by row, so that the memory
+ *      can be checked against the limits of the pool while the result
+ *      is transferred. The rows are kept in a private entry of the
+ *      form of the result cache and returned by FetchRow from there.
+ *      Memory is only accounted in pools with a memory limit.
+ *
+ * Results:
+ *      NS_OK when the rows are buffered, NS_END_DATA when the query
+ *      returned no result set, NS_ERROR on errors and when a hard
+ *      memory limit was reached (exception code HY001).
+ *
+ * Side effects:
+ *      At a hard limit, the query is aborted on the server.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+BufferResult(Ns_DbHandle *handle, const char *sql)
+{
+    Context        *ctx = (Context *) handle->context;
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+    MYSQL_RES      *result;
+    MYSQL_ROW       row;
+    const MYSQL_FIELD *fields;
+    CacheEntry     *entryPtr;
+    RowChunk       *chunkPtr = NULL;
+    unsigned int    i, ncols;
+    unsigned long   nrows = 0u, capacity = 0u;
+    size_t          size;
+    Ns_Time         start;
+    Tcl_DString     ds;
+
+    result = mysql_use_result(mysql);
+    Log(handle, mysql);
+    if (result == NULL) {
+        if (mysql_field_count(mysql) != 0u) {
+            RoutePrimary(handle);
+            return NS_ERROR;
+        }
+        return NS_END_DATA;
+    }
+    fields = mysql_fetch_fields(result);
+    ncols = mysql_num_fields(result);
+
+    size = sizeof(CacheEntry) + FieldsSize(fields, ncols);
+    entryPtr = ns_calloc(1u, size);
+    entryPtr->size = size;
+    entryPtr->refCount = 1;
+    entryPtr->buffered = NS_TRUE;
+    entryPtr->ncols = ncols;
+    entryPtr->fields = (MYSQL_FIELD *) (entryPtr + 1);
+    (void) CopyFields(entryPtr->fields, fields, ncols, (char *) (entryPtr->fields + ncols));
+
+    Tcl_DStringInit(&ds);
+    Ns_GetTime(&start);
+    while ((row = mysql_fetch_row(result)) != NULL) {
+        const unsigned long *lengths = mysql_fetch_lengths(result);
+        size_t               dataSize = 0u;
+
+        for (i = 0u; i < ncols; i++) {
+            if (row[i] != NULL) {
+                dataSize += lengths[i] + 1u;
+            }
+        }
+        if (ctx->poolPtr->memLimits
+            && MemoryCharge(handle, dataSize + ncols * (sizeof(char *) + sizeof(unsigned long)),
+                            sql, &ds) != NS_OK) {
+            break;
+        }
+
+        if (nrows == capacity) {
+            capacity = (capacity == 0u) ? 64u : capacity * 2u;
+            entryPtr->values = ns_realloc(entryPtr->values, capacity * ncols * sizeof(char *));
+            entryPtr->lengths = ns_realloc(entryPtr->lengths, capacity * ncols * sizeof(unsigned long));
+        }
+        if (chunkPtr == NULL || chunkPtr->used + dataSize > chunkPtr->size) {
+            size_t chunkSize = (dataSize > ROW_CHUNK) ? dataSize : ROW_CHUNK;
+
+            chunkPtr = ns_malloc(sizeof(RowChunk) + chunkSize);
+            chunkPtr->size = chunkSize;
+            chunkPtr->used = 0u;
+            chunkPtr->nextPtr = entryPtr->chunks;
+            entryPtr->chunks = chunkPtr;
+        }
+        for (i = 0u; i < ncols; i++) {
+            size_t idx = (size_t) nrows * ncols + i;
+
+            entryPtr->lengths[idx] = lengths[i];
+            if (row[i] == NULL) {
+                entryPtr->values[idx] = NULL;
+            } else {
+                char *p = chunkPtr->data + chunkPtr->used;
+
+                memcpy(p, row[i], lengths[i]);
+                p[lengths[i]] = '\0';
+                entryPtr->values[idx] = p;
+                chunkPtr->used += lengths[i] + 1u;
+            }
+        }
+        nrows++;
+    }
+    ctx->fetchTime += Elapsed(&start);
+    entryPtr->nrows = nrows;
+
+    if (row != NULL || mysql_errno(mysql) != 0u) {
+        /*
+         * Memory limit reached, or the connection failed while reading.
+         * Drop the partial result; abort the rest of the transfer.
+         */
+        if (row == NULL) {
+            Log(handle, mysql);
+            StatsError(&ctx->stats, mysql_errno(mysql));
+        }
+        CacheFree(entryPtr);
+        handle->statement = (void *) result;
+        ctx->streaming = (row != NULL);
+        FreeResult(handle, NS_TRUE);
+        if (row != NULL) {
+            strcpy(handle->cExceptionCode, "HY001");
+            Tcl_DStringFree(&handle->dsExceptionMsg);
+            Tcl_DStringAppend(&handle->dsExceptionMsg, Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+        }
+        Tcl_DStringFree(&ds);
+        return NS_ERROR;
+    }
+    Tcl_DStringFree(&ds);
+
+    mysql_free_result(result);
+    ctx->cachePtr = entryPtr;
+    ctx->cacheRow = 0u;
+    handle->fetchingRows = NS_TRUE;
+
+    return NS_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemoryCharge --
+ *
+ *      Account memory of the buffered result of a handle and check it
+ *      against the limits of the pool. The usage of the handle is
+ *      added to the pool in steps of MEMORY_STEP bytes, to keep the
+ *      pool lock off the row loop. A soft limit is logged and counted
+ *      once per result.
+ *
+ * Results:
+ *      NS_OK, or NS_ERROR when a hard limit is exceeded; the error
+ *      message is then left in dsPtr.
+ *
+ * Side effects:
+ *      Updates the usage and high-water marks of handle and pool.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+MemoryCharge(Ns_DbHandle *handle, size_t bytes, const char *sql, Tcl_DString *dsPtr)
+{
+    Context        *ctx = (Context *) handle->context;
+    Pool           *poolPtr = ctx->poolPtr;
+    const char     *hard = NULL, *soft = NULL;
+    size_t          limit = 0u;
+
+    ctx->memUsed += bytes;
+    ctx->memPending += bytes;
+    if (ctx->memUsed > ctx->memPeak) {
+        ctx->memPeak = ctx->memUsed;
+    }
+    if (poolPtr->memHard > 0u && ctx->memUsed > poolPtr->memHard) {
+        hard = "handle";
+        limit = poolPtr->memHard;
+    } else if (!ctx->memWarned && poolPtr->memSoft > 0u && ctx->memUsed > poolPtr->memSoft) {
+        soft = "handle";
+        limit = poolPtr->memSoft;
+    }
+
+    if (ctx->memPending >= MEMORY_STEP || hard != NULL || soft != NULL) {
+        Ns_MutexLock(&poolPtr->lock);
+        poolPtr->memUsed += ctx->memPending;
+        ctx->memPending = 0u;
+        if (poolPtr->memUsed > poolPtr->memPeak) {
+            poolPtr->memPeak = poolPtr->memUsed;
+        }
+        if (hard == NULL && poolPtr->poolMemHard > 0u && poolPtr->memUsed > poolPtr->poolMemHard) {
+            hard = "pool";
+            limit = poolPtr->poolMemHard;
+        } else if (hard == NULL && soft == NULL && !ctx->memWarned
+                   && poolPtr->poolMemSoft > 0u && poolPtr->memUsed > poolPtr->poolMemSoft) {
+            soft = "pool";
+            limit = poolPtr->poolMemSoft;
+        }
+        if (hard != NULL) {
+            poolPtr->memHardCount++;
+        } else if (soft != NULL) {
+            poolPtr->memSoftCount++;
+        }
+        Ns_MutexUnlock(&poolPtr->lock);
+    }
+
+    if (hard != NULL) {
+        Ns_DStringPrintf(dsPtr, "result exceeds %s memory limit of %lu bytes", hard, (unsigned long) limit);
+        Ns_Log(Error, "nsdbmysql: pool %s: %s: %s", poolPtr->name, Tcl_DStringValue(dsPtr), sql);
+        return NS_ERROR;
+    }
+    if (soft != NULL) {
+        ctx->memWarned = NS_TRUE;
+        Ns_Log(Warning, "nsdbmysql: pool %s: result exceeds %s soft memory limit of %lu bytes: %s",
+               poolPtr->name, soft, (unsigned long) limit, sql);
+    }
+    return NS_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemoryRelease --
+ *
+ *      Return the memory of the released result of a handle to the
+ *      pool.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Resets the usage of the handle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+MemoryRelease(Context *ctx)
+{
+    Pool *poolPtr = ctx->poolPtr;
+
+    if (ctx->memUsed > ctx->memPending) {
+        Ns_MutexLock(&poolPtr->lock);
+        poolPtr->memUsed -= ctx->memUsed - ctx->memPending;
+        Ns_MutexUnlock(&poolPtr->lock);
+    }
+    ctx->memUsed = 0u;
+    ctx->memPending = 0u;
+    ctx->memWarned = NS_FALSE;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MemoryCmd --
+ *
+ *      Implements "ns_mysql memory": current and high-water result
+ *      memory, limits and limit counters of all pools.
+ *
+ * Results:
+ *      TCL_OK, dict by pool name as interp result.
+ *
+ * Side effects:
+ *      With reset, the high-water marks and counters start anew.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+MemoryCmd(Tcl_Interp *interp, bool reset)
+{
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    Tcl_Obj        *resultObj = Tcl_NewDictObj();
+
+    Ns_MutexLock(&poolsLock);
+    for (hPtr = Tcl_FirstHashEntry(&pools, &search); hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+        Pool    *poolPtr = Tcl_GetHashValue(hPtr);
+        Context *cPtr;
+        Tcl_Obj *dictObj = Tcl_NewDictObj();
+        size_t   handlePeak = 0u;
+
+        Ns_MutexLock(&poolPtr->lock);
+        for (cPtr = poolPtr->firstCtxPtr; cPtr != NULL; cPtr = cPtr->nextPtr) {
+            if (cPtr->memPeak > handlePeak) {
+                handlePeak = cPtr->memPeak;
+            }
+            if (reset) {
+                cPtr->memPeak = cPtr->memUsed;
+            }
+        }
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("used", 4),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->memUsed));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("peak", 4),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->memPeak));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("handlepeak", 10),
+                       Tcl_NewWideIntObj((Tcl_WideInt) handlePeak));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("softlimit", 9),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->memSoft));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("hardlimit", 9),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->memHard));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("poolsoftlimit", 13),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->poolMemSoft));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("poolhardlimit", 13),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->poolMemHard));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("softexceeded", 12),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->memSoftCount));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("hardexceeded", 12),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->memHardCount));
+        if (reset) {
+            poolPtr->memPeak = poolPtr->memUsed;
+            poolPtr->memSoftCount = 0u;
+            poolPtr->memHardCount = 0u;
+        }
+        Ns_MutexUnlock(&poolPtr->lock);
+        Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj(poolPtr->name, TCL_INDEX_NONE), dictObj);
+    }
+    Ns_MutexUnlock(&poolsLock);
+
+    Tcl_SetObjResult(interp, resultObj);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DrainResults --
+ *
+ *      Discard further results of a multi-statement query, which would
+ *      otherwise leave the connection out of sync for the next query.
+ *
+ * Results:
+ *      NS_OK, or NS_ERROR when one of the statements failed.
+ *
+ * Side effects:
+ *      Errors are logged.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+DrainResults(Ns_DbHandle *handle)
+{
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+    int             rc;
+
+    while (mysql_more_results(mysql)) {
+        rc = mysql_next_result(mysql);
+        if (rc > 0) {
+            Log(handle, mysql);
+            return NS_ERROR;
+        } else if (rc < 0) {
+            break;
+        } else {
+            MYSQL_RES *result = mysql_store_result(mysql);
+
+            if (result != NULL) {
+                mysql_free_result(result);
+            }
+        }
+    }
+    return NS_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Batch --
+ *
+ *      Send a list of statements in one round-trip as multi-statement
+ *      query and collect the results of all statements. Trailing ";"
+ *      of the statements are removed. Requires a pool configured with
+ *      "multistatements".
+ *
+ * Results:
+ *      Tcl result code. The interp result is a list with one dict per
+ *      executed statement, containing either "affected" and
+ *      "insert_id", or "columns" and "rows", or "error" and "message".
+ *      Execution stops at the first failing statement, and at a
+ *      result exceeding a hard memory limit of the pool.
+ *
+ * Side effects:
+ *      Executes the statements.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Batch(Tcl_Interp *interp, Ns_DbHandle *handle, Tcl_Obj *sqlListObj)
+{
+    Context        *ctx = (Context *) handle->context;
+    MYSQL          *mysql;
+    Tcl_Obj       **stmts, *listObj, *dictObj;
+    TCL_SIZE_T      nstmts, i, current = 0;
+    Tcl_DString     sql, ds;
+    Ns_Time         start;
+    int             rc;
+
+    if (!ctx->poolPtr->multiStatements) {
+        Tcl_AppendResult(interp, "multi-statement batches are not enabled for pool \"",
+                         ctx->poolPtr->name, "\" (parameter multistatements)", NULL);
+        return TCL_ERROR;
+    }
+    if (Tcl_ListObjGetElements(interp, sqlListObj, &nstmts, &stmts) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (nstmts == 0) {
+        return TCL_OK;
+    }
+    RouteWrite(handle);
+    mysql = (MYSQL *) handle->connection;
+
+    /*
+     * Statements are joined with ";", so their own terminators are
+     * dropped; an empty statement would fail as ER_EMPTY_QUERY.
+     */
+    Tcl_DStringInit(&sql);
+    for (i = 0; i < nstmts; i++) {
+        TCL_SIZE_T  length;
+        const char *stmt = Tcl_GetStringFromObj(stmts[i], &length);
+
+        while (length > 0 && (stmt[length - 1] == ';'
+                              || isspace((unsigned char) stmt[length - 1]))) {
+            length--;
+        }
+        if (length == 0) {
+            Tcl_DStringFree(&sql);
+            Ns_TclPrintfResult(interp, "statement %ld of the batch is empty", (long) i);
+            return TCL_ERROR;
+        }
+        if (i > 0) {
+            Tcl_DStringAppend(&sql, ";\n", 2);
+        }
+        Tcl_DStringAppend(&sql, stmt, length);
+    }
+
+    listObj = Tcl_NewListObj(0, NULL);
+    Ns_GetTime(&start);
+    rc = mysql_real_query(mysql, Tcl_DStringValue(&sql), (unsigned long) Tcl_DStringLength(&sql));
+    StatsQuery(handle, STATS_EXEC, Tcl_DStringValue(&sql), &start);
+    Tcl_DStringFree(&sql);
+    for (i = 0; i < nstmts; i++) {
+        CacheWrite(handle, Tcl_GetString(stmts[i]));
+    }
+
+    Tcl_DStringInit(&ds);
+    for (;;) {
+        dictObj = Tcl_NewDictObj();
+
+        if (rc != 0) {
+            Log(handle, mysql);
+            Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("error", 5),
+                           Tcl_NewWideIntObj((Tcl_WideInt) mysql_errno(mysql)));
+            Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("message", 7),
+                           Tcl_NewStringObj(mysql_error(mysql), TCL_INDEX_NONE));
+            Tcl_ListObjAppendElement(NULL, listObj, dictObj);
+            break;
+
+        } else {
+            /*
+             * In pools with memory limits, rows are read unbuffered and
+             * charged while they are converted.
+             */
+            MYSQL_RES *result = ctx->poolPtr->memLimits
+                ? mysql_use_result(mysql) : mysql_store_result(mysql);
+
+            if (result != NULL) {
+                unsigned int       col, ncols = mysql_num_fields(result);
+                const MYSQL_FIELD *fields = mysql_fetch_fields(result);
+                Tcl_Obj           *columnsObj, *rowsObj;
+
+                rowsObj = ResultObj(handle, result,
+                                    Tcl_GetString(stmts[(current < nstmts) ? current : nstmts - 1]), &ds);
+                if (rowsObj == NULL && Tcl_DStringLength(&ds) > 0) {
+                    /*
+                     * Memory limit reached; abort the rest of the batch.
+                     */
+                    handle->statement = (void *) result;
+                    ctx->streaming = NS_TRUE;
+                    FreeResult(handle, NS_TRUE);
+                    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("error", 5),
+                                   Tcl_NewWideIntObj((Tcl_WideInt) CR_OUT_OF_MEMORY));
+                    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("message", 7),
+                                   Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds)));
+                    Tcl_ListObjAppendElement(NULL, listObj, dictObj);
+                    break;
+                } else if (rowsObj == NULL) {
+                    /*
+                     * Reading the rows failed.
+                     */
+                    mysql_free_result(result);
+                    Tcl_DecrRefCount(dictObj);
+                    rc = 1;
+                    continue;
+                }
+                columnsObj = Tcl_NewListObj(0, NULL);
+                for (col = 0u; col < ncols; col++) {
+                    Tcl_ListObjAppendElement(NULL, columnsObj,
+                                             Tcl_NewStringObj(fields[col].name,
+                                                              (TCL_SIZE_T) fields[col].name_length));
+                }
+                Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("columns", 7), columnsObj);
+                Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("rows", 4), rowsObj);
+                mysql_free_result(result);
+
+            } else if (mysql_field_count(mysql) == 0u) {
+                Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("affected", 8),
+                               Tcl_NewWideIntObj((Tcl_WideInt) mysql_affected_rows(mysql)));
+                Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("insert_id", 9),
+                               Tcl_NewWideIntObj((Tcl_WideInt) mysql_insert_id(mysql)));
+                if (current < nstmts) {
+                    SessionTrack(ctx, Tcl_GetString(stmts[current]));
+                }
+            } else {
+                /*
+                 * Reading the result set failed.
+                 */
+                Tcl_DecrRefCount(dictObj);
+                rc = 1;
+                continue;
+            }
+            Tcl_ListObjAppendElement(NULL, listObj, dictObj);
+        }
+
+        current++;
+        rc = mysql_next_result(mysql);
+        if (rc < 0) {
+            break;
+        }
+    }
+    Tcl_DStringFree(&ds);
+    MemoryRelease(ctx);
+    FlushQuery(handle);
+
+    Tcl_SetObjResult(interp, listObj);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ResultObj --
+ *
+ *      Convert the rows of a result set into a list of rows, each row a
+ *      list of column values. NULL values are returned as empty
+ *      strings, like in DbGetRow. In pools with memory limits, the
+ *      rows are charged to the handle.
+ *
+ * Results:
+ *      List object, or NULL when reading the rows failed or a hard
+ *      memory limit was reached; the limit message is then left in
+ *      dsPtr.
+ *
+ * Side effects:
+ *      Reads all rows of the result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+ResultObj(Ns_DbHandle *handle, MYSQL_RES *result, const char *sql, Tcl_DString *dsPtr)
+{
+    Context           *ctx = (Context *) handle->context;
+    MYSQL             *mysql = (MYSQL *) handle->connection;
+    Tcl_Obj           *listObj = Tcl_NewListObj(0, NULL);
+    const MYSQL_FIELD *fields = mysql_fetch_fields(result);
+    unsigned int       i, ncols = mysql_num_fields(result);
+    MYSQL_ROW          row;
+
+    while ((row = mysql_fetch_row(result)) != NULL) {
+        const unsigned long *lengths = mysql_fetch_lengths(result);
+
+        if (ctx->poolPtr->memLimits) {
+            size_t size = ncols * sizeof(Tcl_Obj);
+
+            for (i = 0u; i < ncols; i++) {
+                size += lengths[i];
+            }
+            if (MemoryCharge(handle, size, sql, dsPtr) != NS_OK) {
+                Tcl_DecrRefCount(listObj);
+                return NULL;
+            }
+        }
+        Tcl_ListObjAppendElement(NULL, listObj, RowObj(fields, ncols, row, lengths));
+    }
+    if (mysql_errno(mysql) != 0u) {
+        Tcl_DecrRefCount(listObj);
+        return NULL;
+    }
+    return listObj;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RowObj --
+ *
+ *      Convert a row into a list of column values, sized by the fetched
+ *      lengths. Binary columns are returned as byte arrays, NULL values
+ *      as empty strings.
+ *
+ * Results:
+ *      List object.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+RowObj(const MYSQL_FIELD *fields, unsigned int ncols, char **values, const unsigned long *lengths)
+{
+    Tcl_Obj        *rowObj = Tcl_NewListObj(0, NULL);
+    unsigned int    i;
+
+    for (i = 0u; i < ncols; i++) {
+        Tcl_Obj *valueObj;
+
+        if (values[i] == NULL) {
+            valueObj = Tcl_NewObj();
+        } else if (IsBinaryField(&fields[i])) {
+            valueObj = Tcl_NewByteArrayObj((const unsigned char *) values[i], (TCL_SIZE_T) lengths[i]);
+        } else {
+            valueObj = Tcl_NewStringObj(values[i], (TCL_SIZE_T) lengths[i]);
+        }
+        Tcl_ListObjAppendElement(NULL, rowObj, valueObj);
+    }
+    return rowObj;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RunSelect --
+ *
+ *      Run a query for a command that reads the rows itself, in the
+ *      given result mode. The exception of an earlier query is cleared
+ *      first, so that a failure is reported with its own message.
+ *
+ * Results:
+ *      Tcl result code; on error, the message is left in the interp.
+ *
+ * Side effects:
+ *      On success the handle is fetching rows.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+RunSelect(Tcl_Interp *interp, Ns_DbHandle *handle, const char *sql, ResultMode mode)
+{
+    Context        *ctx = (Context *) handle->context;
+    ResultMode      resultMode = ctx->resultMode;
+    Ns_Set         *row;
+
+    handle->cExceptionCode[0] = '\0';
+    Tcl_DStringSetLength(&handle->dsExceptionMsg, 0);
+
+    ctx->resultMode = mode;
+    row = DbSelect(handle, (char *) sql);
+    ctx->resultMode = resultMode;
+
+    if (row == NULL) {
+        if (Tcl_DStringLength(&handle->dsExceptionMsg) == 0) {
+            Tcl_AppendResult(interp, "query did not return rows", NULL);
+        } else {
+            Tcl_DStringResult(interp, &handle->dsExceptionMsg);
+        }
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Export --
+ *
+ *      Run a query and write its rows as CSV, TSV, JSON or NDJSON to a
+ *      Tcl channel or, with chunked transfer encoding, to the current
+ *      connection. Rows are streamed from the server (mysql_use_result)
+ *      and formatted in C into one output buffer, which is flushed
+ *      whenever it holds EXPORT_CHUNK bytes, so memory usage does not
+ *      depend on the size of the result.
+ *
+ * Results:
+ *      Tcl result code, the number of exported rows as interp result.
+ *
+ * Side effects:
+ *      On a write error the query is aborted via KILL QUERY.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Export(Tcl_Interp *interp, Ns_DbHandle *handle, const char *sql, ExportFormat format,
+       Tcl_Channel chan, Ns_Conn *conn)
+{
+    static const char *contentTypes[] = {
+        "text/csv; charset=utf-8", "text/tab-separated-values; charset=utf-8",
+        "application/json", "application/x-ndjson"
+    };
+    Context           *ctx = (Context *) handle->context;
+    const MYSQL_FIELD *fields;
+    char             **values;
+    unsigned long     *lengths;
+    unsigned int       i, ncols;
+    Tcl_WideInt        nrows = 0;
+    BinaryEncoding     encoding;
+    Tcl_DString        ds, keys;
+    TCL_SIZE_T        *keyOffsets = NULL;
+    int                rc;
+
+    if (handle->fetchingRows) {
+        Tcl_AppendResult(interp, "handle has rows waiting to fetch", NULL);
+        return TCL_ERROR;
+    }
+    ctx->cacheNext = NS_FALSE;
+    ctx->compressNext = NS_TRUE;
+    if (RunSelect(interp, handle, sql, RESULT_USE) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    /*
+     * JSON has no representation for raw bytes, binary columns are
+     * base64 encoded unless hex is selected.
+     */
+    encoding = ctx->binaryEncoding;
+    if (encoding == BINARY_NONE && (format == EXPORT_JSON || format == EXPORT_NDJSON)) {
+        encoding = BINARY_BASE64;
+    }
+
+    fields = mysql_fetch_fields((MYSQL_RES *) handle->statement);
+    ncols = mysql_num_fields((MYSQL_RES *) handle->statement);
+    Tcl_DStringInit(&ds);
+    Tcl_DStringInit(&keys);
+
+    /*
+     * CSV and TSV start with a header line, JSON objects use the column
+     * names as keys, which are escaped once.
+     */
+    if (format == EXPORT_JSON || format == EXPORT_NDJSON) {
+        keyOffsets = JsonKeys(&keys, fields, ncols);
+    }
+    for (i = 0u; i < ncols; i++) {
+        if (format == EXPORT_CSV) {
+            if (i > 0u) {
+                Tcl_DStringAppend(&ds, ",", 1);
+            }
+            ExportCsv(&ds, fields[i].name, fields[i].name_length);
+        } else if (format == EXPORT_TSV) {
+            if (i > 0u) {
+                Tcl_DStringAppend(&ds, "\t", 1);
+            }
+            ExportTsv(&ds, fields[i].name, fields[i].name_length);
+        }
+    }
+    if (format == EXPORT_CSV) {
+        Tcl_DStringAppend(&ds, "\r\n", 2);
+    } else if (format == EXPORT_TSV) {
+        Tcl_DStringAppend(&ds, "\n", 1);
+    } else if (format == EXPORT_JSON) {
+        Tcl_DStringAppend(&ds, "[", 1);
+    }
+
+    if (conn != NULL) {
+        Ns_ConnSetTypeHeader(conn, contentTypes[format]);
+    }
+
+    while ((rc = FetchRow(handle, &fields, &ncols, &values, &lengths)) == NS_OK) {
+        if (format == EXPORT_JSON || format == EXPORT_NDJSON) {
+            Tcl_DStringAppend(&ds, (format == EXPORT_JSON && nrows > 0) ? ",\n{" : "{", TCL_INDEX_NONE);
+        }
+        for (i = 0u; i < ncols; i++) {
+            const char   *value = values[i];
+            unsigned long length = lengths[i];
+            bool          binary = (value != NULL && encoding != BINARY_NONE
+                                    && format != EXPORT_JSON && format != EXPORT_NDJSON
+                                    && IsBinaryField(&fields[i]));
+
+            switch (format) {
+            case EXPORT_CSV:
+                if (i > 0u) {
+                    Tcl_DStringAppend(&ds, ",", 1);
+                }
+                if (binary) {
+                    EncodeBinary(&ds, encoding, (const unsigned char *) value, length);
+                } else if (value != NULL) {
+                    ExportCsv(&ds, value, length);
+                }
+                break;
+
+            case EXPORT_TSV:
+                if (i > 0u) {
+                    Tcl_DStringAppend(&ds, "\t", 1);
+                }
+                if (value == NULL) {
+                    Tcl_DStringAppend(&ds, "\\N", 2);
+                } else if (binary) {
+                    EncodeBinary(&ds, encoding, (const unsigned char *) value, length);
+                } else {
+                    ExportTsv(&ds, value, length);
+                }
+                break;
+
+            case EXPORT_JSON:
+            case EXPORT_NDJSON:
+                Tcl_DStringAppend(&ds, Tcl_DStringValue(&keys) + keyOffsets[i],
+                                  keyOffsets[i + 1u] - keyOffsets[i]);
+                JsonValue(&ds, &fields[i], value, length, encoding);
+                break;
+            }
+        }
+        switch (format) {
+        case EXPORT_CSV:
+            Tcl_DStringAppend(&ds, "\r\n", 2);
+            break;
+        case EXPORT_TSV:
+            Tcl_DStringAppend(&ds, "\n", 1);
+            break;
+        case EXPORT_JSON:
+            Tcl_DStringAppend(&ds, "}", 1);
+            break;
+        case EXPORT_NDJSON:
+            Tcl_DStringAppend(&ds, "}\n", 2);
+            break;
+        }
+        nrows++;
+
+        if (Tcl_DStringLength(&ds) >= EXPORT_CHUNK) {
+            if (!ExportWrite(&ds, chan, conn, NS_TRUE)) {
+                FreeResult(handle, NS_TRUE);
+                rc = NS_ERROR;
+                Tcl_DStringFree(&handle->dsExceptionMsg);
+                Tcl_DStringAppend(&handle->dsExceptionMsg, "export: write failed", TCL_INDEX_NONE);
+                break;
+            }
+        }
+    }
+
+    if (rc == NS_END_DATA) {
+        if (format == EXPORT_JSON) {
+            Tcl_DStringAppend(&ds, "]\n", 2);
+        }
+        if (ExportWrite(&ds, chan, conn, NS_FALSE)) {
+            rc = NS_OK;
+        } else {
+            rc = NS_ERROR;
+            Tcl_DStringFree(&handle->dsExceptionMsg);
+            Tcl_DStringAppend(&handle->dsExceptionMsg, "export: write failed", TCL_INDEX_NONE);
+        }
+    }
+    Tcl_DStringFree(&ds);
+    Tcl_DStringFree(&keys);
+    ns_free(keyOffsets);
+
+    if (rc != NS_OK) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_DStringValue(&handle->dsExceptionMsg),
+                                                  Tcl_DStringLength(&handle->dsExceptionMsg)));
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(nrows));
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ExportWrite --
+ *
+ *      Write the export buffer to the channel or connection and empty
+ *      it. Writes to the connection are sent as chunks; the last write
+ *      (stream false) ends the chunked response.
+ *
+ * Results:
+ *      NS_TRUE on success.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ExportWrite(Tcl_DString *dsPtr, Tcl_Channel chan, Ns_Conn *conn, bool stream)
+{
+    bool success;
+
+    if (chan != NULL) {
+        success = (Tcl_Write(chan, Tcl_DStringValue(dsPtr), Tcl_DStringLength(dsPtr)) >= 0);
+    } else {
+        success = (Ns_ConnWriteData(conn, Tcl_DStringValue(dsPtr), (size_t) Tcl_DStringLength(dsPtr),
+                                    stream ? NS_CONN_STREAM : 0u) == NS_OK);
+    }
+    Tcl_DStringSetLength(dsPtr, 0);
+
+    return success;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ExportCsv, ExportTsv --
+ *
+ *      Append a field value in CSV format (RFC 4180: quoted when it
+ *      contains a separator, quote or line break, or is empty, to tell
+ *      it from NULL) or in TSV format (backslash escapes for tab,
+ *      newline, carriage return, NUL and backslash, as used by
+ *      LOAD DATA).
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Grows the DString.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ExportCsv(Tcl_DString *dsPtr, const char *value, unsigned long length)
+{
+    unsigned long i, start;
+
+    for (i = 0u; i < length; i++) {
+        if (value[i] == ',' || value[i] == '"' || value[i] == '\n' || value[i] == '\r') {
+            break;
+        }
+    }
+    if (i == length && length > 0u) {
+        Tcl_DStringAppend(dsPtr, value, (TCL_SIZE_T) length);
+        return;
+    }
+
+    Tcl_DStringAppend(dsPtr, "\"", 1);
+    for (start = 0u; i < length; i++) {
+        if (value[i] == '"') {
+            Tcl_DStringAppend(dsPtr, value + start, (TCL_SIZE_T) (i + 1u - start));
+            start = i;
+        }
+    }
+    Tcl_DStringAppend(dsPtr, value + start, (TCL_SIZE_T) (length - start));
+    Tcl_DStringAppend(dsPtr, "\"", 1);
+}
+
+static void
+ExportTsv(Tcl_DString *dsPtr, const char *value, unsigned long length)
+{
+    unsigned long i, start = 0u;
+
+    for (i = 0u; i < length; i++) {
+        const char *escape;
+
+        switch (value[i]) {
+        case '\t': escape = "\\t"; break;
+        case '\n': escape = "\\n"; break;
+        case '\r': escape = "\\r"; break;
+        case '\0': escape = "\\0"; break;
+        case '\\': escape = "\\\\"; break;
+        default:   continue;
+        }
+        Tcl_DStringAppend(dsPtr, value + start, (TCL_SIZE_T) (i - start));
+        Tcl_DStringAppend(dsPtr, escape, 2);
+        start = i + 1u;
+    }
+    Tcl_DStringAppend(dsPtr, value + start, (TCL_SIZE_T) (length - start));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * JsonAppend --
+ *
+ *      Append a string with JSON escapes (without the quotes). The
+ *      input is scanned eight bytes at a time for control characters,
+ *      quotes and backslashes (SWAR bit tricks on a 64-bit word), runs
+ *      without such bytes are appended at once, and the escape of each
+ *      remaining byte is looked up in a table. Bytes of UTF-8 sequences
+ *      are copied as they are.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Grows the DString.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#define SWAR_ONES              0x0101010101010101ULL
+#define SWAR_HIGHS             0x8080808080808080ULL
+#define SWAR_LESS(w, n)        (((w) - SWAR_ONES * (n)) & ~(w) & SWAR_HIGHS)
+#define SWAR_EQUAL(w, c)       SWAR_LESS((w) ^ (SWAR_ONES * (c)), 1u)
+
+static void
+JsonAppend(Tcl_DString *dsPtr, const char *value, unsigned long length)
+{
+    /*
+     * 0: no escape, 'u': \u00XX, else the character after the backslash.
+     */
+    static const char escapes[256] = {
+        'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+        'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+        0,   0,   '"', 0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+        0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   '\\', 0,  0,   0
+    };
+    static const char hexDigits[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char *) value, *end = p + length, *start = p;
+
+    for (;;) {
+        char escape;
+
+        while (end - p >= 8) {
+            unsigned long long w;
+
+            memcpy(&w, p, sizeof(w));
+            if ((SWAR_LESS(w, 0x20u) | SWAR_EQUAL(w, (unsigned char) '"')
+                 | SWAR_EQUAL(w, (unsigned char) '\\')) != 0u) {
+                break;
+            }
+            p += 8;
+        }
+        if (p == end) {
+            break;
+        }
+        escape = escapes[*p];
+        if (escape != 0) {
+            char buf[6] = {'\\', escape, '0', '0', '\0', '\0'};
+
+            Tcl_DStringAppend(dsPtr, (const char *) start, (TCL_SIZE_T) (p - start));
+            if (escape == 'u') {
+                buf[4] = hexDigits[*p >> 4];
+                buf[5] = hexDigits[*p & 0x0fu];
+                Tcl_DStringAppend(dsPtr, buf, 6);
+            } else {
+                Tcl_DStringAppend(dsPtr, buf, 2);
+            }
+            start = p + 1;
+        }
+        p++;
+    }
+    Tcl_DStringAppend(dsPtr, (const char *) start, (TCL_SIZE_T) (p - start));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * JsonValue --
+ *
+ *      Append a column value as JSON: null for NULL, numbers unquoted
+ *      by the type of the field, binary columns as encoded strings and
+ *      all other values as escaped strings.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Grows the DString.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+JsonValue(Tcl_DString *dsPtr, const MYSQL_FIELD *fieldPtr, const char *value, unsigned long length,
+          BinaryEncoding encoding)
+{
+    if (value == NULL) {
+        Tcl_DStringAppend(dsPtr, "null", 4);
+    } else if (IS_NUM(fieldPtr->type)) {
+        Tcl_DStringAppend(dsPtr, value, (TCL_SIZE_T) length);
+    } else {
+        Tcl_DStringAppend(dsPtr, "\"", 1);
+        if (IsBinaryField(fieldPtr)) {
+            EncodeBinary(dsPtr, encoding == BINARY_HEX ? BINARY_HEX : BINARY_BASE64,
+                         (const unsigned char *) value, length);
+        } else {
+            JsonAppend(dsPtr, value, length);
+        }
+        Tcl_DStringAppend(dsPtr, "\"", 1);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * JsonKeys --
+ *
+ *      Build the escaped object keys ("name": and ,"name": after the
+ *      first) of the columns of a result.
+ *
+ * Results:
+ *      Array of ncols + 1 offsets of the keys in the DString, to be
+ *      freed by the caller.
+ *
+ * Side effects:
+ *      Grows the DString.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TCL_SIZE_T *
+JsonKeys(Tcl_DString *dsPtr, const MYSQL_FIELD *fields, unsigned int ncols)
+{
+    TCL_SIZE_T   *offsets = ns_malloc(sizeof(TCL_SIZE_T) * (ncols + 1u));
+    unsigned int  i;
+
+    for (i = 0u; i < ncols; i++) {
+        offsets[i] = Tcl_DStringLength(dsPtr);
+        Tcl_DStringAppend(dsPtr, i > 0u ? ",\"" : "\"", TCL_INDEX_NONE);
+        JsonAppend(dsPtr, fields[i].name, fields[i].name_length);
+        Tcl_DStringAppend(dsPtr, "\":", 2);
+    }
+    offsets[ncols] = Tcl_DStringLength(dsPtr);
+
+    return offsets;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SelectJson --
+ *
+ *      Run a query and return its result as JSON text, built in C from
+ *      the fetched rows: an array of objects keyed by column name
+ *      (JSON_OBJECT), an array of arrays (JSON_ARRAY) or an object
+ *      with one array of values per column (JSON_COLUMNAR).
+ *
+ * Results:
+ *      Tcl result code, the JSON text as interp result.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SelectJson(Tcl_Interp *interp, Ns_DbHandle *handle, const char *sql, JsonShape shape)
+{
+    Context           *ctx = (Context *) handle->context;
+    const MYSQL_FIELD *fields;
+    char             **values;
+    unsigned long     *lengths;
+    unsigned int       i, ncols;
+    unsigned long      nrows = 0u;
+    Tcl_DString        ds, keys, *columns = NULL;
+    TCL_SIZE_T        *keyOffsets;
+    int                rc;
+
+    if (handle->fetchingRows) {
+        Tcl_AppendResult(interp, "handle has rows waiting to fetch", NULL);
+        return TCL_ERROR;
+    }
+
+    /*
+     * The rows are copied into the JSON text right away, so they are
+     * streamed rather than stored a second time.
+     */
+    ctx->compressNext = NS_TRUE;
+    if (RunSelect(interp, handle, sql, RESULT_USE) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    fields = (ctx->cachePtr != NULL) ? ctx->cachePtr->fields : mysql_fetch_fields((MYSQL_RES *) handle->statement);
+    ncols = (ctx->cachePtr != NULL) ? ctx->cachePtr->ncols : mysql_num_fields((MYSQL_RES *) handle->statement);
+    Tcl_DStringInit(&ds);
+    Tcl_DStringInit(&keys);
+    keyOffsets = JsonKeys(&keys, fields, ncols);
+    if (shape == JSON_COLUMNAR) {
+        columns = ns_malloc(sizeof(Tcl_DString) * ncols);
+        for (i = 0u; i < ncols; i++) {
+            Tcl_DStringInit(&columns[i]);
+        }
+    } else {
+        Tcl_DStringAppend(&ds, "[", 1);
+    }
+
+    while ((rc = FetchRow(handle, &fields, &ncols, &values, &lengths)) == NS_OK) {
+        switch (shape) {
+        case JSON_OBJECT:
+            Tcl_DStringAppend(&ds, nrows > 0u ? ",{" : "{", TCL_INDEX_NONE);
+            for (i = 0u; i < ncols; i++) {
+                Tcl_DStringAppend(&ds, Tcl_DStringValue(&keys) + keyOffsets[i],
+                                  keyOffsets[i + 1u] - keyOffsets[i]);
+                JsonValue(&ds, &fields[i], values[i], lengths[i], ctx->binaryEncoding);
+            }
+            Tcl_DStringAppend(&ds, "}", 1);
+            break;
+
+        case JSON_ARRAY:
+            Tcl_DStringAppend(&ds, nrows > 0u ? ",[" : "[", TCL_INDEX_NONE);
+            for (i = 0u; i < ncols; i++) {
+                if (i > 0u) {
+                    Tcl_DStringAppend(&ds, ",", 1);
+                }
+                JsonValue(&ds, &fields[i], values[i], lengths[i], ctx->binaryEncoding);
+            }
+            Tcl_DStringAppend(&ds, "]", 1);
+            break;
+
+        case JSON_COLUMNAR:
+            for (i = 0u; i < ncols; i++) {
+                if (nrows > 0u) {
+                    Tcl_DStringAppend(&columns[i], ",", 1);
+                }
+                JsonValue(&columns[i], &fields[i], values[i], lengths[i], ctx->binaryEncoding);
+            }
+            break;
+        }
+        nrows++;
+    }
+
+    if (shape == JSON_COLUMNAR) {
+        Tcl_DStringAppend(&ds, "{", 1);
+        for (i = 0u; i < ncols; i++) {
+            Tcl_DStringAppend(&ds, Tcl_DStringValue(&keys) + keyOffsets[i],
+                              keyOffsets[i + 1u] - keyOffsets[i]);
+            Tcl_DStringAppend(&ds, "[", 1);
+            Tcl_DStringAppend(&ds, Tcl_DStringValue(&columns[i]), Tcl_DStringLength(&columns[i]));
+            Tcl_DStringAppend(&ds, "]", 1);
+            Tcl_DStringFree(&columns[i]);
+        }
+        Tcl_DStringAppend(&ds, "}", 1);
+        ns_free(columns);
+    } else {
+        Tcl_DStringAppend(&ds, "]", 1);
+    }
+    Tcl_DStringFree(&keys);
+    ns_free(keyOffsets);
+
+    if (rc != NS_END_DATA) {
+        Tcl_DStringFree(&ds);
+        Tcl_DStringResult(interp, &handle->dsExceptionMsg);
+        return TCL_ERROR;
+    }
+    Tcl_DStringResult(interp, &ds);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SelectAll --
+ *
+ *      Run a query and return the whole result as one Tcl structure,
+ *      built in a single pass over the stored result: a list of row
+ *      lists (ALL_ROWS), a list of dicts (ALL_DICTS), a flat list of
+ *      all values (ALL_FLAT) or a dict of column value lists
+ *      (ALL_COLUMNS). The lists are allocated with their final size
+ *      from the row count, the column name objects are created once
+ *      and shared by all rows, and so is the empty object for NULL.
+ *      The dicts are created as key/value lists, which Tcl converts on
+ *      first dict access.
+ *
+ * Results:
+ *      Tcl result code, the structure as interp result.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SelectAll(Tcl_Interp *interp, Ns_DbHandle *handle, const char *sql, AllShape shape)
+{
+    Context           *ctx = (Context *) handle->context;
+    const MYSQL_FIELD *fields;
+    char             **values;
+    unsigned long     *lengths;
+    unsigned int       i, ncols;
+    TCL_SIZE_T         nrows, row = 0;
+    Tcl_Obj          **keys, **objv, *nullObj, *resultObj, **columnObjs = NULL;
+    bool              *binary;
+    int                rc;
+
+    if (handle->fetchingRows) {
+        Tcl_AppendResult(interp, "handle has rows waiting to fetch", NULL);
+        return TCL_ERROR;
+    }
+
+    /*
+     * The row count is needed up front.
+     */
+    ctx->compressNext = NS_TRUE;
+    if (RunSelect(interp, handle, sql, RESULT_STORE) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    if (ctx->cachePtr != NULL) {
+        fields = ctx->cachePtr->fields;
+        ncols = ctx->cachePtr->ncols;
+        nrows = (TCL_SIZE_T) ctx->cachePtr->nrows;
+    } else {
+        fields = mysql_fetch_fields((MYSQL_RES *) handle->statement);
+        ncols = mysql_num_fields((MYSQL_RES *) handle->statement);
+        nrows = (TCL_SIZE_T) mysql_num_rows((MYSQL_RES *) handle->statement);
+    }
+    nullObj = Tcl_NewObj();
+    Tcl_IncrRefCount(nullObj);
+    keys = ns_malloc(sizeof(Tcl_Obj *) * ncols * 3u);
+    objv = keys + ncols;
+    binary = ns_malloc(sizeof(bool) * ncols);
+    for (i = 0u; i < ncols; i++) {
+        keys[i] = Tcl_NewStringObj(fields[i].name, (TCL_SIZE_T) fields[i].name_length);
+        Tcl_IncrRefCount(keys[i]);
+        binary[i] = IsBinaryField(&fields[i]);
+    }
+
+    switch (shape) {
+    case ALL_FLAT:
+        resultObj = Tcl_NewListObj(nrows * (TCL_SIZE_T) ncols, NULL);
+        break;
+    case ALL_COLUMNS:
+        columnObjs = ns_malloc(sizeof(Tcl_Obj *) * ncols);
+        for (i = 0u; i < ncols; i++) {
+            columnObjs[i] = Tcl_NewListObj(nrows, NULL);
+        }
+        resultObj = NULL;
+        break;
+    case ALL_ROWS:
+    case ALL_DICTS:
+    default:
+        resultObj = Tcl_NewListObj(nrows, NULL);
+        break;
+    }
+
+    while ((rc = FetchRow(handle, &fields, &ncols, &values, &lengths)) == NS_OK) {
+        for (i = 0u; i < ncols; i++) {
+            Tcl_Obj *valueObj;
+
+            if (values[i] == NULL) {
+                valueObj = nullObj;
+            } else if (binary[i]) {
+                valueObj = Tcl_NewByteArrayObj((const unsigned char *) values[i], (TCL_SIZE_T) lengths[i]);
+            } else {
+                valueObj = Tcl_NewStringObj(values[i], (TCL_SIZE_T) lengths[i]);
+            }
+
+            switch (shape) {
+            case ALL_ROWS:
+                objv[i] = valueObj;
+                break;
+            case ALL_DICTS:
+                objv[2u * i] = keys[i];
+                objv[2u * i + 1u] = valueObj;
+                break;
+            case ALL_FLAT:
+                Tcl_ListObjAppendElement(NULL, resultObj, valueObj);
+                break;
+            case ALL_COLUMNS:
+                Tcl_ListObjAppendElement(NULL, columnObjs[i], valueObj);
+                break;
+            }
+        }
+        if (shape == ALL_ROWS) {
+            Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewListObj((TCL_SIZE_T) ncols, objv));
+        } else if (shape == ALL_DICTS) {
+            Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewListObj((TCL_SIZE_T) ncols * 2, objv));
+        }
+        row++;
+    }
+
+    if (shape == ALL_COLUMNS) {
+        for (i = 0u; i < ncols; i++) {
+            objv[2u * i] = keys[i];
+            objv[2u * i + 1u] = columnObjs[i];
+        }
+        resultObj = Tcl_NewListObj((TCL_SIZE_T) ncols * 2, objv);
+        ns_free(columnObjs);
+    }
+    for (i = 0u; i < ncols; i++) {
+        Tcl_DecrRefCount(keys[i]);
+    }
+    ns_free(keys);
+    ns_free(binary);
+    Tcl_DecrRefCount(nullObj);
+
+    if (rc != NS_END_DATA) {
+        Tcl_DecrRefCount(resultObj);
+        Tcl_DStringResult(interp, &handle->dsExceptionMsg);
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, resultObj);
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * KillQuery --
+ *
+ *      Abort the statement currently running on the connection of the
+ *      handle via "KILL QUERY" sent over a side connection.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Opens and closes a connection to the server.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+KillQuery(Ns_DbHandle *handle)
+{
+    const Context  *ctx = (Context *) handle->context;
+    MYSQL          *side;
+    char            sql[64];
+
+    side = Connect(handle, (ctx != NULL && ctx->replica >= 0)
+                   ? ctx->poolPtr->replicas[ctx->replica].datasource : handle->datasource,
+                   NS_FALSE, NS_FALSE, 0u);
+    if (side != NULL) {
+        snprintf(sql, sizeof(sql), "KILL QUERY %lu",
+                 mysql_thread_id((MYSQL *) handle->connection));
+        if (mysql_query(side, sql) != 0) {
+            Log(NULL, side);
+        }
+        mysql_close(side);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrepareStmt --
+ *
+ *      Return the prepared statement for the given SQL text from the
+ *      statement cache of the handle, preparing it on the server on a
+ *      cache miss. When the cache is full, the least recently used
+ *      statement is closed. With a cache size of 0, the statement is
+ *      not cached and closed by ReleaseStmt().
+ *
+ * Results:
+ *      Statement or NULL on error (message left in interp).
+ *
+ * Side effects:
+ *      Updates the cache hit and miss counters of the handle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Stmt *
+PrepareStmt(Tcl_Interp *interp, Ns_DbHandle *handle, const char *sql)
+{
+    Context        *ctx = (Context *) handle->context;
+    Tcl_HashEntry  *hPtr;
+    Stmt           *stmtPtr;
+    MYSQL_STMT     *stmt;
+    int             isNew;
+
+    hPtr = Tcl_FindHashEntry(&ctx->stmts, sql);
+    if (hPtr != NULL) {
+        stmtPtr = Tcl_GetHashValue(hPtr);
+        ctx->stmtHits++;
+
+        if (stmtPtr != ctx->firstStmtPtr) {
+            stmtPtr->prevPtr->nextPtr = stmtPtr->nextPtr;
+            if (stmtPtr->nextPtr != NULL) {
+                stmtPtr->nextPtr->prevPtr = stmtPtr->prevPtr;
+            } else {
+                ctx->lastStmtPtr = stmtPtr->prevPtr;
+            }
+            stmtPtr->prevPtr = NULL;
+            stmtPtr->nextPtr = ctx->firstStmtPtr;
+            ctx->firstStmtPtr->prevPtr = stmtPtr;
+            ctx->firstStmtPtr = stmtPtr;
+        }
+        return stmtPtr;
+    }
+    ctx->stmtMisses++;
+
+    stmt = mysql_stmt_init((MYSQL *) handle->connection);
+    if (stmt == NULL) {
+        Log(handle, (MYSQL *) handle->connection);
+        Tcl_AppendResult(interp, "mysql_stmt_init failed.", NULL);
+        return NULL;
+    }
+    if (mysql_stmt_prepare(stmt, sql, (unsigned long) strlen(sql)) != 0) {
+        (void) StmtError(interp, handle, stmt);
+        mysql_stmt_close(stmt);
+        return NULL;
+    }
+
+    stmtPtr = ns_calloc(1u, sizeof(Stmt));
+    stmtPtr->stmt = stmt;
+
+    if (ctx->poolPtr->stmtCacheSize > 0) {
+        if (ctx->stmts.numEntries >= ctx->poolPtr->stmtCacheSize) {
+            FreeStmt(ctx, ctx->lastStmtPtr);
+        }
+        stmtPtr->hPtr = Tcl_CreateHashEntry(&ctx->stmts, sql, &isNew);
+        Tcl_SetHashValue(stmtPtr->hPtr, stmtPtr);
+
+        stmtPtr->nextPtr = ctx->firstStmtPtr;
+        if (ctx->firstStmtPtr != NULL) {
+            ctx->firstStmtPtr->prevPtr = stmtPtr;
+        } else {
+            ctx->lastStmtPtr = stmtPtr;
+        }
+        ctx->firstStmtPtr = stmtPtr;
+    }
+
+    return stmtPtr;
+}
+
+static void
+ReleaseStmt(Context *ctx, Stmt *stmtPtr)
+{
+    if (stmtPtr->hPtr == NULL) {
+        FreeStmt(ctx, stmtPtr);
+    }
+}
+
+static void
+FreeStmt(Context *ctx, Stmt *stmtPtr)
+{
+    if (stmtPtr->hPtr != NULL) {
+        if (stmtPtr->prevPtr != NULL) {
+            stmtPtr->prevPtr->nextPtr = stmtPtr->nextPtr;
+        } else {
+            ctx->firstStmtPtr = stmtPtr->nextPtr;
+        }
+        if (stmtPtr->nextPtr != NULL) {
+            stmtPtr->nextPtr->prevPtr = stmtPtr->prevPtr;
+        } else {
+            ctx->lastStmtPtr = stmtPtr->prevPtr;
+        }
+        Tcl_DeleteHashEntry(stmtPtr->hPtr);
+    }
+    mysql_stmt_close(stmtPtr->stmt);
+    ns_free(stmtPtr);
+}
+
+static void
+FlushStmts(Context *ctx)
+{
+    while (ctx->firstStmtPtr != NULL) {
+        FreeStmt(ctx, ctx->firstStmtPtr);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ExecuteStmt --
+ *
+ *      Bind the elements of valuesObj as parameters of the prepared
+ *      statement and execute it. Elements equal to "null" (when not
+ *      NULL) are bound as SQL NULL, byte arrays as BLOB with their raw
+ *      bytes.
+ *
+ * Results:
+ *      Tcl result code. The interp result is the number of affected
+ *      rows for statements without result set, otherwise the list of
+ *      rows, each row being a list of column values. When "typed" is
+ *      set, the values are native Tcl integers, doubles and byte
+ *      arrays according to the column types.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ExecuteStmt(Tcl_Interp *interp, Ns_DbHandle *handle, Stmt *stmtPtr, const char *sql,
+            Tcl_Obj *valuesObj, const char *null, bool typed)
+{
+    MYSQL_STMT     *stmt = stmtPtr->stmt;
+    MYSQL_BIND     *binds = NULL;
+    unsigned long  *lengths = NULL;
+    unsigned long   nparams;
+    Tcl_Obj       **elems = NULL;
+    TCL_SIZE_T      nelems = 0, i;
+    Ns_Time         start;
+    int             result, rc;
+
+    if (valuesObj != NULL
+        && Tcl_ListObjGetElements(interp, valuesObj, &nelems, &elems) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    nparams = mysql_stmt_param_count(stmt);
+    if ((unsigned long) nelems != nparams) {
+        Ns_TclPrintfResult(interp, "statement expects %lu parameters, %ld given",
+                           nparams, (long) nelems);
+        return TCL_ERROR;
+    }
+
+    if (nparams > 0u) {
+        binds = ns_calloc((size_t) nparams, sizeof(MYSQL_BIND));
+        lengths = ns_calloc((size_t) nparams, sizeof(unsigned long));
+
+        for (i = 0; i < nelems; i++) {
+            TCL_SIZE_T length;
+            bool       binary = IsByteArray(elems[i]);
+
+            if (binary) {
+                binds[i].buffer = (void *) Tcl_GetByteArrayFromObj(elems[i], &length);
+            } else {
+                binds[i].buffer = (void *) Tcl_GetStringFromObj(elems[i], &length);
+            }
+            if (null != NULL && (size_t) length == strlen(null)
+                && memcmp(binds[i].buffer, null, (size_t) length) == 0) {
+                binds[i].buffer_type = MYSQL_TYPE_NULL;
+                continue;
+            }
+            binds[i].buffer_type = binary ? MYSQL_TYPE_BLOB : MYSQL_TYPE_STRING;
+            lengths[i] = (unsigned long) length;
+            binds[i].buffer_length = lengths[i];
+            binds[i].length = &lengths[i];
+        }
+    }
+
+    if (binds != NULL && mysql_stmt_bind_param(stmt, binds) != 0) {
+        ns_free(binds);
+        ns_free(lengths);
+        return StmtError(interp, handle, stmt);
+    }
+
+    Ns_GetTime(&start);
+    rc = mysql_stmt_execute(stmt);
+    StatsQuery(handle, (mysql_stmt_field_count(stmt) == 0u) ? STATS_DML : STATS_SELECT, sql, &start);
+
+    if (rc != 0) {
+        result = StmtError(interp, handle, stmt);
+
+    } else if (mysql_stmt_field_count(stmt) == 0u) {
+        SessionTrack((Context *) handle->context, sql);
+        Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt) mysql_stmt_affected_rows(stmt)));
+        result = TCL_OK;
+
+    } else {
+        result = StmtRows(interp, handle, stmt, typed);
+    }
+
+    /*
+     * The rows were read right away, account the query now.
+     */
+    FlushQuery(handle);
+
+    ns_free(binds);
+    ns_free(lengths);
+
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StmtRows --
+ *
+ *      Fetch the full result set of an executed statement into a list
+ *      of rows.
+ *
+ * Results:
+ *      Tcl result code.
+ *
+ * Side effects:
+ *      The result of the statement is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+StmtRows(Tcl_Interp *interp, Ns_DbHandle *handle, MYSQL_STMT *stmt, bool typed)
+{
+    MYSQL_RES      *meta;
+    Bindings        bindings;
+    Tcl_Obj        *listObj, *rowObj;
+    unsigned int    i;
+    my_bool         updateMaxLength = 1;
+    int             rc, result = TCL_OK;
+
+    (void) mysql_stmt_attr_set(stmt, STMT_ATTR_UPDATE_MAX_LENGTH, &updateMaxLength);
+    if (mysql_stmt_store_result(stmt) != 0) {
+        return StmtError(interp, handle, stmt);
+    }
+
+    meta = mysql_stmt_result_metadata(stmt);
+    if (meta == NULL) {
+        (void) mysql_stmt_free_result(stmt);
+        return StmtError(interp, handle, stmt);
+    }
+
+    if (BindResult(stmt, &bindings, mysql_fetch_fields(meta), mysql_num_fields(meta), typed) != 0) {
+        result = StmtError(interp, handle, stmt);
+    } else {
+        listObj = Tcl_NewListObj(0, NULL);
+
+        while ((rc = FetchBound(stmt, &bindings)) == 0) {
+            rowObj = Tcl_NewListObj(0, NULL);
+            for (i = 0u; i < bindings.ncols; i++) {
+                Tcl_ListObjAppendElement(NULL, rowObj, BoundObj(stmt, &bindings, i));
+            }
+            Tcl_ListObjAppendElement(NULL, listObj, rowObj);
+        }
+
+        if (rc == MYSQL_NO_DATA) {
+            Tcl_SetObjResult(interp, listObj);
+        } else {
+            Tcl_DecrRefCount(listObj);
+            result = StmtError(interp, handle, stmt);
+        }
+    }
+
+    FreeBindings(&bindings);
+    mysql_free_result(meta);
+    (void) mysql_stmt_free_result(stmt);
+
+    return result;
+}
+
+static int
+StmtError(Tcl_Interp *interp, Ns_DbHandle *handle, MYSQL_STMT *stmt)
+{
+    unsigned int nErr = mysql_stmt_errno(stmt);
+
+    Ns_Log(Error, "MySQL log message: (%u) '%s'", nErr, mysql_stmt_error(stmt));
+    snprintf(handle->cExceptionCode, sizeof(handle->cExceptionCode), "%u", nErr);
+    Tcl_DStringFree(&(handle->dsExceptionMsg));
+    Tcl_DStringAppend(&(handle->dsExceptionMsg), mysql_stmt_error(stmt), TCL_INDEX_NONE);
+
+    if (interp != NULL) {
+        Tcl_AppendResult(interp, mysql_stmt_error(stmt), NULL);
+    }
+    return TCL_ERROR;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BindResult, FetchBound, BoundValue, BoundObj, FreeBindings --
+ *
+ *      Bind buffers to the result columns of a statement and fetch rows
+ *      into them. String buffers are sized from max_length when known
+ *      and grown on demand when a value was truncated. For typed
+ *      bindings, integer and floating point columns are fetched in
+ *      binary form, so no string conversion takes place on either side;
+ *      only FLOAT values are formatted with their own precision.
+ *
+ * Results:
+ *      BindResult and FetchBound return the MySQL status code,
+ *      BoundValue the column value as string or NULL for SQL NULL,
+ *      BoundObj the column value as Tcl object.
+ *
+ * Side effects:
+ *      Memory of the buffers is released by FreeBindings.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+BindResult(MYSQL_STMT *stmt, Bindings *bindPtr, const MYSQL_FIELD *fields, unsigned int ncols, bool typed)
+{
+    unsigned int i;
+
+    bindPtr->ncols = ncols;
+    bindPtr->binds = ns_calloc(ncols, sizeof(MYSQL_BIND));
+    bindPtr->lengths = ns_calloc(ncols, sizeof(unsigned long));
+    bindPtr->nulls = ns_calloc(ncols, sizeof(my_bool));
+    bindPtr->errors = ns_calloc(ncols, sizeof(my_bool));
+    bindPtr->binary = ns_calloc(ncols, sizeof(bool));
+    bindPtr->rebind = NS_FALSE;
+
+    for (i = 0u; i < ncols; i++) {
+        unsigned long size;
+
+        switch (typed ? fields[i].type : MYSQL_TYPE_STRING) {
+        case MYSQL_TYPE_TINY:
+        case MYSQL_TYPE_SHORT:
+        case MYSQL_TYPE_LONG:
+        case MYSQL_TYPE_INT24:
+        case MYSQL_TYPE_LONGLONG:
+        case MYSQL_TYPE_YEAR:
+            bindPtr->binds[i].buffer_type = MYSQL_TYPE_LONGLONG;
+            bindPtr->binds[i].is_unsigned = ((fields[i].flags & UNSIGNED_FLAG) != 0u);
+            size = sizeof(long long);
+            break;
+
+        case MYSQL_TYPE_FLOAT:
+            bindPtr->binds[i].buffer_type = MYSQL_TYPE_FLOAT;
+            size = sizeof(float);
+            break;
+
+        case MYSQL_TYPE_DOUBLE:
+            bindPtr->binds[i].buffer_type = MYSQL_TYPE_DOUBLE;
+            size = sizeof(double);
+            break;
+
+        default:
+            bindPtr->binds[i].buffer_type = MYSQL_TYPE_STRING;
+            bindPtr->binary[i] = (typed && IsBinaryField(&fields[i]));
+            size = fields[i].max_length + 1u;
+            if (size < 64u) {
+                size = 64u;
+            }
+            break;
+        }
+        bindPtr->binds[i].buffer = ns_malloc(size);
+        bindPtr->binds[i].buffer_length = size;
+        bindPtr->binds[i].length = &bindPtr->lengths[i];
+        bindPtr->binds[i].is_null = &bindPtr->nulls[i];
+        bindPtr->binds[i].error = &bindPtr->errors[i];
+    }
+
+    return (int) mysql_stmt_bind_result(stmt, bindPtr->binds);
+}
+
+static int
+FetchBound(MYSQL_STMT *stmt, Bindings *bindPtr)
+{
+    int rc;
+
+    if (bindPtr->rebind) {
+        bindPtr->rebind = NS_FALSE;
+        if (mysql_stmt_bind_result(stmt, bindPtr->binds) != 0) {
+            return 1;
+        }
+    }
+    rc = mysql_stmt_fetch(stmt);
+
+    return (rc == MYSQL_DATA_TRUNCATED) ? 0 : rc;
+}
+
+static const char *
+BoundValue(MYSQL_STMT *stmt, Bindings *bindPtr, unsigned int i, unsigned long *lengthPtr)
+{
+    MYSQL_BIND *bindingPtr = &bindPtr->binds[i];
+
+    if (bindPtr->nulls[i]) {
+        *lengthPtr = 0u;
+        return NULL;
+    }
+    if (bindPtr->errors[i]) {
+        /*
+         * The value did not fit; grow the buffer and fetch the column
+         * again. The new buffer is bound for the following rows.
+         */
+        bindingPtr->buffer_length = bindPtr->lengths[i] + 1u;
+        bindingPtr->buffer = ns_realloc(bindingPtr->buffer, bindingPtr->buffer_length);
+        (void) mysql_stmt_fetch_column(stmt, bindingPtr, i, 0u);
+        bindPtr->errors[i] = 0;
+        bindPtr->rebind = NS_TRUE;
+    }
+    *lengthPtr = bindPtr->lengths[i];
+
+    return (const char *) bindingPtr->buffer;
+}
+
+static Tcl_Obj *
+BoundObj(MYSQL_STMT *stmt, Bindings *bindPtr, unsigned int i)
+{
+    const MYSQL_BIND *bindingPtr = &bindPtr->binds[i];
+    const char       *value;
+    unsigned long     length;
+
+    if (bindPtr->nulls[i]) {
+        return Tcl_NewObj();
+    }
+
+    switch (bindingPtr->buffer_type) {
+    case MYSQL_TYPE_LONGLONG:
+        if (bindingPtr->is_unsigned
+            && *(unsigned long long *) bindingPtr->buffer > (unsigned long long) LLONG_MAX) {
+            char buffer[TCL_INTEGER_SPACE + 1];
+
+            snprintf(buffer, sizeof(buffer), "%llu", *(unsigned long long *) bindingPtr->buffer);
+            return Tcl_NewStringObj(buffer, TCL_INDEX_NONE);
+        }
+        return Tcl_NewWideIntObj((Tcl_WideInt) *(long long *) bindingPtr->buffer);
+
+    case MYSQL_TYPE_FLOAT: {
+        /*
+         * A FLOAT widened to double shows digits beyond its precision;
+         * format it like the server does in the text protocol.
+         */
+        char buffer[TCL_DOUBLE_SPACE];
+
+        snprintf(buffer, sizeof(buffer), "%.*g", FLT_DIG, (double) *(float *) bindingPtr->buffer);
+        return Tcl_NewStringObj(buffer, TCL_INDEX_NONE);
+    }
+
+    case MYSQL_TYPE_DOUBLE:
+        return Tcl_NewDoubleObj(*(double *) bindingPtr->buffer);
+
+    default:
+        value = BoundValue(stmt, bindPtr, i, &length);
+        if (bindPtr->binary[i]) {
+            return Tcl_NewByteArrayObj((const unsigned char *) value, (TCL_SIZE_T) length);
+        }
+        return Tcl_NewStringObj(value, (TCL_SIZE_T) length);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IsBinaryField --
+ *
+ *      Check whether a column carries binary data (BLOB, BINARY,
+ *      VARBINARY, BIT), i.e. a string type with the "binary" character
+ *      set (charsetnr 63). Numeric and temporal columns report the
+ *      binary character set as well and are excluded.
+ *
+ * Results:
+ *      Boolean.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+IsBinaryField(const MYSQL_FIELD *fieldPtr)
+{
+    switch (fieldPtr->type) {
+    case MYSQL_TYPE_BIT:
+    case MYSQL_TYPE_GEOMETRY:
+        return NS_TRUE;
+
+    case MYSQL_TYPE_STRING:
+    case MYSQL_TYPE_VAR_STRING:
+    case MYSQL_TYPE_VARCHAR:
+    case MYSQL_TYPE_TINY_BLOB:
+    case MYSQL_TYPE_MEDIUM_BLOB:
+    case MYSQL_TYPE_LONG_BLOB:
+    case MYSQL_TYPE_BLOB:
+        return (fieldPtr->charsetnr == 63u);
+
+    default:
+        return NS_FALSE;
+    }
+}
+
+static void
+FreeBindings(Bindings *bindPtr)
+{
+    unsigned int i;
+
+    for (i = 0u; i < bindPtr->ncols; i++) {
+        ns_free(bindPtr->binds[i].buffer);
+    }
+    ns_free(bindPtr->binds);
+    ns_free(bindPtr->lengths);
+    ns_free(bindPtr->nulls);
+    ns_free(bindPtr->errors);
+    ns_free(bindPtr->binary);
+    bindPtr->ncols = 0u;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BulkInsert --
+ *
+ *      Insert a list of rows into a table with multi-row INSERT
+ *      statements. Each statement takes as many rows as fit into the
+ *      max_allowed_packet limit of the server. Values equal to "null"
+ *      (when not NULL) are inserted as NULL. Byte arrays are inserted
+ *      with their raw bytes as binary literals.
+ *
+ * Results:
+ *      Tcl result code, the interp result is the total number of
+ *      affected rows.
+ *
+ * Side effects:
+ *      Rows are inserted; on error, rows of statements sent before
+ *      remain inserted unless the caller uses a transaction.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+BulkInsert(Tcl_Interp *interp, Ns_DbHandle *handle, Tcl_Obj *tableObj,
+           Tcl_Obj *columnsObj, Tcl_Obj *rowsObj, bool ignore, const char *onDup,
+           const char *null)
+{
+    MYSQL          *mysql;
+    Tcl_DString     sql, row, suffix;
+    Tcl_Obj       **columns, **rows, **values;
+    TCL_SIZE_T      ncolumns, nrows, nvalues, i, j, prefixLength;
+    unsigned long   maxPacket;
+    Tcl_WideInt     affected = 0;
+    Ns_Time         start;
+    int             result = TCL_OK, rc;
+
+    if (Tcl_ListObjGetElements(interp, columnsObj, &ncolumns, &columns) != TCL_OK
+        || Tcl_ListObjGetElements(interp, rowsObj, &nrows, &rows) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (ncolumns == 0) {
+        Tcl_AppendResult(interp, "no columns specified", NULL);
+        return TCL_ERROR;
+    }
+    RouteWrite(handle);
+    mysql = (MYSQL *) handle->connection;
+
+    /*
+     * Leave some room for the packet header and rounding.
+     */
+    maxPacket = GetMaxPacket(handle);
+    if (maxPacket > 1024u) {
+        maxPacket -= 1024u;
+    }
+
+    Tcl_DStringInit(&sql);
+    Tcl_DStringInit(&row);
+    Tcl_DStringInit(&suffix);
+
+    Tcl_DStringAppend(&sql, ignore ? "INSERT IGNORE INTO " : "INSERT INTO ", TCL_INDEX_NONE);
+    AppendTable(&sql, Tcl_GetString(tableObj));
+
+    Tcl_DStringAppend(&sql, " (", 2);
+    for (i = 0; i < ncolumns; i++) {
+        if (i > 0) {
+            Tcl_DStringAppend(&sql, ",", 1);
+        }
+        AppendIdentifier(&sql, Tcl_GetString(columns[i]));
+    }
+    Tcl_DStringAppend(&sql, ") VALUES ", TCL_INDEX_NONE);
+    prefixLength = Tcl_DStringLength(&sql);
+
+    if (onDup != NULL) {
+        Ns_DStringVarAppend(&suffix, " ON DUPLICATE KEY UPDATE ", onDup, NULL);
+    }
+
+    for (i = 0; i <= nrows; i++) {
+        bool flush;
+
+        Tcl_DStringSetLength(&row, 0);
+
+        if (i < nrows) {
+            if (Tcl_ListObjGetElements(interp, rows[i], &nvalues, &values) != TCL_OK) {
+                result = TCL_ERROR;
+                break;
+            }
+            if (nvalues != ncolumns) {
+                Ns_TclPrintfResult(interp, "row %ld has %ld values, expected %ld",
+                                   (long) i, (long) nvalues, (long) ncolumns);
+                result = TCL_ERROR;
+                break;
+            }
+            Tcl_DStringAppend(&row, "(", 1);
+            for (j = 0; j < nvalues; j++) {
+                TCL_SIZE_T  length;
+                const char *value;
+                bool        binary = IsByteArray(values[j]);
+
+                if (binary) {
+                    value = (const char *) Tcl_GetByteArrayFromObj(values[j], &length);
+                } else {
+                    value = Tcl_GetStringFromObj(values[j], &length);
+                }
+                if (j > 0) {
+                    Tcl_DStringAppend(&row, ",", 1);
+                }
+                if (null != NULL && (size_t) length == strlen(null)
+                    && memcmp(value, null, (size_t) length) == 0) {
+                    Tcl_DStringAppend(&row, "NULL", 4);
+                } else {
+                    if (binary) {
+                        Tcl_DStringAppend(&row, "_binary", 7);
+                    }
+                    AppendLiteral(&row, mysql, value, length);
+                }
+            }
+            Tcl_DStringAppend(&row, ")", 1);
+
+            if ((unsigned long) (prefixLength + Tcl_DStringLength(&row) + Tcl_DStringLength(&suffix))
+                > maxPacket) {
+                Ns_TclPrintfResult(interp, "row %ld exceeds max_allowed_packet (%lu bytes)",
+                                   (long) i, maxPacket);
+                result = TCL_ERROR;
+                break;
+            }
+            flush = ((unsigned long) (Tcl_DStringLength(&sql) + 1 + Tcl_DStringLength(&row)
+                                      + Tcl_DStringLength(&suffix)) > maxPacket);
+        } else {
+            flush = NS_TRUE;
+        }
+
+        if (flush && Tcl_DStringLength(&sql) > prefixLength) {
+            Tcl_DStringAppend(&sql, Tcl_DStringValue(&suffix), Tcl_DStringLength(&suffix));
+            Ns_GetTime(&start);
+            rc = mysql_real_query(mysql, Tcl_DStringValue(&sql), (unsigned long) Tcl_DStringLength(&sql));
+            StatsQuery(handle, STATS_DML, Tcl_DStringValue(&sql), &start);
+            if (rc != 0) {
+                Log(handle, mysql);
+                Tcl_AppendResult(interp, mysql_error(mysql), NULL);
+                result = TCL_ERROR;
+                break;
+            }
+            affected += (Tcl_WideInt) mysql_affected_rows(mysql);
+            CacheWrite(handle, Tcl_DStringValue(&sql));
+            Tcl_DStringSetLength(&sql, prefixLength);
+        }
+
+        if (i < nrows) {
+            if (Tcl_DStringLength(&sql) > prefixLength) {
+                Tcl_DStringAppend(&sql, ",", 1);
+            }
+            Tcl_DStringAppend(&sql, Tcl_DStringValue(&row), Tcl_DStringLength(&row));
+        }
+    }
+
+    Tcl_DStringFree(&sql);
+    Tcl_DStringFree(&row);
+    Tcl_DStringFree(&suffix);
+
+    if (result == TCL_OK) {
+        Tcl_SetObjResult(interp, Tcl_NewWideIntObj(affected));
+    }
+    return result;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IsByteArray --
+ *
+ *      Check whether a value is a byte array, i.e. binary data that
+ *      must be passed on as its raw bytes rather than its string
+ *      representation.
+ *
+ * Results:
+ *      NS_TRUE for a byte array.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+IsByteArray(const Tcl_Obj *objPtr)
+{
+    static const Tcl_ObjType *byteArrayTypePtr = NULL;
+
+    if (byteArrayTypePtr == NULL) {
+        byteArrayTypePtr = Tcl_GetObjType("bytearray");
+    }
+    return (objPtr->typePtr != NULL && objPtr->typePtr == byteArrayTypePtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoadBytes --
+ *
+ *      Provide the bytes of the -data value of "ns_mysql load_data".
+ *      A byte array is sent as is. Any other value is text, converted
+ *      to the character set of the data: UTF-8 by default or for the
+ *      utf8 character sets, cp1252 for latin1, otherwise the Tcl
+ *      encoding of the same name.
+ *
+ * Results:
+ *      Tcl result code, an error for a character set without Tcl
+ *      encoding.
+ *
+ * Side effects:
+ *      Sets the data of infilePtr, pointing into dataObj or dsPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+LoadBytes(Tcl_Interp *interp, Tcl_Obj *dataObj, const char *charset, Tcl_DString *dsPtr,
+          Infile *infilePtr)
+{
+    const char   *name, *string;
+    Tcl_Encoding  encoding;
+    TCL_SIZE_T    length;
+
+    if (IsByteArray(dataObj)) {
+        infilePtr->data = Tcl_GetByteArrayFromObj(dataObj, &infilePtr->length);
+        if (infilePtr->data != NULL) {
+            return TCL_OK;
+        }
+    }
+
+    if (charset == NULL || strncasecmp(charset, "utf8", 4u) == 0) {
+        name = "utf-8";
+    } else if (strcasecmp(charset, "latin1") == 0) {
+        name = "cp1252";
+    } else {
+        name = charset;
+    }
+    encoding = Tcl_GetEncoding(NULL, name);
+    if (encoding == NULL) {
+        Tcl_AppendResult(interp, "no encoding for charset \"", charset,
+                         "\": pass the data as byte array", NULL);
+        return TCL_ERROR;
+    }
+    string = Tcl_GetStringFromObj(dataObj, &length);
+    (void) Tcl_UtfToExternalDString(encoding, string, length, dsPtr);
+    Tcl_FreeEncoding(encoding);
+    infilePtr->data = (const unsigned char *) Tcl_DStringValue(dsPtr);
+    infilePtr->length = Tcl_DStringLength(dsPtr);
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LoadData --
+ *
+ *      Load rows into a table with LOAD DATA LOCAL INFILE, with the
+ *      data read from a Tcl channel or a byte array by the infile
+ *      handler of the connection while the server asks for it. Only a
+ *      buffer of the client library is used, so memory usage does not
+ *      depend on the amount of data.
+ *
+ * Results:
+ *      Tcl result code, a dict with rows, deleted, skipped, warnings,
+ *      bytes and time (microseconds) as interp result.
+ *
+ * Side effects:
+ *      Rows are inserted.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+LoadData(Tcl_Interp *interp, Ns_DbHandle *handle, const char *table, Infile *infilePtr,
+         const LoadOptions *optionsPtr)
+{
+    Context        *ctx = (Context *) handle->context;
+    MYSQL          *mysql;
+    Tcl_DString     sql;
+    Tcl_Obj        *dictObj, **columns;
+    TCL_SIZE_T      ncolumns = 0, i;
+    unsigned long   records = 0u, deleted = 0u, skipped = 0u, warnings = 0u;
+    unsigned long   usec;
+    const char     *info;
+    Ns_Time         start;
+    int             rc;
+
+    if (!ctx->poolPtr->localInfile) {
+        Tcl_AppendResult(interp, "load_data requires the pool parameter localinfile", NULL);
+        return TCL_ERROR;
+    }
+    if (handle->fetchingRows) {
+        Tcl_AppendResult(interp, "handle has rows waiting to fetch", NULL);
+        return TCL_ERROR;
+    }
+    if (optionsPtr->columnsObj != NULL
+        && Tcl_ListObjGetElements(interp, optionsPtr->columnsObj, &ncolumns, &columns) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    RouteWrite(handle);
+    mysql = (MYSQL *) handle->connection;
+
+    /*
+     * The file name is not used, the handler reads from infilePtr.
+     */
+    Tcl_DStringInit(&sql);
+    Tcl_DStringAppend(&sql, "LOAD DATA LOCAL INFILE 'ns_mysql' ", TCL_INDEX_NONE);
+    if (optionsPtr->replace) {
+        Tcl_DStringAppend(&sql, "REPLACE ", TCL_INDEX_NONE);
+    } else if (optionsPtr->ignore) {
+        Tcl_DStringAppend(&sql, "IGNORE ", TCL_INDEX_NONE);
+    }
+    Tcl_DStringAppend(&sql, "INTO TABLE ", TCL_INDEX_NONE);
+    AppendTable(&sql, table);
+    if (optionsPtr->charset != NULL) {
+        Tcl_DStringAppend(&sql, " CHARACTER SET ", TCL_INDEX_NONE);
+        AppendIdentifier(&sql, optionsPtr->charset);
+    }
+    if (optionsPtr->csv) {
+        Tcl_DStringAppend(&sql, " FIELDS TERMINATED BY ',' OPTIONALLY ENCLOSED BY '\"' ESCAPED BY ''",
+                          TCL_INDEX_NONE);
+    }
+    Tcl_DStringAppend(&sql, " LINES TERMINATED BY ", TCL_INDEX_NONE);
+    AppendLiteral(&sql, mysql, optionsPtr->lineEnd, (TCL_SIZE_T) strlen(optionsPtr->lineEnd));
+    if (optionsPtr->ignoreLines > 0) {
+        Ns_DStringPrintf(&sql, " IGNORE %d LINES", optionsPtr->ignoreLines);
+    }
+    if (ncolumns > 0) {
+        Tcl_DStringAppend(&sql, " (", 2);
+        for (i = 0; i < ncolumns; i++) {
+            if (i > 0) {
+                Tcl_DStringAppend(&sql, ",", 1);
+            }
+            AppendIdentifier(&sql, Tcl_GetString(columns[i]));
+        }
+        Tcl_DStringAppend(&sql, ")", 1);
+    }
+
+    ctx->infilePtr = infilePtr;
+    Ns_GetTime(&start);
+    rc = mysql_real_query(mysql, Tcl_DStringValue(&sql), (unsigned long) Tcl_DStringLength(&sql));
+    usec = Elapsed(&start);
+    ctx->infilePtr = NULL;
+    Log(handle, mysql);
+    StatsQuery(handle, STATS_DML, Tcl_DStringValue(&sql), &start);
+    CacheWrite(handle, Tcl_DStringValue(&sql));
+    Tcl_DStringFree(&sql);
+
+    if (rc != 0) {
+        Tcl_AppendResult(interp, mysql_error(mysql), NULL);
+        return TCL_ERROR;
+    }
+
+    info = mysql_info(mysql);
+    if (info == NULL || sscanf(info, "Records: %lu Deleted: %lu Skipped: %lu Warnings: %lu",
+                               &records, &deleted, &skipped, &warnings) != 4) {
+        records = (unsigned long) mysql_affected_rows(mysql);
+        warnings = mysql_warning_count(mysql);
+    }
+
+    dictObj = Tcl_NewDictObj();
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("rows", 4), Tcl_NewWideIntObj((Tcl_WideInt) records));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("deleted", 7), Tcl_NewWideIntObj((Tcl_WideInt) deleted));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("skipped", 7), Tcl_NewWideIntObj((Tcl_WideInt) skipped));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("warnings", 8), Tcl_NewWideIntObj((Tcl_WideInt) warnings));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("bytes", 5), Tcl_NewWideIntObj(infilePtr->bytes));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("time", 4), Tcl_NewWideIntObj((Tcl_WideInt) usec));
+    Tcl_SetObjResult(interp, dictObj);
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InfileInit, InfileRead, InfileEnd, InfileError --
+ *
+ *      LOAD DATA LOCAL INFILE handler of connections of pools with
+ *      localinfile enabled. The data comes from the source of the
+ *      running "ns_mysql load_data"; requests of the server at any
+ *      other time are refused, so the server can never read local
+ *      files.
+ *
+ * Results:
+ *      See mysql_set_local_infile_handler().
+ *
+ * Side effects:
+ *      Reads from the channel of the load.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+InfileInit(void **ptr, const char *UNUSED(filename), void *userdata)
+{
+    const Context *ctx = (Context *) userdata;
+
+    *ptr = userdata;
+    return (ctx->infilePtr != NULL) ? 0 : 1;
+}
+
+static int
+InfileRead(void *ptr, char *buf, unsigned int length)
+{
+    Infile     *infilePtr = ((Context *) ptr)->infilePtr;
+    TCL_SIZE_T  n;
+
+    if (infilePtr->chan != NULL) {
+        n = Tcl_Read(infilePtr->chan, buf, (TCL_SIZE_T) length);
+        if (n < 0) {
+            return -1;
+        }
+    } else {
+        n = infilePtr->length - infilePtr->offset;
+        if (n > (TCL_SIZE_T) length) {
+            n = (TCL_SIZE_T) length;
+        }
+        memcpy(buf, infilePtr->data + infilePtr->offset, (size_t) n);
+        infilePtr->offset += n;
+    }
+    infilePtr->bytes += n;
+
+    return (int) n;
+}
+
+static void
+InfileEnd(void *UNUSED(ptr))
+{
+}
+
+static int
+InfileError(void *ptr, char *msg, unsigned int length)
+{
+    const Context *ctx = (Context *) ptr;
+
+    if (ctx->infilePtr == NULL) {
+        snprintf(msg, length, "LOAD DATA LOCAL is only allowed by ns_mysql load_data");
+    } else {
+        snprintf(msg, length, "error reading load_data channel: %s",
+                 Tcl_ErrnoMsg(Tcl_GetErrno()));
+    }
+    return 2000;                    /* CR_UNKNOWN_ERROR */
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetMaxPacket --
+ *
+ *      Return the max_allowed_packet setting of the server, queried
+ *      once per connection.
+ *
+ * Results:
+ *      Size in bytes; the protocol default of 4MB when the query fails.
+ *
+ * Side effects:
+ *      May send a query to the server.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned long
+GetMaxPacket(Ns_DbHandle *handle)
+{
+    Context        *ctx = (Context *) handle->context;
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+
+    if (ctx->maxPacket == 0u) {
+        MYSQL_RES *result;
+        MYSQL_ROW  row;
+
+        ctx->maxPacket = 4u * 1024u * 1024u;
+        if (mysql_query(mysql, "SELECT @@max_allowed_packet") == 0
+            && (result = mysql_store_result(mysql)) != NULL) {
+            row = mysql_fetch_row(result);
+            if (row != NULL && row[0] != NULL) {
+                ctx->maxPacket = strtoul(row[0], NULL, 10);
+            }
+            mysql_free_result(result);
+        } else {
+            Log(handle, mysql);
+        }
+    }
+    return ctx->maxPacket;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendIdentifier, AppendTable, AppendLiteral --
+ *
+ *      Append a quoted identifier, table name (optionally qualified by
+ *      the database) or string literal to the SQL text in the DString.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AppendIdentifier(Tcl_DString *dsPtr, const char *name)
+{
+    const char *p;
+
+    Tcl_DStringAppend(dsPtr, "`", 1);
+    for (p = name; *p != '\0'; p++) {
+        if (*p == '`') {
+            Tcl_DStringAppend(dsPtr, "`", 1);
+        }
+        Tcl_DStringAppend(dsPtr, p, 1);
+    }
+    Tcl_DStringAppend(dsPtr, "`", 1);
+}
+
+static void
+AppendTable(Tcl_DString *dsPtr, const char *name)
+{
+    char *table = ns_strdup(name), *dot;
+
+    dot = strchr(table, '.');
+    if (dot != NULL) {
+        *dot = '\0';
+        AppendIdentifier(dsPtr, table);
+        Tcl_DStringAppend(dsPtr, ".", 1);
+        AppendIdentifier(dsPtr, dot + 1);
+    } else {
+        AppendIdentifier(dsPtr, table);
+    }
+    ns_free(table);
+}
+
+static void
+AppendLiteral(Tcl_DString *dsPtr, MYSQL *mysql, const char *value, TCL_SIZE_T length)
+{
+    TCL_SIZE_T      offset = Tcl_DStringLength(dsPtr);
+    unsigned long   escaped;
+
+    /*
+     * Escaping may double each byte; add room for the quotes and the
+     * terminating NUL.
+     */
+    Tcl_DStringSetLength(dsPtr, offset + 2 * length + 3);
+    dsPtr->string[offset] = '\'';
+#ifdef HAVE_ESCAPE_QUOTE
+    escaped = mysql_real_escape_string_quote(mysql, dsPtr->string + offset + 1,
+                                             value, (unsigned long) length, '\'');
+#else
+    escaped = mysql_real_escape_string(mysql, dsPtr->string + offset + 1,
+                                       value, (unsigned long) length);
+#endif
+    if (escaped == (unsigned long) -1) {
+        /*
+         * NO_BACKSLASH_ESCAPES mode of the session: only the quote
+         * needs to be doubled.
+         */
+        char       *to = dsPtr->string + offset + 1;
+        TCL_SIZE_T  i;
+
+        escaped = 0u;
+        for (i = 0; i < length; i++) {
+            if (value[i] == '\'') {
+                to[escaped++] = '\'';
+            }
+            to[escaped++] = value[i];
+        }
+    }
+    dsPtr->string[offset + 1 + (TCL_SIZE_T) escaped] = '\'';
+    Tcl_DStringSetLength(dsPtr, offset + 2 + (TCL_SIZE_T) escaped);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AsyncSubmit, AsyncWait --
+ *
+ *      Submit a query without waiting for its result, and wait later
+ *      (optionally bounded by a timeout) for its completion. This uses
+ *      the nonblocking API of the client library; the connection
+ *      thread polls the socket of the connection only while waiting.
+ *
+ * Results:
+ *      AsyncSubmit returns a Tcl result code. AsyncWait returns NS_DML
+ *      or NS_ROWS on completion (for NS_ROWS, the result is bound to
+ *      the handle like after DbExec), NS_TIMEOUT when the query is
+ *      still running, or NS_ERROR.
+ *
+ * Side effects:
+ *      The handle is busy until AsyncWait reports completion.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#ifdef HAVE_ASYNC_QUERY
+
+static void
+AsyncStep(Context *ctx, MYSQL *mysql, bool start, int ready)
+{
+# ifdef MARIADB_BASE_VERSION
+    if (ctx->asyncState == ASYNC_QUERY) {
+        ctx->asyncWait = start
+            ? mysql_real_query_start(&ctx->asyncErr, mysql, ctx->asyncSql,
+                                     (unsigned long) strlen(ctx->asyncSql))
+            : mysql_real_query_cont(&ctx->asyncErr, mysql, ready);
+    } else {
+        ctx->asyncWait = start
+            ? mysql_store_result_start(&ctx->asyncRes, mysql)
+            : mysql_store_result_cont(&ctx->asyncRes, mysql, ready);
+    }
+# else
+    enum net_async_status status;
+
+    (void) start;
+    (void) ready;
+    if (ctx->asyncState == ASYNC_QUERY) {
+        status = mysql_real_query_nonblocking(mysql, ctx->asyncSql,
+                                              (unsigned long) strlen(ctx->asyncSql));
+    } else {
+        status = mysql_store_result_nonblocking(mysql, &ctx->asyncRes);
+    }
+    ctx->asyncWait = (status == NET_ASYNC_NOT_READY);
+    ctx->asyncErr = (status == NET_ASYNC_ERROR);
+# endif
+}
+
+# ifdef MARIADB_BASE_VERSION
+static int
+AsyncPoll(Context *ctx, MYSQL *mysql, const Ns_Time *deadlinePtr)
+{
+    struct pollfd   pfd;
+    long            ms = -1, libraryMs = -1;
+    int             n;
+
+    if (deadlinePtr != NULL) {
+        Ns_Time now, diff;
+
+        Ns_GetTime(&now);
+        if (Ns_DiffTime(deadlinePtr, &now, &diff) < 0) {
+            return 0;
+        }
+        ms = (long) diff.sec * 1000 + diff.usec / 1000;
+    }
+
+    pfd.fd = mysql_get_socket(mysql);
+    pfd.events = (short) (((ctx->asyncWait & MYSQL_WAIT_READ) != 0 ? POLLIN : 0)
+                          | ((ctx->asyncWait & MYSQL_WAIT_WRITE) != 0 ? POLLOUT : 0)
+                          | ((ctx->asyncWait & MYSQL_WAIT_EXCEPT) != 0 ? POLLPRI : 0));
+    if ((ctx->asyncWait & MYSQL_WAIT_TIMEOUT) != 0) {
+        libraryMs = (long) mysql_get_timeout_value_ms(mysql);
+    }
+    pfd.revents = 0;
+
+    if (libraryMs >= 0 && (ms < 0 || libraryMs < ms)) {
+        n = ns_poll(&pfd, 1, libraryMs);
+        if (n == 0) {
+            return MYSQL_WAIT_TIMEOUT;
+        }
+    } else {
+        n = ns_poll(&pfd, 1, ms);
+        if (n == 0) {
+            return 0;
+        }
+    }
+    if (n < 0) {
+        /*
+         * Let the library report the error on the next step.
+         */
+        return ctx->asyncWait;
+    }
+
+    return (((pfd.revents & (POLLIN | POLLHUP | POLLERR)) != 0 ? MYSQL_WAIT_READ : 0)
+            | ((pfd.revents & POLLOUT) != 0 ? MYSQL_WAIT_WRITE : 0)
+            | ((pfd.revents & POLLPRI) != 0 ? MYSQL_WAIT_EXCEPT : 0));
+}
+# else
+static int
+AsyncPoll(Context *UNUSED(ctx), MYSQL *UNUSED(mysql), const Ns_Time *deadlinePtr)
+{
+    Ns_Time slice;
+
+    /*
+     * The MySQL API does not expose the socket it waits for; call the
+     * nonblocking function again after a short pause, as documented.
+     */
+    slice.sec = 0;
+    slice.usec = ASYNC_SLICE;
+    if (deadlinePtr != NULL) {
+        Ns_Time now, diff;
+
+        Ns_GetTime(&now);
+        if (Ns_DiffTime(deadlinePtr, &now, &diff) < 0) {
+            return 0;
+        }
+        if (diff.sec == 0 && diff.usec < slice.usec) {
+            slice.usec = diff.usec;
+        }
+    }
+    Ns_Sleep(&slice);
+    return 1;
+}
+# endif
+
+static int
+AsyncSubmit(Tcl_Interp *interp, Ns_DbHandle *handle, const char *sql)
+{
+    Context        *ctx = (Context *) handle->context;
+    MYSQL          *mysql;
+
+    if (ctx->asyncState != ASYNC_IDLE || handle->fetchingRows) {
+        Tcl_AppendResult(interp, "handle is busy", NULL);
+        return TCL_ERROR;
+    }
+    RouteWrite(handle);
+    mysql = (MYSQL *) handle->connection;
+
+# ifdef MARIADB_BASE_VERSION
+    /*
+     * Only connections used for submit need the context of the
+     * nonblocking API; setting it again replaces the idle one.
+     */
+    if (mysql_options(mysql, MYSQL_OPT_NONBLOCK, 0) != 0) {
+        Log(handle, mysql);
+        Tcl_AppendResult(interp, "could not enable nonblocking queries", NULL);
+        return TCL_ERROR;
+    }
+# endif
+    ns_free(ctx->asyncSql);
+    ctx->asyncSql = ns_strdup(sql);
+    ctx->asyncRes = NULL;
+    ctx->asyncErr = 0;
+    ctx->asyncState = ASYNC_QUERY;
+    Ns_GetTime(&ctx->asyncStart);
+
+    AsyncStep(ctx, mysql, NS_TRUE, 0);
+
+    if (ctx->asyncErr != 0 && ctx->asyncWait == 0) {
+        ctx->asyncState = ASYNC_IDLE;
+        Log(handle, mysql);
+        Tcl_AppendResult(interp, mysql_error(mysql), NULL);
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+static int
+AsyncWait(Ns_DbHandle *handle, const Ns_Time *timeoutPtr)
+{
+    Context        *ctx = (Context *) handle->context;
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+    Ns_Time         deadline, *deadlinePtr = NULL;
+
+    if (timeoutPtr != NULL) {
+        Ns_GetTime(&deadline);
+        Ns_IncrTime(&deadline, timeoutPtr->sec, timeoutPtr->usec);
+        deadlinePtr = &deadline;
+    }
+
+    while (ctx->asyncState != ASYNC_IDLE) {
+        if (ctx->asyncWait != 0) {
+            int ready = AsyncPoll(ctx, mysql, deadlinePtr);
+
+            if (ready == 0) {
+                return NS_TIMEOUT;
+            }
+            AsyncStep(ctx, mysql, NS_FALSE, ready);
+            continue;
+        }
+
+        if (ctx->asyncState == ASYNC_QUERY) {
+            if (ctx->asyncErr != 0) {
+                ctx->asyncState = ASYNC_IDLE;
+                Log(handle, mysql);
+                StatsQuery(handle, STATS_EXEC, ctx->asyncSql, &ctx->asyncStart);
+                CacheWrite(handle, ctx->asyncSql);
+                return NS_ERROR;
+            }
+            if (mysql_field_count(mysql) == 0u) {
+                ctx->asyncState = ASYNC_IDLE;
+                StatsQuery(handle, STATS_DML, ctx->asyncSql, &ctx->asyncStart);
+                SessionTrack(ctx, ctx->asyncSql);
+                CacheWrite(handle, ctx->asyncSql);
+                return (DrainResults(handle) == NS_OK) ? NS_DML : NS_ERROR;
+            }
+            StatsQuery(handle, STATS_SELECT, ctx->asyncSql, &ctx->asyncStart);
+            if (ctx->poolPtr->memLimits) {
+                /*
+                 * Read the rows through the memory limits of the pool;
+                 * the transfer of the rows is then not bounded by the
+                 * timeout.
+                 */
+                ctx->asyncState = ASYNC_IDLE;
+                return (BufferResult(handle, ctx->asyncSql) == NS_OK) ? NS_ROWS : NS_ERROR;
+            }
+            ctx->asyncState = ASYNC_STORE;
+            AsyncStep(ctx, mysql, NS_TRUE, 0);
+
+        } else {
+            ctx->asyncState = ASYNC_IDLE;
+            if (ctx->asyncRes == NULL) {
+                Log(handle, mysql);
+                return NS_ERROR;
+            }
+            handle->statement = (void *) ctx->asyncRes;
+            handle->fetchingRows = NS_TRUE;
+            ctx->asyncRes = NULL;
+            ctx->streaming = NS_FALSE;
+            return NS_ROWS;
+        }
+    }
+
+    Ns_Log(Error, "nsdbmysql: no query submitted");
+    return NS_ERROR;
+}
+
+#else
+
+static int
+AsyncSubmit(Tcl_Interp *interp, Ns_DbHandle *UNUSED(handle), const char *UNUSED(sql))
+{
+    Tcl_AppendResult(interp, "asynchronous queries are not supported by the"
+                     " MySQL client library", NULL);
+    return TCL_ERROR;
+}
+
+static int
+AsyncWait(Ns_DbHandle *UNUSED(handle), const Ns_Time *UNUSED(timeoutPtr))
+{
+    Ns_Log(Error, "nsdbmysql: no query submitted");
+    return NS_ERROR;
+}
+
+#endif
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AsyncAbort, AsyncPending --
+ *
+ *      AsyncAbort aborts a submitted query that was not waited for via
+ *      KILL QUERY and releases its result. When the query does not end
+ *      within ASYNC_ABORT_WAIT seconds (e.g. no connection for the KILL
+ *      could be opened), its connection is closed and replaced.
+ *      AsyncPending reports an error for blocking queries on a handle
+ *      with a submitted query.
+ *
+ * Results:
+ *      AsyncPending returns true when a query is pending.
+ *
+ * Side effects:
+ *      AsyncAbort may reconnect the handle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AsyncAbort(Ns_DbHandle *handle)
+{
+    Context        *ctx = (Context *) handle->context;
+    MYSQL          *mysql;
+    Ns_Time         timeout;
+    int             i;
+
+    if (ctx == NULL || ctx->asyncState == ASYNC_IDLE) {
+        return;
+    }
+    KillQuery(handle);
+    timeout.sec = ASYNC_ABORT_WAIT;
+    timeout.usec = 0;
+    switch (AsyncWait(handle, &timeout)) {
+    case NS_ROWS:
+        FreeResult(handle, NS_FALSE);
+        return;
+    case NS_TIMEOUT:
+        break;
+    default:
+        return;
+    }
+
+    mysql = (MYSQL *) handle->connection;
+    Ns_Log(Warning, "nsdbmysql: %s: submitted query not aborted within %ds, closing the connection",
+           handle->datasource, ASYNC_ABORT_WAIT);
+    ctx->asyncState = ASYNC_IDLE;
+    if (mysql == ctx->primary) {
+        (void) Reconnect(handle);
+        return;
+    }
+
+    /*
+     * A replica or compressed connection is opened again on next use.
+     */
+    RoutePrimary(handle);
+    for (i = 0; i < ctx->poolPtr->nreplicas; i++) {
+        if (ctx->replicaConns[i] == mysql) {
+            ctx->replicaConns[i] = NULL;
+            ns_free(ctx->replicaDbs[i]);
+            ctx->replicaDbs[i] = NULL;
+        }
+    }
+    if (ctx->compressConn == mysql) {
+        ctx->compressConn = NULL;
+        ns_free(ctx->compressDb);
+        ctx->compressDb = NULL;
+        ctx->compressUsed[1] = NS_FALSE;
+        ctx->wireMark[1] = 0u;
+    }
+    mysql_close(mysql);
+}
+
+static int
+AsyncPending(Ns_DbHandle *handle)
+{
+    const Context  *ctx = (const Context *) handle->context;
+
+    if (ctx != NULL && ctx->asyncState != ASYNC_IDLE) {
+        Ns_Log(Error, "nsdbmysql: %s: query submitted via ns_mysql submit is pending",
+               handle->datasource);
+        return NS_TRUE;
+    }
+    return NS_FALSE;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HandleBusy --
+ *
+ *      Check that the connection of the handle is free for a new
+ *      statement, i.e. has neither a submitted query nor unread rows.
+ *
+ * Results:
+ *      NS_TRUE when busy (message left in interp).
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+HandleBusy(Tcl_Interp *interp, Ns_DbHandle *handle)
+{
+    if (AsyncPending(handle)) {
+        Tcl_AppendResult(interp, "handle has a submitted query pending", NULL);
+        return NS_TRUE;
+    }
+    if (handle->fetchingRows) {
+        Tcl_AppendResult(interp, "handle has rows waiting to fetch", NULL);
+        return NS_TRUE;
+    }
+    return NS_FALSE;
+}
+
+/* ************************************************************ */
+
+static int 
+DbList_Dbs(Tcl_Interp *interp, const char *wild, Ns_DbHandle *handle)
+{
+    MYSQL_RES      *result;
+    MYSQL_ROW       row;
+    unsigned int    numcols;
+    unsigned int    i;
+
+    if (handle == NULL || handle->connection == NULL) {
+        Ns_Log(Error, "nsdbmysql: Invalid connection.");
+        return NS_ERROR;
+    }
+
+    InitThread();
+
+    result = mysql_list_dbs((MYSQL *) handle->connection, wild);
+    Log(handle, (MYSQL *) handle->connection);
+
+    if (result == NULL) {
+        Tcl_AppendResult(interp, "mysql_list_dbs failed.", NULL);
+        return TCL_ERROR;
+    }
+
+    numcols = mysql_num_fields(result);
+    Log(handle, (MYSQL *) handle->connection);
+
+    while ((row = mysql_fetch_row(result)) != NULL) {
+        for (i = 0; i < numcols; i++) {
+            Tcl_AppendElement(interp, row[i]);
+        }
+    }
+    mysql_free_result(result);
+
+    return TCL_OK;
+}
+
+static int 
+DbList_Tables(Tcl_Interp *interp, const char *wild, Ns_DbHandle *handle)
+{
+    MYSQL_RES      *result;
+    MYSQL_ROW       row;
+    unsigned int    numcols;
+    unsigned int    i;
+
+    if (handle == NULL || handle->connection == NULL) {
+        Ns_Log(Error, "nsdbmysql: Invalid connection.");
+        return NS_ERROR;
+    }
+
+    InitThread();
+
+    result = mysql_list_tables((MYSQL *) handle->connection, wild);
+    Log(handle, (MYSQL *) handle->connection);
+
+    if (result == NULL) {
+        Tcl_AppendResult(interp, "mysql_list_tables failed.", NULL);
+        return TCL_ERROR;
+    }
+
+    numcols = mysql_num_fields(result);
+    Log(handle, (MYSQL *) handle->connection);
+
+    while ((row = mysql_fetch_row(result)) != NULL) {
+        for (i = 0; i < numcols; i++) {
+            Tcl_AppendElement(interp, row[i]);
+        }
+    }
+
+    mysql_free_result(result);
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Fanout --
+ *
+ *      Run one query on each of several handles concurrently and collect
+ *      the results in input order. The queries are queued for a set of
+ *      at most fanoutthreads threads shared by all calls, created on
+ *      demand. They are run via DbExec/DbBindRow/DbGetRow, so the rows
+ *      come back as with ns_db. Queries still running after the
+ *      timeout are aborted via KILL QUERY, queries not yet started are
+ *      dropped.
+ *
+ * Results:
+ *      Tcl result code. The interp result is a list with one dict per
+ *      query with "status" ok, error or timeout, and for successful
+ *      queries "columns" and "rows" or "affected", otherwise "code" and
+ *      "message".
+ *
+ * Side effects:
+ *      May create fanout threads.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Fanout(Tcl_Interp *interp, Tcl_Obj *listObj, Tcl_Obj *timeoutObj)
+{
+    Tcl_Obj       **elems, *resultObj;
+    TCL_SIZE_T      nelems, i, j, njobs;
+    FanoutJob      *jobs;
+    Ns_Time         timeout, deadline;
+    int             result = TCL_OK;
+
+    if (Tcl_ListObjGetElements(interp, listObj, &nelems, &elems) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (nelems % 2 != 0) {
+        Tcl_AppendResult(interp, "list must contain pairs of handle and sql", NULL);
+        return TCL_ERROR;
+    }
+    if (timeoutObj != NULL && Ns_TclGetTimeFromObj(interp, timeoutObj, &timeout) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    njobs = nelems / 2;
+    jobs = ns_calloc((size_t) njobs + 1u, sizeof(FanoutJob));
+
+    for (i = 0; i < njobs; i++) {
+        if (GetHandle(interp, elems[2 * i], &jobs[i].handle) != TCL_OK) {
+            result = TCL_ERROR;
+            break;
+        }
+        for (j = 0; j < i; j++) {
+            if (jobs[j].handle == jobs[i].handle) {
+                Tcl_AppendResult(interp, "handle \"", Tcl_GetString(elems[2 * i]),
+                                 "\" is used more than once", NULL);
+                result = TCL_ERROR;
+                break;
+            }
+        }
+        if (result == TCL_OK && (jobs[i].handle->fetchingRows
+                                 || ((Context *) jobs[i].handle->context)->asyncState != ASYNC_IDLE)) {
+            Tcl_AppendResult(interp, "handle \"", Tcl_GetString(elems[2 * i]),
+                             "\" is busy", NULL);
+            result = TCL_ERROR;
+        }
+        if (result != TCL_OK) {
+            break;
+        }
+    }
+    if (result != TCL_OK) {
+        ns_free(jobs);
+        return result;
+    }
+
+    Ns_MutexLock(&fanoutLock);
+    for (i = 0; i < njobs; i++) {
+        FanoutJob *jobPtr = &jobs[i];
+
+        jobPtr->sql = ns_strdup(Tcl_GetString(elems[2 * i + 1]));
+        Tcl_DStringInit(&jobPtr->columns);
+        Tcl_DStringInit(&jobPtr->rows);
+        Tcl_DStringInit(&jobPtr->error);
+        if (lastFanoutPtr != NULL) {
+            lastFanoutPtr->nextPtr = jobPtr;
+        } else {
+            firstFanoutPtr = jobPtr;
+        }
+        lastFanoutPtr = jobPtr;
+        fanoutQueued++;
+        if (fanoutIdle > 0) {
+            Ns_CondSignal(&fanoutQueueCond);
+        }
+        if (fanoutQueued > fanoutIdle && fanoutThreads < fanoutMax) {
+            fanoutThreads++;
+            Ns_ThreadCreate(FanoutThread, NULL, 0, NULL);
+        }
+    }
+    Ns_MutexUnlock(&fanoutLock);
+
+    if (timeoutObj != NULL) {
+        Ns_GetTime(&deadline);
+        Ns_IncrTime(&deadline, timeout.sec, timeout.usec);
+    }
+
+    Ns_MutexLock(&fanoutLock);
+    for (i = 0; i < njobs; i++) {
+        while (!jobs[i].done) {
+            if (timeoutObj == NULL) {
+                Ns_CondWait(&fanoutCond, &fanoutLock);
+            } else if (Ns_CondTimedWait(&fanoutCond, &fanoutLock, &deadline) == NS_TIMEOUT) {
+                break;
+            }
+        }
+        if (!jobs[i].done) {
+            break;
+        }
+    }
+    if (i < njobs) {
+        /*
+         * Timeout: drop the queries not started yet, abort the ones
+         * still running and wait until their threads have returned the
+         * handles.
+         */
+        for (j = 0; j < njobs; j++) {
+            FanoutJob **jobPtrPtr, *prevPtr = NULL;
+
+            if (jobs[j].done) {
+                continue;
+            }
+            jobs[j].status = NS_TIMEOUT;
+            if (jobs[j].started) {
+                Ns_MutexUnlock(&fanoutLock);
+                KillQuery(jobs[j].handle);
+                Ns_MutexLock(&fanoutLock);
+                continue;
+            }
+            for (jobPtrPtr = &firstFanoutPtr; *jobPtrPtr != &jobs[j]; jobPtrPtr = &(*jobPtrPtr)->nextPtr) {
+                prevPtr = *jobPtrPtr;
+            }
+            *jobPtrPtr = jobs[j].nextPtr;
+            if (lastFanoutPtr == &jobs[j]) {
+                lastFanoutPtr = prevPtr;
+            }
+            fanoutQueued--;
+            Tcl_DStringAppend(&jobs[j].error, "query timed out", TCL_INDEX_NONE);
+            jobs[j].done = NS_TRUE;
+        }
+        for (j = 0; j < njobs; j++) {
+            while (!jobs[j].done) {
+                Ns_CondWait(&fanoutCond, &fanoutLock);
+            }
+        }
+    }
+    Ns_MutexUnlock(&fanoutLock);
+
+    resultObj = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < njobs; i++) {
+        FanoutJob *jobPtr = &jobs[i];
+        Tcl_Obj   *dictObj = Tcl_NewDictObj();
+
+        switch (jobPtr->status) {
+        case NS_ROWS:
+            Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("status", 6), Tcl_NewStringObj("ok", 2));
+            Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("columns", 7),
+                           Tcl_NewStringObj(Tcl_DStringValue(&jobPtr->columns),
+                                            Tcl_DStringLength(&jobPtr->columns)));
+            Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("rows", 4),
+                           Tcl_NewStringObj(Tcl_DStringValue(&jobPtr->rows),
+                                            Tcl_DStringLength(&jobPtr->rows)));
+            break;
+
+        case NS_DML:
+            Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("status", 6), Tcl_NewStringObj("ok", 2));
+            Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("affected", 8),
+                           Tcl_NewWideIntObj(jobPtr->count));
+            break;
+
+        default:
+            Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("status", 6),
+                           Tcl_NewStringObj(jobPtr->status == NS_TIMEOUT ? "timeout" : "error",
+                                            TCL_INDEX_NONE));
+            Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("code", 4),
+                           Tcl_NewStringObj(jobPtr->code, TCL_INDEX_NONE));
+            Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("message", 7),
+                           Tcl_NewStringObj(Tcl_DStringValue(&jobPtr->error),
+                                            Tcl_DStringLength(&jobPtr->error)));
+            break;
+        }
+        Tcl_ListObjAppendElement(NULL, resultObj, dictObj);
+
+        ns_free(jobPtr->sql);
+        Tcl_DStringFree(&jobPtr->columns);
+        Tcl_DStringFree(&jobPtr->rows);
+        Tcl_DStringFree(&jobPtr->error);
+    }
+    ns_free(jobs);
+
+    Tcl_SetObjResult(interp, resultObj);
+    return TCL_OK;
+}
+
+static void
+FanoutThread(void *UNUSED(arg))
+{
+    FanoutJob      *jobPtr;
+    int             status;
+
+    Ns_ThreadSetName("-nsdbmysql:fanout-");
+    InitThread();
+
+    Ns_MutexLock(&fanoutLock);
+    for (;;) {
+        while (firstFanoutPtr == NULL) {
+            fanoutIdle++;
+            Ns_CondWait(&fanoutQueueCond, &fanoutLock);
+            fanoutIdle--;
+        }
+        jobPtr = firstFanoutPtr;
+        firstFanoutPtr = jobPtr->nextPtr;
+        if (firstFanoutPtr == NULL) {
+            lastFanoutPtr = NULL;
+        }
+        fanoutQueued--;
+        jobPtr->started = NS_TRUE;
+        Ns_MutexUnlock(&fanoutLock);
+
+        status = FanoutRun(jobPtr);
+
+        Ns_MutexLock(&fanoutLock);
+        if (jobPtr->status != NS_TIMEOUT) {
+            jobPtr->status = status;
+        } else {
+            memcpy(jobPtr->code, jobPtr->handle->cExceptionCode, sizeof(jobPtr->code));
+            Tcl_DStringSetLength(&jobPtr->error, 0);
+            Tcl_DStringAppend(&jobPtr->error, "query timed out", TCL_INDEX_NONE);
+        }
+        jobPtr->done = NS_TRUE;
+        Ns_CondBroadcast(&fanoutCond);
+    }
+}
+
+static int
+FanoutRun(FanoutJob *jobPtr)
+{
+    Ns_DbHandle    *handle = jobPtr->handle;
+    Ns_Set         *row;
+    int             status, rc;
+    size_t          i;
+
+    handle->cExceptionCode[0] = '\0';
+    Tcl_DStringSetLength(&handle->dsExceptionMsg, 0);
+
+    status = DbExec(handle, jobPtr->sql);
+    if (status == NS_ROWS) {
+        Ns_SetTrunc(handle->row, 0u);
+        row = DbBindRow(handle);
+        for (i = 0u; i < Ns_SetSize(row); i++) {
+            Tcl_DStringAppendElement(&jobPtr->columns, Ns_SetKey(row, i));
+        }
+        while ((rc = DbGetRow(handle, row)) == NS_OK) {
+            Tcl_DStringStartSublist(&jobPtr->rows);
+            for (i = 0u; i < Ns_SetSize(row); i++) {
+                Tcl_DStringAppendElement(&jobPtr->rows, Ns_SetValue(row, i));
+            }
+            Tcl_DStringEndSublist(&jobPtr->rows);
+            jobPtr->count++;
+        }
+        if (rc != NS_END_DATA) {
+            status = NS_ERROR;
+        }
+    } else if (status == NS_DML) {
+        jobPtr->count = (Tcl_WideInt) mysql_affected_rows((MYSQL *) handle->connection);
+    }
+
+    if (status == NS_ERROR) {
+        memcpy(jobPtr->code, handle->cExceptionCode, sizeof(jobPtr->code));
+        Tcl_DStringAppend(&jobPtr->error, Tcl_DStringValue(&handle->dsExceptionMsg),
+                          Tcl_DStringLength(&handle->dsExceptionMsg));
+    }
+    return status;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetHandle --
+ *
+ *      Look up a connected handle of this driver by name.
+ *
+ * Results:
+ *      Tcl result code.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+GetHandle(Tcl_Interp *interp, Tcl_Obj *handleObj, Ns_DbHandle **handlePtr)
+{
+    Ns_DbHandle *handle;
+
+    if (Ns_TclDbGetHandle(interp, Tcl_GetString(handleObj), &handle) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    if (!STREQ(Ns_DbDriverName(handle), DbType(0))) {
+        Tcl_AppendResult(interp, "handle \"", Tcl_GetString(handleObj),
+                "\" is not of type \"", DbType(0), "\"", NULL);
+        return TCL_ERROR;
+    }
+
+    if (handle->context == NULL) {
+        Tcl_AppendResult(interp, "handle \"", Tcl_GetString(handleObj),
+                "\" is not connected", NULL);
+        return TCL_ERROR;
+    }
+
+    *handlePtr = handle;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Elapsed --
+ *
+ *      Microseconds passed since the given start time.
+ *
+ * Results:
+ *      Elapsed time in microseconds.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned long
+Elapsed(const Ns_Time *startPtr)
+{
+    Ns_Time now, diff;
+
+    Ns_GetTime(&now);
+    if (Ns_DiffTime(&now, startPtr, &diff) < 0) {
+        return 0u;
+    }
+    return (unsigned long)diff.sec * 1000000u + (unsigned long)diff.usec;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HistogramAdd --
+ *
+ *      Record a duration in a latency histogram.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Updates the histogram.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HistogramAdd(Histogram *histPtr, unsigned long usec)
+{
+    int i;
+
+    histPtr->count++;
+    histPtr->sum += usec;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (usec <= (1ul << i)) {
+            histPtr->buckets[i]++;
+            break;
+        }
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StatsQuery --
+ *
+ *      Record the execution time of a query on the handle and count the
+ *      error of the connection, if any.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Updates the handle statistics.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+StatsQuery(Ns_DbHandle *handle, StatsKind kind, const char *sql, const Ns_Time *startPtr)
+{
+    Context       *ctx = (Context *) handle->context;
+    MYSQL         *mysql = (MYSQL *) handle->connection;
+    unsigned long  usec;
+    unsigned int   nErr;
+
+    if (ctx == NULL) {
+        return;
+    }
+    usec = Elapsed(startPtr);
+    HistogramAdd(&ctx->stats.queries[kind], usec);
+    nErr = mysql_errno(mysql);
+    if (nErr != 0u) {
+        StatsError(&ctx->stats, nErr);
+    }
+
+    if (ctx->poolPtr->digests != NULL || ctx->poolPtr->slowThreshold > 0u) {
+        /*
+         * A query returning rows is accounted when its result is
+         * released, to include the fetched rows and bytes.
+         */
+        FlushQuery(handle);
+        if (ctx->poolPtr->digests != NULL) {
+            DigestNormalize(sql, &ctx->digestSql);
+        }
+        if (ctx->poolPtr->slowThreshold > 0u && usec >= ctx->poolPtr->slowThreshold) {
+            ctx->slowSql = ns_strdup(sql);
+            ctx->slowDb = ns_strdup(ctx->database);
+            ctx->slowSource = (ctx->replica >= 0)
+                ? ctx->poolPtr->replicas[ctx->replica].datasource : handle->datasource;
+        }
+        if (nErr == 0u && mysql_field_count(mysql) != 0u) {
+            ctx->queryPending = NS_TRUE;
+            ctx->queryTime = usec;
+            ctx->queryRows = ctx->stats.rows;
+            ctx->queryBytes = ctx->stats.bytes;
+        } else {
+            QueryDone(handle, usec, nErr == 0u ? (unsigned long) mysql_affected_rows(mysql) : 0u, 0u);
+        }
+    }
+}
+
+static void
+StatsError(Stats *statsPtr, unsigned int code)
+{
+    int i;
+
+    for (i = 0; i < ERRNO_SLOTS; i++) {
+        if (statsPtr->errnos[i].code == code) {
+            statsPtr->errnos[i].count++;
+            return;
+        }
+        if (statsPtr->errnos[i].code == 0u) {
+            statsPtr->errnos[i].code = code;
+            statsPtr->errnos[i].count = 1u;
+            return;
+        }
+    }
+    statsPtr->otherErrors++;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StatsSum --
+ *
+ *      Add (sign > 0) or subtract (sign < 0) one statistics block to
+ *      or from another. Error numbers not yet present in the target are
+ *      added to its free slots or to its "other" counter.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Updates *toPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HistogramSum(Histogram *toPtr, const Histogram *fromPtr, int sign)
+{
+    int i;
+
+    if (sign < 0) {
+        toPtr->count -= fromPtr->count;
+        toPtr->sum -= fromPtr->sum;
+        for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            toPtr->buckets[i] -= fromPtr->buckets[i];
+        }
+    } else {
+        toPtr->count += fromPtr->count;
+        toPtr->sum += fromPtr->sum;
+        for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            toPtr->buckets[i] += fromPtr->buckets[i];
+        }
+    }
+}
+
+static void
+StatsSum(Stats *toPtr, const Stats *fromPtr, int sign)
+{
+    int i, j;
+
+    for (i = 0; i < STATS_KINDS; i++) {
+        HistogramSum(&toPtr->queries[i], &fromPtr->queries[i], sign);
+    }
+    HistogramSum(&toPtr->fetch, &fromPtr->fetch, sign);
+    HistogramSum(&toPtr->connect, &fromPtr->connect, sign);
+    HistogramSum(&toPtr->connectResumed, &fromPtr->connectResumed, sign);
+
+    if (sign < 0) {
+        toPtr->rows -= fromPtr->rows;
+        toPtr->bytes -= fromPtr->bytes;
+        toPtr->connectErrors -= fromPtr->connectErrors;
+        toPtr->pings -= fromPtr->pings;
+        toPtr->reconnects -= fromPtr->reconnects;
+        toPtr->retries -= fromPtr->retries;
+        toPtr->compressedBytes -= fromPtr->compressedBytes;
+        toPtr->wireBytes -= fromPtr->wireBytes;
+        toPtr->warmups -= fromPtr->warmups;
+        toPtr->warmupTime -= fromPtr->warmupTime;
+        toPtr->otherErrors -= fromPtr->otherErrors;
+    } else {
+        toPtr->rows += fromPtr->rows;
+        toPtr->bytes += fromPtr->bytes;
+        toPtr->connectErrors += fromPtr->connectErrors;
+        toPtr->pings += fromPtr->pings;
+        toPtr->reconnects += fromPtr->reconnects;
+        toPtr->retries += fromPtr->retries;
+        toPtr->compressedBytes += fromPtr->compressedBytes;
+        toPtr->wireBytes += fromPtr->wireBytes;
+        toPtr->warmups += fromPtr->warmups;
+        toPtr->warmupTime += fromPtr->warmupTime;
+        toPtr->otherErrors += fromPtr->otherErrors;
+    }
+
+    for (i = 0; i < ERRNO_SLOTS && fromPtr->errnos[i].code != 0u; i++) {
+        for (j = 0; j < ERRNO_SLOTS; j++) {
+            if (toPtr->errnos[j].code == fromPtr->errnos[i].code
+                || toPtr->errnos[j].code == 0u) {
+                break;
+            }
+        }
+        if (j == ERRNO_SLOTS) {
+            if (sign < 0) {
+                toPtr->otherErrors -= fromPtr->errnos[i].count;
+            } else {
+                toPtr->otherErrors += fromPtr->errnos[i].count;
+            }
+        } else {
+            toPtr->errnos[j].code = fromPtr->errnos[i].code;
+            if (sign < 0) {
+                toPtr->errnos[j].count -= fromPtr->errnos[i].count;
+            } else {
+                toPtr->errnos[j].count += fromPtr->errnos[i].count;
+            }
+        }
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StatsObj --
+ *
+ *      Convert a statistics block into a Tcl dict. Histograms are dicts
+ *      with "count", "sum" (microseconds) and "buckets", a flat list of
+ *      upper bound (microseconds) and non-cumulative count pairs for
+ *      the non-empty buckets.
+ *
+ * Results:
+ *      New Tcl_Obj.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+HistogramObj(const Histogram *histPtr)
+{
+    Tcl_Obj *dictObj = Tcl_NewDictObj(), *bucketsObj = Tcl_NewListObj(0, NULL);
+    int      i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if (histPtr->buckets[i] != 0u) {
+            Tcl_ListObjAppendElement(NULL, bucketsObj, Tcl_NewWideIntObj((Tcl_WideInt)(1ul << i)));
+            Tcl_ListObjAppendElement(NULL, bucketsObj, Tcl_NewWideIntObj((Tcl_WideInt)histPtr->buckets[i]));
+        }
+    }
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("count", 5),
+                   Tcl_NewWideIntObj((Tcl_WideInt)histPtr->count));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("sum", 3),
+                   Tcl_NewWideIntObj((Tcl_WideInt)histPtr->sum));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("buckets", 7), bucketsObj);
+
+    return dictObj;
+}
+
+static Tcl_Obj *
+StatsObj(const Stats *statsPtr)
+{
+    Tcl_Obj *dictObj = Tcl_NewDictObj(), *queriesObj = Tcl_NewDictObj(), *errorsObj = Tcl_NewDictObj();
+    int      i;
+
+    for (i = 0; i < STATS_KINDS; i++) {
+        Tcl_DictObjPut(NULL, queriesObj, Tcl_NewStringObj(statsKinds[i], TCL_INDEX_NONE),
+                       HistogramObj(&statsPtr->queries[i]));
+    }
+    for (i = 0; i < ERRNO_SLOTS && statsPtr->errnos[i].code != 0u; i++) {
+        if (statsPtr->errnos[i].count != 0u) {
+            Tcl_DictObjPut(NULL, errorsObj, Tcl_NewWideIntObj((Tcl_WideInt)statsPtr->errnos[i].code),
+                           Tcl_NewWideIntObj((Tcl_WideInt)statsPtr->errnos[i].count));
+        }
+    }
+    if (statsPtr->otherErrors != 0u) {
+        Tcl_DictObjPut(NULL, errorsObj, Tcl_NewStringObj("other", 5),
+                       Tcl_NewWideIntObj((Tcl_WideInt)statsPtr->otherErrors));
+    }
+
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("queries", 7), queriesObj);
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("fetch", 5), HistogramObj(&statsPtr->fetch));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("connect", 7), HistogramObj(&statsPtr->connect));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("connect_resumed", 15),
+                   HistogramObj(&statsPtr->connectResumed));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("rows", 4),
+                   Tcl_NewWideIntObj((Tcl_WideInt)statsPtr->rows));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("bytes", 5),
+                   Tcl_NewWideIntObj((Tcl_WideInt)statsPtr->bytes));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("connect_errors", 14),
+                   Tcl_NewWideIntObj((Tcl_WideInt)statsPtr->connectErrors));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("pings", 5),
+                   Tcl_NewWideIntObj((Tcl_WideInt)statsPtr->pings));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("reconnects", 10),
+                   Tcl_NewWideIntObj((Tcl_WideInt)statsPtr->reconnects));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("retries", 7),
+                   Tcl_NewWideIntObj((Tcl_WideInt)statsPtr->retries));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("compressed_bytes", 16),
+                   Tcl_NewWideIntObj((Tcl_WideInt)statsPtr->compressedBytes));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("wire_bytes", 10),
+                   Tcl_NewWideIntObj((Tcl_WideInt)statsPtr->wireBytes));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("warmups", 7),
+                   Tcl_NewWideIntObj((Tcl_WideInt)statsPtr->warmups));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("warmup_time", 11),
+                   Tcl_NewWideIntObj((Tcl_WideInt)statsPtr->warmupTime));
+    Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("errors", 6), errorsObj);
+
+    return dictObj;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StatsPrometheus --
+ *
+ *      Append the statistics of the pools in the Prometheus text
+ *      exposition format. Every metric gets its HELP and TYPE lines
+ *      once, followed by the samples of all pools. Durations are
+ *      reported in seconds with cumulative buckets. Pool names are
+ *      escaped as label values.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Appends to dsPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrometheusLabel(Tcl_DString *dsPtr, const char *value)
+{
+    const char *p;
+
+    for (p = value; *p != '\0'; p++) {
+        switch (*p) {
+        case '\\':
+            Tcl_DStringAppend(dsPtr, "\\\\", 2);
+            break;
+        case '"':
+            Tcl_DStringAppend(dsPtr, "\\\"", 2);
+            break;
+        case '\n':
+            Tcl_DStringAppend(dsPtr, "\\n", 2);
+            break;
+        default:
+            Tcl_DStringAppend(dsPtr, p, 1);
+            break;
+        }
+    }
+}
+
+static void
+HistogramPrometheus(Tcl_DString *dsPtr, const char *name, const char *labels, const Histogram *histPtr)
+{
+    unsigned long cumulative = 0u;
+    int           i;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        cumulative += histPtr->buckets[i];
+        Ns_DStringPrintf(dsPtr, "%s_bucket{%s,le=\"%g\"} %lu\n",
+                         name, labels, (double)(1ul << i) / 1e6, cumulative);
+    }
+    Ns_DStringPrintf(dsPtr, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, histPtr->count);
+    Ns_DStringPrintf(dsPtr, "%s_sum{%s} %.6f\n", name, labels, (double)histPtr->sum / 1e6);
+    Ns_DStringPrintf(dsPtr, "%s_count{%s} %lu\n", name, labels, histPtr->count);
+}
+
+static void
+StatsPrometheus(Tcl_DString *dsPtr, int npools, const char **names, const Stats *stats)
+{
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t      offset;
+    } histograms[] = {
+        {"nsdbmysql_fetch_duration_seconds", "Row fetching time per result.",
+         offsetof(Stats, fetch)},
+        {"nsdbmysql_connect_duration_seconds", "Connection setup time with full handshake.",
+         offsetof(Stats, connect)},
+        {"nsdbmysql_connect_resumed_duration_seconds", "Connection setup time with resumed TLS session.",
+         offsetof(Stats, connectResumed)}
+    };
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t      offset;
+        bool        usec;           /* Microseconds, reported as seconds. */
+    } counters[] = {
+        {"nsdbmysql_rows_total", "Rows fetched.", offsetof(Stats, rows), NS_FALSE},
+        {"nsdbmysql_bytes_total", "Bytes of fetched column values.", offsetof(Stats, bytes), NS_FALSE},
+        {"nsdbmysql_connect_errors_total", "Failed connects.", offsetof(Stats, connectErrors), NS_FALSE},
+        {"nsdbmysql_pings_total", "Connection checks.", offsetof(Stats, pings), NS_FALSE},
+        {"nsdbmysql_reconnects_total", "Lost connections reopened.", offsetof(Stats, reconnects), NS_FALSE},
+        {"nsdbmysql_retries_total", "Statements repeated after reconnect.", offsetof(Stats, retries), NS_FALSE},
+        {"nsdbmysql_compressed_bytes_total", "Bytes fetched over compressed connections.",
+         offsetof(Stats, compressedBytes), NS_FALSE},
+        {"nsdbmysql_wire_bytes_total", "Bytes sent by the server on compressed connections.",
+         offsetof(Stats, wireBytes), NS_FALSE},
+        {"nsdbmysql_warmups_total", "Connections opened at server start.", offsetof(Stats, warmups), NS_FALSE},
+        {"nsdbmysql_warmup_seconds_total", "Duration of the warm-up at server start.",
+         offsetof(Stats, warmupTime), NS_TRUE}
+    };
+    Tcl_DString *labels, ds;
+    size_t       k;
+    int          i, j;
+
+    /*
+     * Label sets per pool, with the pool name escaped. All samples of
+     * a metric follow its HELP and TYPE lines.
+     */
+    labels = ns_calloc((size_t) npools, sizeof(Tcl_DString));
+    for (i = 0; i < npools; i++) {
+        Tcl_DStringInit(&labels[i]);
+        Tcl_DStringAppend(&labels[i], "pool=\"", 6);
+        PrometheusLabel(&labels[i], names[i]);
+        Tcl_DStringAppend(&labels[i], "\"", 1);
+    }
+    Tcl_DStringInit(&ds);
+
+    Tcl_DStringAppend(dsPtr, "# HELP nsdbmysql_query_duration_seconds Query execution time.\n"
+                      "# TYPE nsdbmysql_query_duration_seconds histogram\n", TCL_INDEX_NONE);
+    for (i = 0; i < npools; i++) {
+        for (j = 0; j < STATS_KINDS; j++) {
+            Tcl_DStringSetLength(&ds, 0);
+            Ns_DStringPrintf(&ds, "%s,kind=\"%s\"", Tcl_DStringValue(&labels[i]), statsKinds[j]);
+            HistogramPrometheus(dsPtr, "nsdbmysql_query_duration_seconds", Tcl_DStringValue(&ds),
+                                &stats[i].queries[j]);
+        }
+    }
+    for (k = 0u; k < sizeof(histograms) / sizeof(histograms[0]); k++) {
+        Ns_DStringPrintf(dsPtr, "# HELP %s %s\n# TYPE %s histogram\n",
+                         histograms[k].name, histograms[k].help, histograms[k].name);
+        for (i = 0; i < npools; i++) {
+            HistogramPrometheus(dsPtr, histograms[k].name, Tcl_DStringValue(&labels[i]),
+                                (const Histogram *) ((const char *) &stats[i] + histograms[k].offset));
+        }
+    }
+    for (k = 0u; k < sizeof(counters) / sizeof(counters[0]); k++) {
+        Ns_DStringPrintf(dsPtr, "# HELP %s %s\n# TYPE %s counter\n",
+                         counters[k].name, counters[k].help, counters[k].name);
+        for (i = 0; i < npools; i++) {
+            unsigned long value = *(const unsigned long *) ((const char *) &stats[i] + counters[k].offset);
+
+            if (counters[k].usec) {
+                Ns_DStringPrintf(dsPtr, "%s{%s} %.6f\n", counters[k].name,
+                                 Tcl_DStringValue(&labels[i]), (double) value / 1e6);
+            } else {
+                Ns_DStringPrintf(dsPtr, "%s{%s} %lu\n", counters[k].name,
+                                 Tcl_DStringValue(&labels[i]), value);
+            }
+        }
+    }
+    Tcl_DStringAppend(dsPtr, "# HELP nsdbmysql_errors_total Failed statements by MySQL error number.\n"
+                      "# TYPE nsdbmysql_errors_total counter\n", TCL_INDEX_NONE);
+    for (i = 0; i < npools; i++) {
+        for (j = 0; j < ERRNO_SLOTS && stats[i].errnos[j].code != 0u; j++) {
+            Ns_DStringPrintf(dsPtr, "nsdbmysql_errors_total{%s,errno=\"%u\"} %lu\n",
+                             Tcl_DStringValue(&labels[i]), stats[i].errnos[j].code, stats[i].errnos[j].count);
+        }
+        Ns_DStringPrintf(dsPtr, "nsdbmysql_errors_total{%s,errno=\"other\"} %lu\n",
+                         Tcl_DStringValue(&labels[i]), stats[i].otherErrors);
+    }
+
+    Tcl_DStringFree(&ds);
+    for (i = 0; i < npools; i++) {
+        Tcl_DStringFree(&labels[i]);
+    }
+    ns_free(labels);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StatsCmd --
+ *
+ *      Implements "ns_mysql stats". The totals of a pool are the
+ *      statistics of its closed handles plus those of its open handles,
+ *      minus the totals at the last reset. The counters of open handles
+ *      are read while their owners may update them, so the totals are
+ *      a close approximation rather than an atomic snapshot.
+ *
+ * Results:
+ *      Tcl result code. The interp result is a dict with one entry per
+ *      pool or the Prometheus text.
+ *
+ * Side effects:
+ *      With reset, the current totals become the new baseline.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+StatsCmd(Tcl_Interp *interp, bool reset, bool prometheus)
+{
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    Tcl_Obj        *resultObj = Tcl_NewDictObj();
+    Tcl_DString     ds;
+    Stats          *totalPtr, *stats;
+    const char    **names;
+    int             npools = 0;
+
+    Tcl_DStringInit(&ds);
+
+    Ns_MutexLock(&poolsLock);
+    stats = ns_malloc((size_t) pools.numEntries * sizeof(Stats) + 1u);
+    names = ns_malloc((size_t) pools.numEntries * sizeof(char *) + 1u);
+    for (hPtr = Tcl_FirstHashEntry(&pools, &search); hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+        Pool    *poolPtr = Tcl_GetHashValue(hPtr);
+        Context *cPtr;
+
+        totalPtr = &stats[npools];
+        names[npools++] = poolPtr->name;
+
+        Ns_MutexLock(&poolPtr->lock);
+        *totalPtr = poolPtr->retired;
+        for (cPtr = poolPtr->firstCtxPtr; cPtr != NULL; cPtr = cPtr->nextPtr) {
+            StatsSum(totalPtr, &cPtr->stats, 1);
+        }
+        if (reset) {
+            poolPtr->baseline = *totalPtr;
+        }
+        StatsSum(totalPtr, &poolPtr->baseline, -1);
+        Ns_MutexUnlock(&poolPtr->lock);
+
+        if (!prometheus) {
+            Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj(poolPtr->name, TCL_INDEX_NONE),
+                           StatsObj(totalPtr));
+        }
+    }
+    Ns_MutexUnlock(&poolsLock);
+
+    if (prometheus) {
+        StatsPrometheus(&ds, npools, names, stats);
+    }
+    ns_free(stats);
+    ns_free(names);
+    if (prometheus) {
+        Tcl_DecrRefCount(resultObj);
+        Tcl_DStringResult(interp, &ds);
+    } else {
+        Tcl_DStringFree(&ds);
+        Tcl_SetObjResult(interp, resultObj);
+    }
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DigestNormalize --
+ *
+ *      Reduce an SQL text to its digest form: comments are removed,
+ *      white space is collapsed, string, numeric, hex and bit literals
+ *      are replaced by "?" and parenthesized lists of literals (IN
+ *      lists, VALUES rows) by "(...)", so that queries differing only
+ *      in their parameters share one digest.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The normalized text is left in dsPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DigestPlaceholder(Tcl_DString *dsPtr, char c)
+{
+    char       *start = Tcl_DStringValue(dsPtr), *p;
+    TCL_SIZE_T  len;
+
+    if (c != ')') {
+        Tcl_DStringAppend(dsPtr, &c, 1);
+        return;
+    }
+
+    /*
+     * Collapse "(?, ?, ...)" to "(...)" and then "(...), (...)" to
+     * "(...)".
+     */
+    p = start + Tcl_DStringLength(dsPtr);
+    while (p > start && (p[-1] == '?' || p[-1] == ',' || p[-1] == ' ')) {
+        p--;
+    }
+    if (p > start && p[-1] == '(' && p < start + Tcl_DStringLength(dsPtr)
+        && memchr(p, '?', (size_t)(start + Tcl_DStringLength(dsPtr) - p)) != NULL) {
+        Tcl_DStringSetLength(dsPtr, (TCL_SIZE_T)(p - start));
+        Tcl_DStringAppend(dsPtr, "...)", 4);
+        start = Tcl_DStringValue(dsPtr);
+        len = Tcl_DStringLength(dsPtr);
+        while (len >= 12 && memcmp(start + len - 12, "(...), (...)", 12) == 0) {
+            Tcl_DStringSetLength(dsPtr, len - 7);
+            len -= 7;
+        }
+        while (len >= 11 && memcmp(start + len - 11, "(...),(...)", 11) == 0) {
+            Tcl_DStringSetLength(dsPtr, len - 6);
+            len -= 6;
+        }
+        return;
+    }
+    Tcl_DStringAppend(dsPtr, &c, 1);
+}
+
+static void
+DigestNormalize(const char *sql, Tcl_DString *dsPtr)
+{
+    const unsigned char *p = (const unsigned char *) sql;
+    bool                 space = NS_FALSE;
+
+    Tcl_DStringSetLength(dsPtr, 0);
+    while (*p != '\0') {
+        unsigned char c = *p;
+
+        if (isspace(c)) {
+            space = NS_TRUE;
+            p++;
+            continue;
+        }
+        if (c == '/' && p[1] == '*') {
+            const char *end = strstr((const char *) p + 2, "*/");
+
+            p = (end != NULL) ? (const unsigned char *) end + 2 : p + strlen((const char *) p);
+            space = NS_TRUE;
+            continue;
+        }
+        if (c == '#' || (c == '-' && p[1] == '-' && (p[2] == '\0' || isspace(p[2])))) {
+            while (*p != '\0' && *p != '\n') {
+                p++;
+            }
+            space = NS_TRUE;
+            continue;
+        }
+        if (space) {
+            if (Tcl_DStringLength(dsPtr) > 0 && c != ',' && c != ')'
+                && Tcl_DStringValue(dsPtr)[Tcl_DStringLength(dsPtr) - 1] != '(') {
+                Tcl_DStringAppend(dsPtr, " ", 1);
+            }
+            space = NS_FALSE;
+        }
+
+        if (c == '\'' || c == '"') {
+            /*
+             * String literal, with backslash escapes and doubled quotes.
+             */
+            for (p++; *p != '\0'; p++) {
+                if (*p == '\\' && p[1] != '\0') {
+                    p++;
+                } else if (*p == c) {
+                    if (p[1] != c) {
+                        p++;
+                        break;
+                    }
+                    p++;
+                }
+            }
+            DigestPlaceholder(dsPtr, '?');
+
+        } else if (c == '`') {
+            const unsigned char *start = p;
+
+            for (p++; *p != '\0' && *p != '`'; p++) {
+                ;
+            }
+            if (*p == '`') {
+                p++;
+            }
+            Tcl_DStringAppend(dsPtr, (const char *) start, (TCL_SIZE_T)(p - start));
+
+        } else if (isdigit(c) || (c == '.' && isdigit(p[1]))) {
+            /*
+             * Numeric literal, including 0x... and exponents.
+             */
+            for (p++; isalnum(*p) || *p == '.'
+                     || ((*p == '+' || *p == '-') && (p[-1] == 'e' || p[-1] == 'E')); p++) {
+                ;
+            }
+            DigestPlaceholder(dsPtr, '?');
+
+        } else if (isalpha(c) || c == '_' || c == '$' || c >= 0x80u) {
+            const unsigned char *start = p;
+
+            if (p[1] == '\'' && strchr("xXbBnN", c) != NULL) {
+                /*
+                 * Hex, bit or national string literal: let the quote be
+                 * handled as string.
+                 */
+                p++;
+                continue;
+            }
+            while (isalnum(*p) || *p == '_' || *p == '$' || *p >= 0x80u) {
+                p++;
+            }
+            Tcl_DStringAppend(dsPtr, (const char *) start, (TCL_SIZE_T)(p - start));
+
+        } else {
+            DigestPlaceholder(dsPtr, (char) c);
+            p++;
+        }
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DigestAdd --
+ *
+ *      Add the cost of a query to the digest table of the pool. The
+ *      table is split into stripes with their own locks, so concurrent
+ *      handles rarely contend. When a stripe is full, queries with new
+ *      digests are accounted to the entry with the empty text.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Creates or updates a digest entry.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DigestAdd(Pool *poolPtr, const Tcl_DString *sqlPtr, unsigned long usec,
+          unsigned long rows, unsigned long bytes)
+{
+    const char     *sql = Tcl_DStringValue(sqlPtr);
+    DigestTable    *tablePtr;
+    Tcl_HashEntry  *hPtr;
+    Digest         *digestPtr;
+    uint64_t        hash = 14695981039346656037u;
+    TCL_SIZE_T      i;
+    int             isNew;
+
+    for (i = 0; i < Tcl_DStringLength(sqlPtr); i++) {
+        hash = (hash ^ (unsigned char) sql[i]) * 1099511628211u;
+    }
+    tablePtr = &poolPtr->digests[hash % DIGEST_STRIPES];
+
+    Ns_MutexLock(&tablePtr->lock);
+    hPtr = Tcl_FindHashEntry(&tablePtr->entries, sql);
+    if (hPtr == NULL) {
+        if (tablePtr->size < poolPtr->digestSize / DIGEST_STRIPES) {
+            tablePtr->size++;
+        } else {
+            sql = "";
+            hash = 0u;
+        }
+        hPtr = Tcl_CreateHashEntry(&tablePtr->entries, sql, &isNew);
+        if (isNew) {
+            digestPtr = ns_calloc(1u, sizeof(Digest));
+            digestPtr->hash = hash;
+            Tcl_SetHashValue(hPtr, digestPtr);
+        }
+    }
+    digestPtr = Tcl_GetHashValue(hPtr);
+    digestPtr->calls++;
+    digestPtr->time += usec;
+    if (usec > digestPtr->maxTime) {
+        digestPtr->maxTime = usec;
+    }
+    digestPtr->rows += rows;
+    digestPtr->bytes += bytes;
+    Ns_MutexUnlock(&tablePtr->lock);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * QueryDone, FlushQuery --
+ *
+ *      Account a finished query in the digest table and the slow query
+ *      log. FlushQuery does so for the last query of the handle, when
+ *      it was held back until its result was released.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May update the digest table and write to the slow query log.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+QueryDone(Ns_DbHandle *handle, unsigned long usec, unsigned long rows, unsigned long bytes)
+{
+    Context *ctx = (Context *) handle->context;
+
+    if (ctx->poolPtr->digests != NULL) {
+        DigestAdd(ctx->poolPtr, &ctx->digestSql, usec, rows, bytes);
+    }
+    if (ctx->slowSql != NULL) {
+        SlowLog(handle, ctx->slowSql, usec, rows, bytes);
+        ns_free(ctx->slowSql);
+        ns_free(ctx->slowDb);
+        ctx->slowSql = NULL;
+        ctx->slowDb = NULL;
+    }
+}
+
+static void
+FlushQuery(Ns_DbHandle *handle)
+{
+    Context *ctx = (Context *) handle->context;
+
+    if (ctx->queryPending) {
+        ctx->queryPending = NS_FALSE;
+        QueryDone(handle, ctx->queryTime + ctx->fetchTime,
+                  ctx->stats.rows - ctx->queryRows, ctx->stats.bytes - ctx->queryBytes);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DigestTop --
+ *
+ *      Implements "ns_mysql digest top". Collects the digests of all
+ *      pools and returns the n most expensive by total time, calls or
+ *      rows.
+ *
+ * Results:
+ *      Tcl result code. The interp result is a list of dicts.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+DigestCompare(const void *a, const void *b)
+{
+    unsigned long ka = ((const DigestRow *) a)->key, kb = ((const DigestRow *) b)->key;
+
+    return (ka < kb) - (ka > kb);
+}
+
+static int
+DigestTop(Tcl_Interp *interp, int n, const char *by)
+{
+    Tcl_HashEntry  *hPtr, *ePtr;
+    Tcl_HashSearch  search, eSearch;
+    DigestRow      *rows = NULL;
+    Tcl_Obj        *resultObj;
+    size_t          nrows = 0u, capacity = 0u, i;
+    int             j;
+
+    if (!STREQ(by, "time") && !STREQ(by, "calls") && !STREQ(by, "rows")) {
+        Tcl_AppendResult(interp, "invalid sort key \"", by,
+                         "\": must be time, calls or rows", NULL);
+        return TCL_ERROR;
+    }
+
+    Ns_MutexLock(&poolsLock);
+    for (hPtr = Tcl_FirstHashEntry(&pools, &search); hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+        Pool *poolPtr = Tcl_GetHashValue(hPtr);
+
+        if (poolPtr->digests == NULL) {
+            continue;
+        }
+        for (j = 0; j < DIGEST_STRIPES; j++) {
+            DigestTable *tablePtr = &poolPtr->digests[j];
+
+            Ns_MutexLock(&tablePtr->lock);
+            for (ePtr = Tcl_FirstHashEntry(&tablePtr->entries, &eSearch); ePtr != NULL;
+                 ePtr = Tcl_NextHashEntry(&eSearch)) {
+                DigestRow *rowPtr;
+
+                if (nrows == capacity) {
+                    capacity = (capacity == 0u) ? 64u : capacity * 2u;
+                    rows = ns_realloc(rows, capacity * sizeof(DigestRow));
+                }
+                rowPtr = &rows[nrows++];
+                rowPtr->pool = poolPtr->name;
+                rowPtr->queryObj = Tcl_NewStringObj(Tcl_GetHashKey(&tablePtr->entries, ePtr),
+                                                    TCL_INDEX_NONE);
+                rowPtr->digest = *(Digest *) Tcl_GetHashValue(ePtr);
+                rowPtr->key = (*by == 't') ? rowPtr->digest.time
+                    : (*by == 'c') ? rowPtr->digest.calls : rowPtr->digest.rows;
+            }
+            Ns_MutexUnlock(&tablePtr->lock);
+        }
+    }
+    Ns_MutexUnlock(&poolsLock);
+
+    if (nrows > 0u) {
+        qsort(rows, nrows, sizeof(DigestRow), DigestCompare);
+    }
+
+    resultObj = Tcl_NewListObj(0, NULL);
+    for (i = 0u; i < nrows; i++) {
+        Tcl_Obj *dictObj;
+        char     buf[17];
+
+        if (i >= (size_t) n) {
+            Tcl_DecrRefCount(rows[i].queryObj);
+            continue;
+        }
+        snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) rows[i].digest.hash);
+        dictObj = Tcl_NewDictObj();
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("pool", 4),
+                       Tcl_NewStringObj(rows[i].pool, TCL_INDEX_NONE));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("digest", 6), Tcl_NewStringObj(buf, 16));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("query", 5), rows[i].queryObj);
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("calls", 5),
+                       Tcl_NewWideIntObj((Tcl_WideInt) rows[i].digest.calls));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("time", 4),
+                       Tcl_NewWideIntObj((Tcl_WideInt) rows[i].digest.time));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("max", 3),
+                       Tcl_NewWideIntObj((Tcl_WideInt) rows[i].digest.maxTime));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("rows", 4),
+                       Tcl_NewWideIntObj((Tcl_WideInt) rows[i].digest.rows));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("bytes", 5),
+                       Tcl_NewWideIntObj((Tcl_WideInt) rows[i].digest.bytes));
+        Tcl_ListObjAppendElement(NULL, resultObj, dictObj);
+    }
+    ns_free(rows);
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DigestReset --
+ *
+ *      Remove all digests of all pools.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Frees the digest entries.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DigestReset(void)
+{
+    Tcl_HashEntry  *hPtr, *ePtr;
+    Tcl_HashSearch  search, eSearch;
+    int             j;
+
+    Ns_MutexLock(&poolsLock);
+    for (hPtr = Tcl_FirstHashEntry(&pools, &search); hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+        Pool *poolPtr = Tcl_GetHashValue(hPtr);
+
+        if (poolPtr->digests == NULL) {
+            continue;
+        }
+        for (j = 0; j < DIGEST_STRIPES; j++) {
+            DigestTable *tablePtr = &poolPtr->digests[j];
+
+            Ns_MutexLock(&tablePtr->lock);
+            for (ePtr = Tcl_FirstHashEntry(&tablePtr->entries, &eSearch); ePtr != NULL;
+                 ePtr = Tcl_NextHashEntry(&eSearch)) {
+                ns_free(Tcl_GetHashValue(ePtr));
+                Tcl_DeleteHashEntry(ePtr);
+            }
+            tablePtr->size = 0;
+            Ns_MutexUnlock(&tablePtr->lock);
+        }
+    }
+    Ns_MutexUnlock(&poolsLock);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SlowQuery --
+ *
+ *      Decide whether a query over the slow query threshold is logged,
+ *      applying the sampling and rate limit of the pool.
+ *
+ * Results:
+ *      NS_TRUE when the query is to be logged. In that case
+ *      *suppressedPtr is set to the number of entries dropped by the
+ *      rate limit since the last logged one.
+ *
+ * Side effects:
+ *      Updates the slow query counters of the pool.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+SlowQuery(Pool *poolPtr, unsigned long *suppressedPtr)
+{
+    time_t now = time(NULL);
+    bool   log = NS_FALSE;
+
+    Ns_MutexLock(&poolPtr->lock);
+    if (++poolPtr->slowSeen % (unsigned long) poolPtr->slowSampling == 0u) {
+        if (now != poolPtr->slowSecond) {
+            poolPtr->slowSecond = now;
+            poolPtr->slowCount = 0;
+        }
+        if (poolPtr->slowRateLimit == 0 || poolPtr->slowCount < poolPtr->slowRateLimit) {
+            poolPtr->slowCount++;
+            *suppressedPtr = poolPtr->slowSuppressed;
+            poolPtr->slowSuppressed = 0u;
+            log = NS_TRUE;
+        } else {
+            poolPtr->slowSuppressed++;
+        }
+    }
+    Ns_MutexUnlock(&poolPtr->lock);
+
+    return log;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SlowLog --
+ *
+ *      Write a slow query log entry with time, pool, connection id,
+ *      duration, rows, bytes and SQL text. With slowqueryexplain, the
+ *      entry of a SELECT is handed to the explain thread, which adds
+ *      the EXPLAIN FORMAT=JSON output obtained over its own connection
+ *      and writes it, so the query path does not wait for it.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May queue an explain job and start the explain thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SlowLog(Ns_DbHandle *handle, const char *sql, unsigned long usec,
+        unsigned long rows, unsigned long bytes)
+{
+    Context       *ctx = (Context *) handle->context;
+    Pool          *poolPtr = ctx->poolPtr;
+    unsigned long  suppressed = 0u;
+    Tcl_DString    ds;
+    char           buf[64], *p;
+    time_t         now;
+    struct tm      tm;
+    const char    *q;
+
+    if (!SlowQuery(poolPtr, &suppressed)) {
+        return;
+    }
+
+    now = time(NULL);
+    (void) strftime(buf, sizeof(buf), "[%d/%b/%Y:%H:%M:%S %z]", ns_localtime_r(&now, &tm));
+
+    Tcl_DStringInit(&ds);
+    Ns_DStringPrintf(&ds, "%s pool %s conn %lu time %lu.%06lu rows %lu bytes %lu",
+                     buf, poolPtr->name, (unsigned long) mysql_thread_id((MYSQL *) handle->connection),
+                     usec / 1000000u, usec % 1000000u, rows, bytes);
+    if (suppressed > 0u) {
+        Ns_DStringPrintf(&ds, " suppressed %lu", suppressed);
+    }
+    Tcl_DStringAppend(&ds, " sql ", 5);
+    p = Tcl_DStringAppend(&ds, sql, TCL_INDEX_NONE) + Tcl_DStringLength(&ds) - (TCL_SIZE_T) strlen(sql);
+    for (; *p != '\0'; p++) {
+        if (*p == '\n' || *p == '\r' || *p == '\t') {
+            *p = ' ';
+        }
+    }
+    Tcl_DStringAppend(&ds, "\n", 1);
+
+    /*
+     * Only SELECTs are explained. With multistatements, a ";" could
+     * make EXPLAIN run further statements, so such texts are skipped.
+     */
+    for (q = sql; isspace((unsigned char) *q) || *q == '('; q++) {
+        ;
+    }
+    if (poolPtr->slowExplain
+        && (strncasecmp(q, "select", 6u) == 0 || strncasecmp(q, "with", 4u) == 0)
+        && !(poolPtr->multiStatements && strchr(sql, ';') != NULL)) {
+        ExplainJob *jobPtr = NULL;
+
+        Ns_MutexLock(&explainLock);
+        if (explainQueued < EXPLAIN_QUEUE) {
+            jobPtr = ns_calloc(1u, sizeof(ExplainJob));
+            jobPtr->poolPtr = poolPtr;
+            jobPtr->driver = ns_strdup(handle->driver);
+            jobPtr->datasource = ns_strdup(ctx->slowSource);
+            jobPtr->database = ns_strdup(ctx->slowDb);
+            jobPtr->user = ns_strcopy(handle->user);
+            jobPtr->password = ns_strcopy(handle->password);
+            jobPtr->sql = ns_strdup(sql);
+            Tcl_DStringInit(&jobPtr->entry);
+            Tcl_DStringAppend(&jobPtr->entry, Tcl_DStringValue(&ds), Tcl_DStringLength(&ds));
+            if (lastExplainPtr != NULL) {
+                lastExplainPtr->nextPtr = jobPtr;
+            } else {
+                firstExplainPtr = jobPtr;
+            }
+            lastExplainPtr = jobPtr;
+            explainQueued++;
+            if (!explainRunning) {
+                explainRunning = NS_TRUE;
+                Ns_ThreadCreate(ExplainThread, NULL, 0, NULL);
+            }
+            Ns_CondSignal(&explainCond);
+        }
+        Ns_MutexUnlock(&explainLock);
+        if (jobPtr != NULL) {
+            Tcl_DStringFree(&ds);
+            return;
+        }
+    }
+
+    SlowWrite(poolPtr, &ds);
+    Tcl_DStringFree(&ds);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SlowWrite --
+ *
+ *      Write a slow query log entry to the log file of the pool via the
+ *      async log writer, or to the system log when no file is
+ *      configured.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      I/O.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SlowWrite(const Pool *poolPtr, const Tcl_DString *dsPtr)
+{
+    if (poolPtr->slowFd != NS_INVALID_FD) {
+        (void) Ns_AsyncWrite(poolPtr->slowFd, Tcl_DStringValue(dsPtr), (size_t) Tcl_DStringLength(dsPtr));
+    } else {
+        Ns_Log(Notice, "nsdbmysql: slow query: %.*s",
+               (int) Tcl_DStringLength(dsPtr) - 1, Tcl_DStringValue(dsPtr));
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ExplainThread --
+ *
+ *      Run EXPLAIN FORMAT=JSON for queued slow queries in the order
+ *      they were logged, each over a short-lived connection to the
+ *      datasource and database the query ran on, and write the
+ *      completed log entries.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Opens connections to the server.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ExplainThread(void *UNUSED(arg))
+{
+    ExplainJob     *jobPtr;
+
+    Ns_ThreadSetName("-nsdbmysql:explain-");
+    InitThread();
+
+    Ns_MutexLock(&explainLock);
+    for (;;) {
+        Ns_DbHandle     handle;
+        MYSQL          *mysql;
+        Tcl_DString     ds;
+
+        while (firstExplainPtr == NULL) {
+            Ns_CondWait(&explainCond, &explainLock);
+        }
+        jobPtr = firstExplainPtr;
+        firstExplainPtr = jobPtr->nextPtr;
+        if (firstExplainPtr == NULL) {
+            lastExplainPtr = NULL;
+        }
+        explainQueued--;
+        Ns_MutexUnlock(&explainLock);
+
+        memset(&handle, 0, sizeof(handle));
+        handle.driver = jobPtr->driver;
+        handle.datasource = jobPtr->datasource;
+        handle.user = jobPtr->user;
+        handle.password = jobPtr->password;
+        handle.poolname = jobPtr->poolPtr->name;
+        Tcl_DStringInit(&handle.dsExceptionMsg);
+
+        mysql = Connect(&handle, handle.datasource, NS_FALSE, NS_FALSE, 0u);
+        if (mysql != NULL) {
+            Tcl_DStringInit(&ds);
+            Tcl_DStringAppend(&ds, "EXPLAIN FORMAT=JSON ", TCL_INDEX_NONE);
+            Tcl_DStringAppend(&ds, jobPtr->sql, TCL_INDEX_NONE);
+            if ((*jobPtr->database == '\0' || mysql_select_db(mysql, jobPtr->database) == 0)
+                && mysql_query(mysql, Tcl_DStringValue(&ds)) == 0) {
+                MYSQL_RES *result = mysql_store_result(mysql);
+                MYSQL_ROW  row = (result != NULL) ? mysql_fetch_row(result) : NULL;
+
+                if (row != NULL && row[0] != NULL) {
+                    char *p;
+
+                    Tcl_DStringAppend(&jobPtr->entry, "    explain ", TCL_INDEX_NONE);
+                    p = Tcl_DStringAppend(&jobPtr->entry, row[0], TCL_INDEX_NONE)
+                        + Tcl_DStringLength(&jobPtr->entry) - (TCL_SIZE_T) strlen(row[0]);
+                    for (; *p != '\0'; p++) {
+                        if (*p == '\n' || *p == '\r') {
+                            *p = ' ';
+                        }
+                    }
+                    Tcl_DStringAppend(&jobPtr->entry, "\n", 1);
+                }
+                if (result != NULL) {
+                    mysql_free_result(result);
+                }
+            }
+            if (mysql_errno(mysql) != 0u) {
+                Ns_DStringPrintf(&jobPtr->entry, "    explain error (%u) %s\n",
+                                 mysql_errno(mysql), mysql_error(mysql));
+            }
+            Tcl_DStringFree(&ds);
+            mysql_close(mysql);
+        } else {
+            Ns_DStringPrintf(&jobPtr->entry, "    explain error: %s\n",
+                             Tcl_DStringValue(&handle.dsExceptionMsg));
+        }
+        Tcl_DStringFree(&handle.dsExceptionMsg);
+
+        SlowWrite(jobPtr->poolPtr, &jobPtr->entry);
+
+        Tcl_DStringFree(&jobPtr->entry);
+        ns_free(jobPtr->driver);
+        ns_free(jobPtr->datasource);
+        ns_free(jobPtr->database);
+        ns_free(jobPtr->user);
+        ns_free(jobPtr->password);
+        ns_free(jobPtr->sql);
+        ns_free(jobPtr);
+
+        Ns_MutexLock(&explainLock);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheLookup --
+ *
+ *      Look up the result of a query in the result cache of the pool,
+ *      keyed by the current database and the SQL text. An entry is
+ *      valid until its TTL expires or until one of the tables it was
+ *      read from is written (see CacheWrite). On a hit, the handle is
+ *      set up to return the cached rows via DbGetRow.
+ *
+ * Results:
+ *      NS_TRUE on a hit.
+ *
+ * Side effects:
+ *      Updates the cache counters. Expired and invalidated entries are
+ *      removed. On a miss, the current write generation is remembered
+ *      for CacheStore.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+CacheLookup(Ns_DbHandle *handle, const char *sql)
+{
+    Context        *ctx = (Context *) handle->context;
+    Pool           *poolPtr = ctx->poolPtr;
+    Tcl_HashEntry  *hPtr;
+    CacheEntry     *entryPtr = NULL;
+    Tcl_DString     key;
+    Ns_Time         now, diff;
+
+    Ns_GetTime(&now);
+    Tcl_DStringInit(&key);
+    CacheKey(&key, ctx, sql);
+
+    Ns_MutexLock(&cacheLock);
+    ctx->cacheGeneration = cacheGeneration;
+    Ns_MutexUnlock(&cacheLock);
+
+    Ns_MutexLock(&poolPtr->cacheLock);
+    hPtr = Tcl_FindHashEntry(&poolPtr->cache, Tcl_DStringValue(&key));
+    if (hPtr != NULL) {
+        entryPtr = Tcl_GetHashValue(hPtr);
+        if (Ns_DiffTime(&entryPtr->expires, &now, &diff) < 0) {
+            poolPtr->cacheExpired++;
+            CacheRemove(poolPtr, entryPtr);
+            entryPtr = NULL;
+        } else if (!CacheValid(entryPtr)) {
+            poolPtr->cacheInvalidated++;
+            CacheRemove(poolPtr, entryPtr);
+            entryPtr = NULL;
+        }
+    }
+    if (entryPtr != NULL) {
+        poolPtr->cacheHits++;
+        entryPtr->refCount++;
+        CacheUnlink(poolPtr, entryPtr);
+        CacheLink(poolPtr, entryPtr);
+    } else {
+        poolPtr->cacheMisses++;
+    }
+    Ns_MutexUnlock(&poolPtr->cacheLock);
+    Tcl_DStringFree(&key);
+
+    if (entryPtr == NULL) {
+        return NS_FALSE;
+    }
+    ctx->cachePtr = entryPtr;
+    ctx->cacheRow = 0u;
+    handle->fetchingRows = NS_TRUE;
+
+    return NS_TRUE;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheStore --
+ *
+ *      Copy a buffered result into the result cache of the pool. The
+ *      entry holds the column metadata, the row data and the tables
+ *      the result was read from, in a single allocation. Results
+ *      larger than an eighth of the cache are not cached, nor are
+ *      results of tables written while the query was running.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May evict least recently used entries.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheStore(Ns_DbHandle *handle, const char *sql, const CacheEntry *resultPtr)
+{
+    Context            *ctx = (Context *) handle->context;
+    Pool               *poolPtr = ctx->poolPtr;
+    const MYSQL_FIELD  *fields = resultPtr->fields;
+    unsigned int        ncols = resultPtr->ncols, i;
+    unsigned long       nrows = resultPtr->nrows, r;
+    size_t              n = (size_t) nrows * ncols, k;
+    CacheEntry         *entryPtr;
+    Tcl_HashEntry      *hPtr;
+    Tcl_DString         key, tables;
+    size_t              size, dataSize = 0u;
+    char               *p;
+    int                 isNew, ntables = 0;
+    Ns_Time             now;
+
+    Tcl_DStringInit(&tables);
+    for (i = 0u; i < ncols; i++) {
+        if (fields[i].org_table != NULL && *fields[i].org_table != '\0') {
+            CacheTableKey(&tables, handle->datasource,
+                          (fields[i].db != NULL && *fields[i].db != '\0') ? fields[i].db : ctx->database,
+                          TCL_INDEX_NONE, fields[i].org_table, TCL_INDEX_NONE);
+        }
+    }
+    ParseTables(handle, sql, &tables);
+    CacheTableKey(&tables, handle->datasource, "*", 1, "*", 1);
+    for (p = Tcl_DStringValue(&tables); p < Tcl_DStringValue(&tables) + Tcl_DStringLength(&tables);
+         p += strlen(p) + 1u) {
+        ntables++;
+    }
+
+    for (k = 0u; k < n; k++) {
+        if (resultPtr->values[k] != NULL) {
+            dataSize += resultPtr->lengths[k] + 1u;
+        }
+    }
+    size = sizeof(CacheEntry) + FieldsSize(fields, ncols)
+        + (size_t) nrows * ncols * (sizeof(char *) + sizeof(unsigned long))
+        + dataSize + (size_t) Tcl_DStringLength(&tables);
+
+    if (size > poolPtr->cacheMax / 8u) {
+        Tcl_DStringFree(&tables);
+        return;
+    }
+
+    entryPtr = ns_calloc(1u, size);
+    entryPtr->size = size;
+    entryPtr->refCount = 1;
+    entryPtr->generation = ctx->cacheGeneration;
+    entryPtr->ncols = ncols;
+    entryPtr->nrows = nrows;
+    entryPtr->fields = (MYSQL_FIELD *) (entryPtr + 1);
+    entryPtr->values = (char **) (entryPtr->fields + ncols);
+    entryPtr->lengths = (unsigned long *) (entryPtr->values + nrows * ncols);
+    p = (char *) (entryPtr->lengths + nrows * ncols);
+
+    entryPtr->ntables = ntables;
+    entryPtr->tables = p;
+    memcpy(p, Tcl_DStringValue(&tables), (size_t) Tcl_DStringLength(&tables));
+    p += Tcl_DStringLength(&tables);
+    Tcl_DStringFree(&tables);
+
+    p = CopyFields(entryPtr->fields, fields, ncols, p);
+
+    for (r = 0u; r < nrows; r++) {
+        for (i = 0u; i < ncols; i++) {
+            k = r * ncols + i;
+            entryPtr->lengths[k] = resultPtr->lengths[k];
+            if (resultPtr->values[k] != NULL) {
+                memcpy(p, resultPtr->values[k], resultPtr->lengths[k]);
+                p[resultPtr->lengths[k]] = '\0';
+                entryPtr->values[k] = p;
+                p += resultPtr->lengths[k] + 1u;
+            }
+        }
+    }
+
+    Ns_GetTime(&now);
+    entryPtr->expires = now;
+    Ns_IncrTime(&entryPtr->expires, ctx->cacheTtl.sec, ctx->cacheTtl.usec);
+
+    Tcl_DStringInit(&key);
+    CacheKey(&key, ctx, sql);
+
+    Ns_MutexLock(&poolPtr->cacheLock);
+    if (!CacheValid(entryPtr)) {
+        /*
+         * A table was written while the query was running.
+         */
+        Ns_MutexUnlock(&poolPtr->cacheLock);
+        Tcl_DStringFree(&key);
+        ns_free(entryPtr);
+        return;
+    }
+    hPtr = Tcl_CreateHashEntry(&poolPtr->cache, Tcl_DStringValue(&key), &isNew);
+    if (!isNew) {
+        CacheRemove(poolPtr, Tcl_GetHashValue(hPtr));
+        hPtr = Tcl_CreateHashEntry(&poolPtr->cache, Tcl_DStringValue(&key), &isNew);
+    }
+    entryPtr->hPtr = hPtr;
+    Tcl_SetHashValue(hPtr, entryPtr);
+    CacheLink(poolPtr, entryPtr);
+    poolPtr->cacheSize += size;
+    poolPtr->cacheStores++;
+    while (poolPtr->cacheSize > poolPtr->cacheMax && poolPtr->lastCachePtr != entryPtr) {
+        poolPtr->cacheEvictions++;
+        CacheRemove(poolPtr, poolPtr->lastCachePtr);
+    }
+    Ns_MutexUnlock(&poolPtr->cacheLock);
+    Tcl_DStringFree(&key);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheWrite --
+ *
+ *      Invalidate cached results after a statement that may have
+ *      written tables. The tables are taken from the statement text;
+ *      statements whose targets are not known (e.g. CALL) invalidate
+ *      all entries of the server. Tables written in a transaction are
+ *      invalidated again on COMMIT, since other handles may have
+ *      cached the old rows in between. Also tracks USE statements for
+ *      the cache keys.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Advances the write generation of the tables.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheWrite(Ns_DbHandle *handle, const char *sql)
+{
+    static const char *const reads[] = {
+        "select", "show", "explain", "describe", "desc", "help", "do", "set",
+        "begin", "start", "savepoint", "release", "xa", "lock", "unlock", NULL
+    };
+    static const char *const writes[] = {
+        "insert", "replace", "update", "delete", "truncate", "alter", "drop",
+        "create", "rename", "load", NULL
+    };
+    Context        *ctx = (Context *) handle->context;
+    Tcl_DString     tables;
+    const char     *p = sql;
+    char            word[32];
+    int             i;
+
+    if (ctx == NULL) {
+        return;
+    }
+
+    p = SqlWord(p, word, sizeof(word));
+    if (STREQ(word, "use")) {
+        char db[256];
+
+        (void) SqlIdentifier(p, db, sizeof(db), NULL);
+        if (*db != '\0') {
+            ns_free(ctx->database);
+            ctx->database = ns_strdup(db);
+        }
+        return;
+    }
+    if (!cacheEnabled) {
+        return;
+    }
+    for (i = 0; reads[i] != NULL; i++) {
+        if (STREQ(word, reads[i])) {
+            return;
+        }
+    }
+    if (STREQ(word, "commit") || STREQ(word, "rollback")) {
+        if (*word == 'c') {
+            CacheBump(&ctx->txnTables);
+        }
+        Tcl_DStringSetLength(&ctx->txnTables, 0);
+        return;
+    }
+
+    Tcl_DStringInit(&tables);
+    for (i = 0; writes[i] != NULL; i++) {
+        if (STREQ(word, writes[i])) {
+            break;
+        }
+    }
+    if (writes[i] == NULL
+        || (ctx->poolPtr->multiStatements && strchr(sql, ';') != NULL)) {
+        CacheTableKey(&tables, handle->datasource, "*", 1, "*", 1);
+    } else {
+        ParseTables(handle, sql, &tables);
+        if (Tcl_DStringLength(&tables) == 0) {
+            CacheTableKey(&tables, handle->datasource, "*", 1, "*", 1);
+        }
+    }
+    CacheBump(&tables);
+    if ((((MYSQL *) handle->connection)->server_status & SERVER_STATUS_IN_TRANS) != 0u) {
+        Tcl_DStringAppend(&ctx->txnTables, Tcl_DStringValue(&tables), Tcl_DStringLength(&tables));
+    }
+    Tcl_DStringFree(&tables);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseTables --
+ *
+ *      Collect the tables named in an SQL statement after FROM, JOIN,
+ *      INTO, UPDATE, TABLE and TO (including comma separated lists), and
+ *      the target of INSERT, REPLACE and TRUNCATE. This is not a full
+ *      parser; it errs on the side of naming too many tables.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Appends the table keys to dsPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ParseTables(Ns_DbHandle *handle, const char *sql, Tcl_DString *dsPtr)
+{
+    static const char *const stops[] = {
+        "where", "join", "inner", "left", "right", "cross", "natural", "straight_join",
+        "on", "using", "group", "order", "limit", "having", "union", "set", "values",
+        "value", "select", "partition", "force", "use", "ignore", "for", "lock", "window",
+        "into", "outer", "full", "to", "from", "as", "with", "like", "if", "add", "modify",
+        "change", "engine", "default", NULL
+    };
+    static const char *const modifiers[] = {
+        "low_priority", "delayed", "high_priority", "ignore", "quick", "into", "table",
+        "temporary", "if", "not", "exists", "only", NULL
+    };
+    const Context  *ctx = (Context *) handle->context;
+    const char     *p = sql, *q;
+    char            word[32], db[256], table[256];
+    bool            single = NS_FALSE, isStop;
+    int             i;
+
+    q = SqlWord(p, word, sizeof(word));
+    if (STREQ(word, "insert") || STREQ(word, "replace") || STREQ(word, "truncate")) {
+        /*
+         * Only the target is written; stop before a possibly large
+         * VALUES list or the tables of INSERT ... SELECT.
+         */
+        single = NS_TRUE;
+        p = q;
+    }
+
+    while (*p != '\0') {
+        if (!single) {
+            p = SqlWord(p, word, sizeof(word));
+            if (*word == '\0') {
+                p = SqlSkip(p);
+                continue;
+            }
+            if (!STREQ(word, "from") && !STREQ(word, "join") && !STREQ(word, "into")
+                && !STREQ(word, "update") && !STREQ(word, "table") && !STREQ(word, "to")
+                && !STREQ(word, "straight_join")) {
+                continue;
+            }
+        }
+        for (;;) {
+            /*
+             * Skip modifiers, then read "db.table" or "table".
+             */
+            for (;;) {
+                q = SqlWord(p, word, sizeof(word));
+                for (i = 0; modifiers[i] != NULL && !STREQ(word, modifiers[i]); i++) {
+                    ;
+                }
+                if (modifiers[i] == NULL) {
+                    break;
+                }
+                p = q;
+            }
+            p = SqlIdentifier(p, table, sizeof(table), &isStop);
+            if (*table == '\0') {
+                break;
+            }
+            if (!isStop) {
+                for (i = 0; stops[i] != NULL && strcasecmp(table, stops[i]) != 0; i++) {
+                    ;
+                }
+                if (stops[i] != NULL) {
+                    break;
+                }
+            }
+            if (*p == '.') {
+                strcpy(db, table);
+                p = SqlIdentifier(p + 1, table, sizeof(table), NULL);
+                CacheTableKey(dsPtr, handle->datasource, db, TCL_INDEX_NONE, table, TCL_INDEX_NONE);
+            } else {
+                CacheTableKey(dsPtr, handle->datasource, ctx->database, TCL_INDEX_NONE,
+                              table, TCL_INDEX_NONE);
+            }
+            if (single) {
+                break;
+            }
+
+            /*
+             * Skip an alias and continue with a comma separated list.
+             */
+            q = SqlWord(p, word, sizeof(word));
+            if (STREQ(word, "as")) {
+                p = SqlIdentifier(q, word, sizeof(word), NULL);
+            } else if (*word != '\0') {
+                for (i = 0; stops[i] != NULL && !STREQ(word, stops[i]); i++) {
+                    ;
+                }
+                if (stops[i] == NULL) {
+                    p = q;
+                }
+            } else if (*q == '`') {
+                p = SqlIdentifier(q, word, sizeof(word), NULL);
+            }
+            p = SqlSpace(p);
+            if (*p != ',') {
+                break;
+            }
+            p++;
+        }
+        if (single) {
+            break;
+        }
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SqlSpace, SqlSkip, SqlWord, SqlIdentifier --
+ *
+ *      Tokenizer helpers for ParseTables and CacheWrite. SqlSpace skips
+ *      white space and comments, SqlSkip one token that is not a word
+ *      (string literals, operators). SqlWord reads a bare word in lower
+ *      case, leaving word empty if there is none. SqlIdentifier reads a
+ *      bare or backquoted identifier; *quotedPtr tells whether it was
+ *      quoted, so it cannot be a keyword.
+ *
+ * Results:
+ *      Position after the token.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char *
+SqlSpace(const char *p)
+{
+    for (;;) {
+        while (isspace((unsigned char) *p)) {
+            p++;
+        }
+        if (p[0] == '/' && p[1] == '*') {
+            const char *end = strstr(p + 2, "*/");
+
+            p = (end != NULL) ? end + 2 : p + strlen(p);
+        } else if (*p == '#' || (p[0] == '-' && p[1] == '-' && (p[2] == '\0' || isspace((unsigned char) p[2])))) {
+            while (*p != '\0' && *p != '\n') {
+                p++;
+            }
+        } else {
+            return p;
+        }
+    }
+}
+
+static const char *
+SqlSkip(const char *p)
+{
+    char quote = *p;
+
+    if (quote == '\'' || quote == '"' || quote == '`') {
+        for (p++; *p != '\0'; p++) {
+            if (*p == '\\' && quote != '`' && p[1] != '\0') {
+                p++;
+            } else if (*p == quote) {
+                if (p[1] != quote) {
+                    return p + 1;
+                }
+                p++;
+            }
+        }
+        return p;
+    }
+    return (*p != '\0') ? p + 1 : p;
+}
+
+static const char *
+SqlWord(const char *p, char *word, size_t size)
+{
+    size_t n = 0u;
+
+    p = SqlSpace(p);
+    if (isalpha((unsigned char) *p) || *p == '_') {
+        while (isalnum((unsigned char) *p) || *p == '_' || *p == '$') {
+            if (n + 1u < size) {
+                word[n++] = (char) tolower((unsigned char) *p);
+            }
+            p++;
+        }
+    }
+    word[n] = '\0';
+    return p;
+}
+
+static const char *
+SqlIdentifier(const char *p, char *name, size_t size, bool *quotedPtr)
+{
+    size_t n = 0u;
+
+    p = SqlSpace(p);
+    if (quotedPtr != NULL) {
+        *quotedPtr = (*p == '`');
+    }
+    if (*p == '`') {
+        for (p++; *p != '\0'; p++) {
+            if (*p == '`') {
+                if (p[1] != '`') {
+                    p++;
+                    break;
+                }
+                p++;
+            }
+            if (n + 1u < size) {
+                name[n++] = *p;
+            }
+        }
+    } else {
+        while (isalnum((unsigned char) *p) || *p == '_' || *p == '$' || (unsigned char) *p >= 0x80u) {
+            if (n + 1u < size) {
+                name[n++] = *p;
+            }
+            p++;
+        }
+    }
+    name[n] = '\0';
+    return p;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheKey, CacheTableKey --
+ *
+ *      Build the key of a cached result (database and SQL text) and of
+ *      a table for invalidation (server part of the datasource,
+ *      database and table, in lower case), the latter NUL terminated
+ *      and appended to a list.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Appends to dsPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheKey(Tcl_DString *dsPtr, const Context *ctx, const char *sql)
+{
+    Tcl_DStringAppend(dsPtr, ctx->database, TCL_INDEX_NONE);
+    Tcl_DStringAppend(dsPtr, "\n", 1);
+    Tcl_DStringAppend(dsPtr, sql, TCL_INDEX_NONE);
+}
+
+static void
+CacheTableKey(Tcl_DString *dsPtr, const char *datasource, const char *db, TCL_SIZE_T dbLength,
+              const char *table, TCL_SIZE_T tableLength)
+{
+    const char *end = strrchr(datasource, ':');
+    TCL_SIZE_T  start = Tcl_DStringLength(dsPtr), i;
+    char       *p;
+
+    Tcl_DStringAppend(dsPtr, datasource,
+                      end != NULL ? (TCL_SIZE_T) (end - datasource) : TCL_INDEX_NONE);
+    Tcl_DStringAppend(dsPtr, "/", 1);
+    Tcl_DStringAppend(dsPtr, db, dbLength);
+    Tcl_DStringAppend(dsPtr, ".", 1);
+    Tcl_DStringAppend(dsPtr, table, tableLength);
+    p = Tcl_DStringValue(dsPtr);
+    for (i = start; i < Tcl_DStringLength(dsPtr); i++) {
+        p[i] = (char) tolower((unsigned char) p[i]);
+    }
+    Tcl_DStringAppend(dsPtr, "", 1);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheBump, CacheValid --
+ *
+ *      CacheBump records a write to the given list of tables by setting
+ *      their generation to a new value of the global write counter.
+ *      CacheValid checks that none of the tables of an entry was
+ *      written since the entry's query started.
+ *
+ * Results:
+ *      CacheValid: NS_TRUE when the entry is still valid.
+ *
+ * Side effects:
+ *      CacheBump updates the table generations.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheBump(const Tcl_DString *tablesPtr)
+{
+    const char     *p = Tcl_DStringValue(tablesPtr), *end = p + Tcl_DStringLength(tablesPtr);
+    Tcl_HashEntry  *hPtr;
+    int             isNew;
+
+    if (p == end) {
+        return;
+    }
+    Ns_MutexLock(&cacheLock);
+    cacheGeneration++;
+    for (; p < end; p += strlen(p) + 1u) {
+        hPtr = Tcl_CreateHashEntry(&cacheTables, p, &isNew);
+        Tcl_SetHashValue(hPtr, (void *) (uintptr_t) cacheGeneration);
+    }
+    Ns_MutexUnlock(&cacheLock);
+}
+
+static bool
+CacheValid(const CacheEntry *entryPtr)
+{
+    const char     *p = entryPtr->tables;
+    Tcl_HashEntry  *hPtr;
+    bool            valid = NS_TRUE;
+    int             i;
+
+    Ns_MutexLock(&cacheLock);
+    for (i = 0; i < entryPtr->ntables && valid; i++, p += strlen(p) + 1u) {
+        hPtr = Tcl_FindHashEntry(&cacheTables, p);
+        if (hPtr != NULL && (unsigned long) (uintptr_t) Tcl_GetHashValue(hPtr) > entryPtr->generation) {
+            valid = NS_FALSE;
+        }
+    }
+    Ns_MutexUnlock(&cacheLock);
+
+    return valid;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheLink, CacheUnlink, CacheRemove, CacheRelease, CacheFlush --
+ *
+ *      Maintain the LRU list and the entries of the result cache of a
+ *      pool. Entries are reference counted: the cache holds one
+ *      reference and each handle reading the entry another, so a
+ *      removed entry stays valid until the last reader is done. All
+ *      but CacheRelease are called with the cache lock held.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May free entries.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheLink(Pool *poolPtr, CacheEntry *entryPtr)
+{
+    entryPtr->prevPtr = NULL;
+    entryPtr->nextPtr = poolPtr->firstCachePtr;
+    if (entryPtr->nextPtr != NULL) {
+        entryPtr->nextPtr->prevPtr = entryPtr;
+    } else {
+        poolPtr->lastCachePtr = entryPtr;
+    }
+    poolPtr->firstCachePtr = entryPtr;
+}
+
+static void
+CacheUnlink(Pool *poolPtr, CacheEntry *entryPtr)
+{
+    if (entryPtr->prevPtr != NULL) {
+        entryPtr->prevPtr->nextPtr = entryPtr->nextPtr;
+    } else {
+        poolPtr->firstCachePtr = entryPtr->nextPtr;
+    }
+    if (entryPtr->nextPtr != NULL) {
+        entryPtr->nextPtr->prevPtr = entryPtr->prevPtr;
+    } else {
+        poolPtr->lastCachePtr = entryPtr->prevPtr;
+    }
+}
+
+static void
+CacheRemove(Pool *poolPtr, CacheEntry *entryPtr)
+{
+    CacheUnlink(poolPtr, entryPtr);
+    Tcl_DeleteHashEntry(entryPtr->hPtr);
+    entryPtr->hPtr = NULL;
+    poolPtr->cacheSize -= entryPtr->size;
+    if (--entryPtr->refCount == 0) {
+        ns_free(entryPtr);
+    }
+}
+
+static void
+CacheRelease(Pool *poolPtr, CacheEntry *entryPtr)
+{
+    if (entryPtr->buffered) {
+        CacheFree(entryPtr);
+        return;
+    }
+    Ns_MutexLock(&poolPtr->cacheLock);
+    if (--entryPtr->refCount == 0) {
+        ns_free(entryPtr);
+    }
+    Ns_MutexUnlock(&poolPtr->cacheLock);
+}
+
+static void
+CacheFree(CacheEntry *entryPtr)
+{
+    while (entryPtr->chunks != NULL) {
+        RowChunk *chunkPtr = entryPtr->chunks;
+
+        entryPtr->chunks = chunkPtr->nextPtr;
+        ns_free(chunkPtr);
+    }
+    ns_free(entryPtr->values);
+    ns_free(entryPtr->lengths);
+    ns_free(entryPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FieldsSize, CopyFields --
+ *
+ *      Copy the column metadata used by the driver (types, flags,
+ *      names and tables) into a result of the cache. FieldsSize
+ *      returns the space needed for the copy, CopyFields makes it with
+ *      the strings stored from p on.
+ *
+ * Results:
+ *      Size in bytes, or the position after the copied strings.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static size_t
+FieldsSize(const MYSQL_FIELD *fields, unsigned int ncols)
+{
+    size_t       size = ncols * sizeof(MYSQL_FIELD);
+    unsigned int i;
+
+    for (i = 0u; i < ncols; i++) {
+        size += strlen(fields[i].name) + 1u + strlen(fields[i].table != NULL ? fields[i].table : "") + 1u;
+    }
+    return size;
+}
+
+static char *
+CopyFields(MYSQL_FIELD *to, const MYSQL_FIELD *fields, unsigned int ncols, char *p)
+{
+    unsigned int i;
+
+    for (i = 0u; i < ncols; i++) {
+        MYSQL_FIELD *fieldPtr = &to[i];
+
+        fieldPtr->type = fields[i].type;
+        fieldPtr->flags = fields[i].flags;
+        fieldPtr->charsetnr = fields[i].charsetnr;
+        fieldPtr->length = fields[i].length;
+        fieldPtr->name = strcpy(p, fields[i].name);
+        fieldPtr->name_length = (unsigned int) strlen(p);
+        p += fieldPtr->name_length + 1u;
+        fieldPtr->table = strcpy(p, fields[i].table != NULL ? fields[i].table : "");
+        fieldPtr->table_length = (unsigned int) strlen(p);
+        p += fieldPtr->table_length + 1u;
+    }
+    return p;
+}
+
+static void
+CacheFlush(Pool *poolPtr)
+{
+    while (poolPtr->firstCachePtr != NULL) {
+        CacheRemove(poolPtr, poolPtr->firstCachePtr);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RunQuery --
+ *
+ *      Send a query of ns_db select/exec, on a replica when RouteQuery
+ *      chooses one. When the replica connection fails, the replica is
+ *      taken out of use and the query is repeated on the primary. When
+ *      the primary connection is lost (pool parameter reconnect), it is
+ *      reopened, and a read-only statement outside of a transaction is
+ *      repeated once.
+ *
+ * Results:
+ *      Return code of mysql_query().
+ *
+ * Side effects:
+ *      handle->connection is the connection the query was sent on,
+ *      until RoutePrimary() is called.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+RunQuery(Ns_DbHandle *handle, const char *sql)
+{
+    Context        *ctx = (Context *) handle->context;
+    int             rc;
+    bool            inTrans;
+
+    RouteQuery(handle, sql);
+    inTrans = ((ctx->primary->server_status & SERVER_STATUS_IN_TRANS) != 0u);
+    rc = mysql_query((MYSQL *) handle->connection, sql);
+    if (rc != 0 && ctx->replica >= 0) {
+        unsigned int nErr = mysql_errno((MYSQL *) handle->connection);
+
+        if (nErr >= 2000u && nErr < 3000u) {
+            /*
+             * Client error, i.e. the connection to the replica is
+             * broken; the statement is read-only, so it can be retried.
+             */
+            Ns_Log(Warning, "nsdbmysql: replica %s failed: %s",
+                   ctx->poolPtr->replicas[ctx->replica].datasource,
+                   mysql_error((MYSQL *) handle->connection));
+            ReplicaFailed(handle, ctx->replica);
+            RoutePrimary(handle);
+            rc = mysql_query((MYSQL *) handle->connection, sql);
+        }
+    } else if (rc != 0 && handle->connection == ctx->compressConn) {
+        unsigned int nErr = mysql_errno(ctx->compressConn);
+
+        if (nErr >= 2000u && nErr < 3000u) {
+            Ns_Log(Warning, "nsdbmysql: compressed connection failed: %s", mysql_error(ctx->compressConn));
+            mysql_close(ctx->compressConn);
+            ctx->compressConn = NULL;
+            ctx->wireMark[1] = 0u;
+            ctx->compressUsed[1] = NS_FALSE;
+            RoutePrimary(handle);
+            rc = mysql_query((MYSQL *) handle->connection, sql);
+        }
+    }
+    if (rc == 0) {
+        const Pool *poolPtr = ctx->poolPtr;
+
+        if (handle->connection == ctx->compressConn) {
+            ctx->compressing = ctx->compressUsed[1] = NS_TRUE;
+        } else if (handle->connection == ctx->primary && poolPtr->compression != NULL
+                   && !poolPtr->compressBulk) {
+            ctx->compressing = ctx->compressUsed[0] = NS_TRUE;
+        }
+    }
+    if (rc != 0 && ConnectionLost(handle)) {
+        if (!inTrans && ReadOnly(sql)) {
+            if (Reconnect(handle) == NS_OK) {
+                ctx->stats.retries++;
+                rc = mysql_query((MYSQL *) handle->connection, sql);
+            }
+        } else {
+            /*
+             * Not repeated: the statement may have been executed, or
+             * the transaction it belonged to is gone.
+             */
+            Log(handle, (MYSQL *) handle->connection);
+            (void) Reconnect(handle);
+        }
+    }
+    return rc;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RouteQuery, RoutePrimary, RouteWrite --
+ *
+ *      RouteQuery switches the handle to a usable replica (round-robin)
+ *      for a read-only statement, unless the handle is pinned to the
+ *      primary or a transaction is open on the primary. Any other
+ *      statement pins the handle to the primary until it is released,
+ *      when the pool has readyourwrites enabled. RoutePrimary switches
+ *      the handle back to the primary connection. RouteWrite does so
+ *      for a statement that may write, and pins the handle like
+ *      RouteQuery.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May open replica connections and check replica lag.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+RouteQuery(Ns_DbHandle *handle, const char *sql)
+{
+    Context        *ctx = (Context *) handle->context;
+    const Pool     *poolPtr = ctx->poolPtr;
+    int             n;
+
+    RoutePrimary(handle);
+    if (ctx->compressNext) {
+        /*
+         * Bulk transfer in a pool compressing only these: use the
+         * compressed connection, when the statement does not depend on
+         * the state of the primary connection.
+         */
+        ctx->compressNext = NS_FALSE;
+        if (poolPtr->compressBulk && poolPtr->compression != NULL && !ctx->pinPrimary
+            && ReadOnly(sql) && (ctx->primary->server_status & SERVER_STATUS_IN_TRANS) == 0u
+            && CompressUsable(handle)) {
+            handle->connection = ctx->compressConn;
+            return;
+        }
+    }
+    if (poolPtr->nreplicas == 0 || ctx->pinPrimary) {
+        return;
+    }
+    if (!ReadOnly(sql) || (poolPtr->multiStatements && strchr(sql, ';') != NULL)) {
+        if (poolPtr->readYourWrites) {
+            ctx->pinPrimary = NS_TRUE;
+        }
+        return;
+    }
+    if ((ctx->primary->server_status & SERVER_STATUS_IN_TRANS) != 0u) {
+        return;
+    }
+
+    for (n = 0; n < poolPtr->nreplicas; n++) {
+        int i = (ctx->nextReplica + n) % poolPtr->nreplicas;
+
+        if (ReplicaUsable(handle, i)) {
+            ctx->nextReplica = i + 1;
+            ctx->replica = i;
+            handle->connection = ctx->replicaConns[i];
+            return;
+        }
+    }
+}
+
+static void
+RoutePrimary(Ns_DbHandle *handle)
+{
+    Context *ctx = (Context *) handle->context;
+
+    if (ctx->replica >= 0 || handle->connection != ctx->primary) {
+        ctx->replica = -1;
+        handle->connection = ctx->primary;
+    }
+}
+
+static void
+RouteWrite(Ns_DbHandle *handle)
+{
+    Context *ctx = (Context *) handle->context;
+
+    RoutePrimary(handle);
+    if (ctx->poolPtr->readYourWrites) {
+        ctx->pinPrimary = NS_TRUE;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CompressUsable --
+ *
+ *      Open the compressed connection of a handle for bulk transfers,
+ *      when needed, and select the current database of the handle on
+ *      it.
+ *
+ * Results:
+ *      NS_TRUE when the connection can be used.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+CompressUsable(Ns_DbHandle *handle)
+{
+    Context        *ctx = (Context *) handle->context;
+    MYSQL          *mysql = ctx->compressConn;
+
+    if (mysql == NULL) {
+        mysql = Connect(handle, handle->datasource, NS_FALSE, NS_TRUE, 0u);
+        if (mysql != NULL && SessionInit(handle, mysql) != NS_OK) {
+            mysql_close(mysql);
+            mysql = NULL;
+        }
+        if (mysql == NULL) {
+            return NS_FALSE;
+        }
+        ctx->compressConn = mysql;
+        ns_free(ctx->compressDb);
+        ctx->compressDb = NULL;
+    }
+    if (ctx->compressDb == NULL || !STREQ(ctx->compressDb, ctx->database)) {
+        if (*ctx->database != '\0' && mysql_select_db(mysql, ctx->database) != 0) {
+            Log(handle, mysql);
+            return NS_FALSE;
+        }
+        ns_free(ctx->compressDb);
+        ctx->compressDb = ns_strdup(ctx->database);
+    }
+    return NS_TRUE;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WireSample, WireBytes --
+ *
+ *      Add the bytes the server has sent on a compressed connection
+ *      since the last call to the statistics, as reported by the
+ *      session status of the server. Compared with the value bytes
+ *      fetched on the connection, this shows the compression achieved.
+ *      WireSample does so for the connections of a handle used with
+ *      compression since the last sample.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Sends a query on the connection.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+WireSample(Context *ctx)
+{
+    if (ctx->compressUsed[0]) {
+        WireBytes(ctx, ctx->primary, 0);
+    }
+    if (ctx->compressUsed[1]) {
+        WireBytes(ctx, ctx->compressConn, 1);
+    }
+}
+
+static void
+WireBytes(Context *ctx, MYSQL *mysql, int i)
+{
+    MYSQL_RES      *result;
+    MYSQL_ROW       row;
+
+    ctx->compressUsed[i] = NS_FALSE;
+    if (mysql == NULL || mysql_query(mysql, "SHOW SESSION STATUS LIKE 'Bytes_sent'") != 0) {
+        return;
+    }
+    result = mysql_store_result(mysql);
+    if (result == NULL) {
+        return;
+    }
+    row = mysql_fetch_row(result);
+    if (row != NULL && row[1] != NULL) {
+        unsigned long sent = strtoul(row[1], NULL, 10);
+
+        if (sent >= ctx->wireMark[i]) {
+            ctx->stats.wireBytes += sent - ctx->wireMark[i];
+        }
+        ctx->wireMark[i] = sent;
+    }
+    mysql_free_result(result);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CheckConnection --
+ *
+ *      Ping the primary connection of a handle before a query, when the
+ *      handle was idle longer than pinginterval, or when another handle
+ *      of the pool has lost its connection since the last check. A
+ *      connection found gone or lost is reopened, so the query does not
+ *      fail on it; other ping errors are left to the query. No check is
+ *      made while rows of the last query are still being fetched, since
+ *      the connection is busy with them.
+ *
+ * Results:
+ *      NS_OK, or NS_ERROR when the connection could not be reopened.
+ *
+ * Side effects:
+ *      May reconnect the handle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CheckConnection(Ns_DbHandle *handle)
+{
+    Context        *ctx = (Context *) handle->context;
+    Pool           *poolPtr = ctx->poolPtr;
+    Ns_Time         now, idle, diff;
+    unsigned int    nErr;
+    bool            check;
+
+    if ((poolPtr->pingInterval.sec == 0 && poolPtr->pingInterval.usec == 0 && !poolPtr->reconnect)
+        || handle->fetchingRows) {
+        return NS_OK;
+    }
+    Ns_GetTime(&now);
+    check = (ctx->lostGeneration != poolPtr->lostGeneration);
+    if (!check && (poolPtr->pingInterval.sec != 0 || poolPtr->pingInterval.usec != 0)) {
+        idle = ctx->lastUsed;
+        Ns_IncrTime(&idle, poolPtr->pingInterval.sec, poolPtr->pingInterval.usec);
+        check = (Ns_DiffTime(&now, &idle, &diff) > 0);
+    }
+    ctx->lastUsed = now;
+    if (!check) {
+        return NS_OK;
+    }
+
+    ctx->lostGeneration = poolPtr->lostGeneration;
+    ctx->stats.pings++;
+    if (mysql_ping(ctx->primary) == 0) {
+        return NS_OK;
+    }
+    nErr = mysql_errno(ctx->primary);
+    if (nErr != CR_SERVER_GONE_ERROR && nErr != CR_SERVER_LOST) {
+        Ns_Log(Warning, "nsdbmysql: pool %s: ping failed: %s", poolPtr->name, mysql_error(ctx->primary));
+        return NS_OK;
+    }
+    Ns_Log(Notice, "nsdbmysql: pool %s: connection lost: %s", poolPtr->name, mysql_error(ctx->primary));
+    Ns_MutexLock(&poolPtr->lock);
+    ctx->lostGeneration = ++poolPtr->lostGeneration;
+    Ns_MutexUnlock(&poolPtr->lock);
+
+    return Reconnect(handle);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConnectionLost --
+ *
+ *      Check whether the last statement on the primary failed because
+ *      the connection to the server was lost, in a pool with reconnect
+ *      enabled. The other handles of the pool then check their
+ *      connection before their next query.
+ *
+ * Results:
+ *      NS_TRUE when the handle should reconnect.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ConnectionLost(Ns_DbHandle *handle)
+{
+    Context        *ctx = (Context *) handle->context;
+    Pool           *poolPtr = ctx->poolPtr;
+    unsigned int    nErr;
+
+    if (!poolPtr->reconnect || ctx->replica >= 0) {
+        return NS_FALSE;
+    }
+    nErr = mysql_errno(ctx->primary);
+    if (nErr != CR_SERVER_GONE_ERROR && nErr != CR_SERVER_LOST) {
+        return NS_FALSE;
+    }
+    Ns_MutexLock(&poolPtr->lock);
+    ctx->lostGeneration = ++poolPtr->lostGeneration;
+    Ns_MutexUnlock(&poolPtr->lock);
+
+    return NS_TRUE;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Reconnect --
+ *
+ *      Replace the primary connection of a handle by a new one and
+ *      restore the session: the sessioninit statements of the pool,
+ *      the current database and the session variables set on the
+ *      handle. Prepared statements of the old connection are dropped.
+ *
+ * Results:
+ *      NS_OK, or NS_ERROR when the connection could not be opened
+ *      (the old connection is then kept).
+ *
+ * Side effects:
+ *      Closes the old connection.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Reconnect(Ns_DbHandle *handle)
+{
+    Context        *ctx = (Context *) handle->context;
+    Pool           *poolPtr = ctx->poolPtr;
+    MYSQL          *dbh;
+    SessionVar     *varPtr;
+    Ns_Time         start;
+
+    RoutePrimary(handle);
+    FlushStmts(ctx);
+
+    Ns_GetTime(&start);
+    dbh = Connect(handle, handle->datasource, poolPtr->localInfile,
+                  poolPtr->compression != NULL && !poolPtr->compressBulk, 0u);
+    if (dbh != NULL && SessionInit(handle, dbh) != NS_OK) {
+        mysql_close(dbh);
+        dbh = NULL;
+    }
+    if (dbh == NULL) {
+        ctx->stats.connectErrors++;
+        return NS_ERROR;
+    }
+    HistogramAdd(SslResumed(dbh) ? &ctx->stats.connectResumed : &ctx->stats.connect, Elapsed(&start));
+    ctx->stats.reconnects++;
+
+    if (*ctx->database != '\0' && mysql_select_db(dbh, ctx->database) != 0) {
+        Log(handle, dbh);
+    }
+    for (varPtr = ctx->firstVarPtr; varPtr != NULL; varPtr = varPtr->nextPtr) {
+        if (mysql_query(dbh, varPtr->sql) != 0) {
+            Log(handle, dbh);
+        }
+    }
+    if (poolPtr->localInfile) {
+        mysql_set_local_infile_handler(dbh, InfileInit, InfileRead, InfileEnd, InfileError, ctx);
+    }
+
+    mysql_close(ctx->primary);
+    ctx->primary = dbh;
+    ctx->wireMark[0] = 0u;
+    handle->connection = dbh;
+    Ns_Log(Notice, "nsdbmysql: pool %s: reconnected to %s", poolPtr->name, handle->datasource);
+
+    return NS_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SessionInit --
+ *
+ *      Run the sessioninit statements of the pool on a new connection.
+ *
+ * Results:
+ *      NS_OK, or NS_ERROR when a statement failed.
+ *
+ * Side effects:
+ *      Results of the statements are discarded.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+SessionInit(Ns_DbHandle *handle, MYSQL *mysql)
+{
+    const Pool     *poolPtr = GetPool(handle->poolname);
+    TCL_SIZE_T      i;
+
+    for (i = 0; i < poolPtr->sessionInitc; i++) {
+        MYSQL_RES *result;
+
+        if (mysql_query(mysql, poolPtr->sessionInitv[i]) != 0) {
+            Ns_Log(Error, "nsdbmysql: pool %s: sessioninit '%s' failed: %s",
+                   poolPtr->name, poolPtr->sessionInitv[i], mysql_error(mysql));
+            Log(handle, mysql);
+            return NS_ERROR;
+        }
+        result = mysql_store_result(mysql);
+        if (result != NULL) {
+            mysql_free_result(result);
+        }
+    }
+    return NS_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SessionTrack, SessionVarSet --
+ *
+ *      Remember a SET statement changing session state (session
+ *      variables, user variables, NAMES, CHARACTER SET), to repeat it
+ *      after a reconnect. Each assignment of the statement is kept as
+ *      a SET of its own, unless GLOBAL, PERSIST or PERSIST_ONLY applies
+ *      to it; as in MySQL, such a modifier holds for the following
+ *      assignments until the next one. A later statement setting the
+ *      same variable replaces the earlier one.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Updates the session variable list of the handle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SessionTrack(Context *ctx, const char *sql)
+{
+    const char     *p, *q, *start;
+    char            word[32], key[MAX_IDENTIFIER];
+    bool            global = NS_FALSE, skip, first = NS_TRUE;
+    int             depth;
+    size_t          n;
+
+    if (!ctx->poolPtr->reconnect) {
+        return;
+    }
+    p = SqlWord(sql, word, sizeof(word));
+    if (!STREQ(word, "set")) {
+        return;
+    }
+    for (;;) {
+        p = SqlSpace(p);
+        q = SqlWord(p, word, sizeof(word));
+        if (first
+            && (STREQ(word, "password") || STREQ(word, "transaction") || STREQ(word, "role")
+                || STREQ(word, "default") || STREQ(word, "resource"))) {
+            return;
+        }
+        if (STREQ(word, "global") || STREQ(word, "persist") || STREQ(word, "persist_only")) {
+            global = NS_TRUE;
+            p = SqlSpace(q);
+        } else if (STREQ(word, "session") || STREQ(word, "local")) {
+            global = NS_FALSE;
+            p = SqlSpace(q);
+        }
+        start = p;
+        skip = global;
+        if (p[0] == '@' && p[1] == '@') {
+            p += 2;
+            q = SqlWord(p, word, sizeof(word));
+            if (*q == '.') {
+                skip = (!STREQ(word, "session") && !STREQ(word, "local"));
+                p = q + 1;
+            } else {
+                skip = NS_FALSE;
+            }
+        }
+
+        n = 0u;
+        if (*p == '@') {
+            key[n++] = *p++;
+        }
+        while ((isalnum((unsigned char) *p) || *p == '_' || *p == '$' || *p == '.') && n + 1u < sizeof(key)) {
+            key[n++] = (char) tolower((unsigned char) *p++);
+        }
+        key[n] = '\0';
+        if (n == 0u || (n == 1u && key[0] == '@')) {
+            return;
+        }
+
+        /*
+         * The assignment ends at a comma outside of parentheses, string
+         * literals and comments.
+         */
+        for (q = p, depth = 0;;) {
+            q = SqlSpace(q);
+            if (*q == '\0' || (*q == ',' && depth == 0)) {
+                break;
+            }
+            if (*q == '(') {
+                depth++;
+            } else if (*q == ')' && depth > 0) {
+                depth--;
+            }
+            q = SqlSkip(q);
+        }
+        if (!skip) {
+            SessionVarSet(ctx, key, start, (size_t) (q - start));
+        }
+        if (*q != ',') {
+            break;
+        }
+        p = q + 1;
+        first = NS_FALSE;
+    }
+}
+
+static void
+SessionVarSet(Context *ctx, const char *key, const char *assignment, size_t length)
+{
+    SessionVar    **varPtrPtr, *varPtr;
+    Tcl_DString     ds;
+
+    for (varPtrPtr = &ctx->firstVarPtr; *varPtrPtr != NULL; varPtrPtr = &(*varPtrPtr)->nextPtr) {
+        if (STREQ((*varPtrPtr)->key, key)) {
+            varPtr = *varPtrPtr;
+            *varPtrPtr = varPtr->nextPtr;
+            ns_free(varPtr->key);
+            ns_free(varPtr->sql);
+            ns_free(varPtr);
+            break;
+        }
+    }
+    while (*varPtrPtr != NULL) {
+        varPtrPtr = &(*varPtrPtr)->nextPtr;
+    }
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, "SET ", 4);
+    Tcl_DStringAppend(&ds, assignment, (TCL_SIZE_T) length);
+    varPtr = ns_malloc(sizeof(SessionVar));
+    varPtr->nextPtr = NULL;
+    varPtr->key = ns_strdup(key);
+    varPtr->sql = ns_strdup(Tcl_DStringValue(&ds));
+    *varPtrPtr = varPtr;
+    Tcl_DStringFree(&ds);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReadOnly --
+ *
+ *      Check whether a statement can run on a replica: SELECT, SHOW,
+ *      DESCRIBE, EXPLAIN and WITH statements without locking reads,
+ *      INTO, user variables or functions depending on the session.
+ *
+ * Results:
+ *      NS_TRUE when the statement is read-only.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ReadOnly(const char *sql)
+{
+    static const char *const sessionFns[] = {
+        "into", "get_lock", "release_lock", "release_all_locks", "is_used_lock",
+        "last_insert_id", "found_rows", "row_count", "nextval", "lastval", "setval",
+        "master_pos_wait", "source_pos_wait", "connection_id", NULL
+    };
+    const char     *p;
+    char            word[32], prev[32] = "";
+    bool            with;
+    int             i;
+
+    for (p = SqlSpace(sql); *p == '('; p = SqlSpace(p + 1)) {
+        ;
+    }
+    p = SqlWord(p, word, sizeof(word));
+    if (!STREQ(word, "select") && !STREQ(word, "show") && !STREQ(word, "describe")
+        && !STREQ(word, "desc") && !STREQ(word, "explain") && !STREQ(word, "with")) {
+        return NS_FALSE;
+    }
+    with = STREQ(word, "with");
+    while (*p != '\0') {
+        p = SqlWord(p, word, sizeof(word));
+        if (*word == '\0') {
+            p = SqlSpace(p);
+            if (*p == '@' && p[1] != '@') {
+                return NS_FALSE;
+            }
+            p = (*p == '@') ? p + 2 : SqlSkip(p);
+            continue;
+        }
+        if ((STREQ(prev, "for") && (STREQ(word, "update") || STREQ(word, "share")))
+            || (with && (STREQ(word, "update") || STREQ(word, "delete")))
+            || (STREQ(prev, "lock") && STREQ(word, "in"))
+            || (STREQ(prev, "explain") && STREQ(word, "analyze"))) {
+            return NS_FALSE;
+        }
+        for (i = 0; sessionFns[i] != NULL; i++) {
+            if (STREQ(word, sessionFns[i])) {
+                return NS_FALSE;
+            }
+        }
+        strcpy(prev, word);
+    }
+    return NS_TRUE;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReplicaUsable, ReplicaFailed --
+ *
+ *      ReplicaUsable checks whether replica i can serve a read: it must
+ *      not be marked as failed and its lag must be known and within
+ *      replicamaxlag. The lag is checked by one handle per
+ *      replicacheckinterval and shared via the pool. The replica
+ *      connection of the handle is opened on first use and switched to
+ *      the current database of the handle. ReplicaFailed closes the
+ *      replica connection and takes the replica out of use for
+ *      replicacheckinterval.
+ *
+ * Results:
+ *      ReplicaUsable: NS_TRUE when the replica can be used.
+ *
+ * Side effects:
+ *      May open or close connections, updates the replica state.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ReplicaUsable(Ns_DbHandle *handle, int i)
+{
+    Context        *ctx = (Context *) handle->context;
+    Pool           *poolPtr = ctx->poolPtr;
+    Replica        *replicaPtr = &poolPtr->replicas[i];
+    MYSQL          *mysql;
+    Ns_Time         now, diff, next;
+    bool            check = NS_FALSE;
+    long            lag;
+
+    Ns_GetTime(&now);
+    Ns_MutexLock(&poolPtr->lock);
+    if (Ns_DiffTime(&replicaPtr->failedUntil, &now, &diff) > 0) {
+        Ns_MutexUnlock(&poolPtr->lock);
+        return NS_FALSE;
+    }
+    next = replicaPtr->checked;
+    Ns_IncrTime(&next, poolPtr->replicaInterval.sec, poolPtr->replicaInterval.usec);
+    if (Ns_DiffTime(&next, &now, &diff) <= 0) {
+        replicaPtr->checked = now;
+        check = NS_TRUE;
+    }
+    lag = replicaPtr->lag;
+    Ns_MutexUnlock(&poolPtr->lock);
+
+    if (!check && (lag < 0 || lag > poolPtr->replicaMaxLag)) {
+        return NS_FALSE;
+    }
+
+    mysql = ctx->replicaConns[i];
+    if (mysql == NULL) {
+        mysql = Connect(handle, replicaPtr->datasource, NS_FALSE,
+                        poolPtr->compression != NULL && !poolPtr->compressBulk, 0u);
+        if (mysql != NULL && SessionInit(handle, mysql) != NS_OK) {
+            mysql_close(mysql);
+            mysql = NULL;
+        }
+        if (mysql == NULL) {
+            ReplicaFailed(handle, i);
+            return NS_FALSE;
+        }
+        ctx->replicaConns[i] = mysql;
+    }
+
+    if (check) {
+        lag = ReplicaLag(mysql, poolPtr->replicaLagQuery);
+        if (lag < 0 && mysql_errno(mysql) >= 2000u && mysql_errno(mysql) < 3000u) {
+            ReplicaFailed(handle, i);
+            return NS_FALSE;
+        }
+        Ns_MutexLock(&poolPtr->lock);
+        replicaPtr->lag = lag;
+        Ns_MutexUnlock(&poolPtr->lock);
+        if (lag < 0 || lag > poolPtr->replicaMaxLag) {
+            Ns_Log(Notice, "nsdbmysql: replica %s not used, lag %ld", replicaPtr->datasource, lag);
+            return NS_FALSE;
+        }
+    }
+
+    if (ctx->replicaDbs[i] == NULL || !STREQ(ctx->replicaDbs[i], ctx->database)) {
+        if (*ctx->database != '\0' && mysql_select_db(mysql, ctx->database) != 0) {
+            Log(handle, mysql);
+            return NS_FALSE;
+        }
+        ns_free(ctx->replicaDbs[i]);
+        ctx->replicaDbs[i] = ns_strdup(ctx->database);
+    }
+    return NS_TRUE;
+}
+
+static void
+ReplicaFailed(Ns_DbHandle *handle, int i)
+{
+    Context        *ctx = (Context *) handle->context;
+    Pool           *poolPtr = ctx->poolPtr;
+    Replica        *replicaPtr = &poolPtr->replicas[i];
+
+    if (ctx->replicaConns[i] != NULL) {
+        mysql_close(ctx->replicaConns[i]);
+        ctx->replicaConns[i] = NULL;
+        ns_free(ctx->replicaDbs[i]);
+        ctx->replicaDbs[i] = NULL;
+    }
+    Ns_MutexLock(&poolPtr->lock);
+    Ns_GetTime(&replicaPtr->failedUntil);
+    Ns_IncrTime(&replicaPtr->failedUntil, poolPtr->replicaInterval.sec, poolPtr->replicaInterval.usec);
+    replicaPtr->lag = -1;
+    Ns_MutexUnlock(&poolPtr->lock);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReplicaLag --
+ *
+ *      Run the lag query on a replica connection. The lag is taken from
+ *      the column Seconds_Behind_Source or Seconds_Behind_Master (as
+ *      returned by SHOW REPLICA/SLAVE STATUS), or else from the first
+ *      column, e.g. of a query on a heartbeat table.
+ *
+ * Results:
+ *      Lag in seconds, or -1 when the query failed, returned no row or
+ *      NULL (replication not running).
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-static int 
-DbList_Tables(Tcl_Interp *interp, const char *wild, Ns_DbHandle *handle)
+static long
+ReplicaLag(MYSQL *mysql, const char *query)
 {
     MYSQL_RES      *result;
     MYSQL_ROW       row;
-    unsigned int    numcols;
-    unsigned int    i;
+    long            lag = -1;
 
-    if (handle == NULL || handle->connection == NULL) {
-        Ns_Log(Error, "nsdbmysql: Invalid connection.");
-        return NS_ERROR;
+    if (mysql_query(mysql, query) != 0) {
+        Log(NULL, mysql);
+        return -1;
     }
-
-    InitThread();
-
-    result = mysql_list_tables((MYSQL *) handle->connection, wild);
-    Log(handle, (MYSQL *) handle->connection);
-
+    result = mysql_store_result(mysql);
     if (result == NULL) {
-        Tcl_AppendResult(interp, "mysql_list_tables failed.", NULL);
-        return TCL_ERROR;
+        return -1;
     }
-
-    numcols = mysql_num_fields(result);
-    Log(handle, (MYSQL *) handle->connection);
-
-    while ((row = mysql_fetch_row(result)) != NULL) {
-        for (i = 0; i < numcols; i++) {
-            Tcl_AppendElement(interp, row[i]);
+    row = mysql_fetch_row(result);
+    if (row != NULL) {
+        const MYSQL_FIELD *fields = mysql_fetch_fields(result);
+        unsigned int       i, ncols = mysql_num_fields(result), col = 0u;
+
+        for (i = 0u; i < ncols; i++) {
+            if (strcasecmp(fields[i].name, "Seconds_Behind_Source") == 0
+                || strcasecmp(fields[i].name, "Seconds_Behind_Master") == 0) {
+                col = i;
+                break;
+            }
+        }
+        if (row[col] != NULL) {
+            lag = strtol(row[col], NULL, 10);
         }
     }
-
     mysql_free_result(result);
+    while (mysql_more_results(mysql) && mysql_next_result(mysql) == 0) {
+        result = mysql_store_result(mysql);
+        if (result != NULL) {
+            mysql_free_result(result);
+        }
+    }
 
-    return TCL_OK;
+    return lag;
 }
 
 /*
@@ -581,15 +8712,24 @@ DbCmd(ClientData UNUSED(arg), Tcl_Interp *interp, int objc, Tcl_Obj * const objv
     static const char *opts[] = {
         "include_tablenames", "list_dbs", "list_tables",
         "resultrows", "select_db", "insert_id", "version",
-        NULL
+        "resultmode", "prepare", "execute", "stmtcache", "rows",
+        "layoutcache", "bulk_insert", "batch", "submit", "wait",
+        "fanout", "stats", "digest", "cache", "resultcache", "primary",
+        "fetch", "binaryencoding", "export", "select_json",
+        "select_all", "load_data", "memory", "compress", NULL
     };
     enum {
         IIncludeTableNamesIdx, IListDbsIdx, IListTablesIdx,
-        IResultRowsIdx, ISelectDbIdx, IInsertIdIdx, IVersionIdx
+        IResultRowsIdx, ISelectDbIdx, IInsertIdIdx, IVersionIdx,
+        IResultModeIdx, IPrepareIdx, IExecuteIdx, IStmtCacheIdx, IRowsIdx,
+        ILayoutCacheIdx, IBulkInsertIdx, IBatchIdx, ISubmitIdx, IWaitIdx,
+        IFanoutIdx, IStatsIdx, IDigestIdx, ICacheIdx, IResultCacheIdx, IPrimaryIdx,
+        IFetchIdx, IBinaryEncodingIdx, IExportIdx, ISelectJsonIdx,
+        ISelectAllIdx, ILoadDataIdx, IMemoryIdx, ICompressIdx
     } opt;
 
-    if (objc < 3) {
-        Tcl_WrongNumArgs(interp, 1, objv, "option handle ?args?");
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "option ?args?");
         return TCL_ERROR;
     }
 
@@ -597,13 +8737,94 @@ DbCmd(ClientData UNUSED(arg), Tcl_Interp *interp, int objc, Tcl_Obj * const objv
         return TCL_ERROR;
     }
 
-    if (Ns_TclDbGetHandle(interp, Tcl_GetString(objv[2]), &handle) != TCL_OK) {
+    /*
+     * Subcommands not operating on a single handle.
+     */
+    switch (opt) {
+    case IFanoutIdx:
+        if (objc != 3 && !(objc == 5 && STREQ(Tcl_GetString(objv[3]), "-timeout"))) {
+            Tcl_WrongNumArgs(interp, 2, objv, "{handle sql ...} ?-timeout time?");
+            return TCL_ERROR;
+        }
+        return Fanout(interp, objv[2], objc == 5 ? objv[4] : NULL);
+
+    case IStatsIdx: {
+        bool reset = NS_FALSE, prometheus = NS_FALSE;
+        int  i;
+
+        for (i = 2; i < objc; i++) {
+            const char *option = Tcl_GetString(objv[i]);
+
+            if (STREQ(option, "-reset")) {
+                reset = NS_TRUE;
+            } else if (STREQ(option, "-format") && i + 1 < objc) {
+                const char *format = Tcl_GetString(objv[++i]);
+
+                if (STREQ(format, "prometheus")) {
+                    prometheus = NS_TRUE;
+                } else if (!STREQ(format, "dict")) {
+                    Tcl_AppendResult(interp, "invalid format \"", format,
+                                     "\": must be dict or prometheus", NULL);
+                    return TCL_ERROR;
+                }
+            } else {
+                Tcl_WrongNumArgs(interp, 2, objv, "?-reset? ?-format dict|prometheus?");
+                return TCL_ERROR;
+            }
+        }
+        return StatsCmd(interp, reset, prometheus);
+    }
+
+    case IDigestIdx: {
+        const char *by = "time";
+        int         n = 10, i;
+
+        if (objc == 3 && STREQ(Tcl_GetString(objv[2]), "reset")) {
+            DigestReset();
+            return TCL_OK;
+        }
+        if (objc < 3 || !STREQ(Tcl_GetString(objv[2]), "top")) {
+            Tcl_WrongNumArgs(interp, 2, objv, "top ?n? ?-by time|calls|rows?");
+            return TCL_ERROR;
+        }
+        i = 3;
+        if (i < objc && !STREQ(Tcl_GetString(objv[i]), "-by")) {
+            if (Tcl_GetIntFromObj(interp, objv[i], &n) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (n < 0) {
+                Tcl_AppendResult(interp, "invalid count \"", Tcl_GetString(objv[i]),
+                                 "\": must not be negative", NULL);
+                return TCL_ERROR;
+            }
+            i++;
+        }
+        if (i + 2 == objc && STREQ(Tcl_GetString(objv[i]), "-by")) {
+            by = Tcl_GetString(objv[i + 1]);
+        } else if (i != objc) {
+            Tcl_WrongNumArgs(interp, 2, objv, "top ?n? ?-by time|calls|rows?");
+            return TCL_ERROR;
+        }
+        return DigestTop(interp, n, by);
+    }
+
+    case IMemoryIdx:
+        if (objc > 3 || (objc == 3 && !STREQ(Tcl_GetString(objv[2]), "-reset"))) {
+            Tcl_WrongNumArgs(interp, 2, objv, "?-reset?");
+            return TCL_ERROR;
+        }
+        return MemoryCmd(interp, objc == 3);
+
+    default:
+        break;
+    }
+
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, "option handle ?args?");
         return TCL_ERROR;
     }
 
-    if (!STREQ(Ns_DbDriverName(handle), DbType(0))) {
-        Tcl_AppendResult(interp, "handle \"", Tcl_GetString(objv[2]),
-                "\" is not of type \"", DbType(0), "\"", NULL);
+    if (GetHandle(interp, objv[2], &handle) != TCL_OK) {
         return TCL_ERROR;
     }
 
@@ -656,16 +8877,527 @@ DbCmd(ClientData UNUSED(arg), Tcl_Interp *interp, int objc, Tcl_Obj * const objv
             Tcl_WrongNumArgs(interp, 2, objv, "handle database");
             return TCL_ERROR;
         }
-        rc = mysql_select_db((MYSQL *) handle->connection, Tcl_GetString(objv[3]));
-        if (rc) {
-            Tcl_AppendResult(interp, "mysql_select_db failed.", NULL);
+        if (HandleBusy(interp, handle)) {
             return TCL_ERROR;
+        } else {
+            Context *ctx = (Context *) handle->context;
+
+            /*
+             * Replica and compressed connections follow ctx->database
+             * on their next use.
+             */
+            RoutePrimary(handle);
+            rc = mysql_select_db(ctx->primary, Tcl_GetString(objv[3]));
+            if (rc) {
+                Tcl_AppendResult(interp, "mysql_select_db failed.", NULL);
+                return TCL_ERROR;
+            }
+            ns_free(ctx->database);
+            ctx->database = ns_strdup(Tcl_GetString(objv[3]));
         }
         break;
 
     case IVersionIdx:
         Tcl_AppendResult(interp, "mysql", mysql_get_server_info((MYSQL *) handle->connection), NULL);
         return TCL_OK;
+
+    case IResultModeIdx: {
+        Context *ctx = (Context *) handle->context;
+        int      mode;
+
+        if (objc > 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?store|use|cursor?");
+            return TCL_ERROR;
+        }
+        if (objc == 4) {
+            if (Tcl_GetIndexFromObj(interp, objv[3], resultModes, "result mode", 0, &mode) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            ctx->resultMode = (ResultMode) mode;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(resultModes[ctx->resultMode], TCL_INDEX_NONE));
+        break;
+    }
+
+    case IPrepareIdx: {
+        Stmt *stmtPtr;
+
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle sql");
+            return TCL_ERROR;
+        }
+        if (HandleBusy(interp, handle)) {
+            return TCL_ERROR;
+        }
+        RoutePrimary(handle);
+        stmtPtr = PrepareStmt(interp, handle, Tcl_GetString(objv[3]));
+        if (stmtPtr == NULL) {
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt) mysql_stmt_param_count(stmtPtr->stmt)));
+        ReleaseStmt((Context *) handle->context, stmtPtr);
+        break;
+    }
+
+    case IExecuteIdx:
+    case IRowsIdx: {
+        Stmt       *stmtPtr;
+        Tcl_Obj    *valuesObj = NULL;
+        const char *null = NULL;
+        int         i = 4;
+
+        if (i < objc && !(i + 2 == objc && STREQ(Tcl_GetString(objv[i]), "-null"))) {
+            valuesObj = objv[i++];
+        }
+        if (i + 2 == objc && STREQ(Tcl_GetString(objv[i]), "-null")) {
+            null = Tcl_GetString(objv[i + 1]);
+        } else if (objc < 4 || i != objc) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle sql ?values? ?-null marker?");
+            return TCL_ERROR;
+        }
+        if (HandleBusy(interp, handle)) {
+            return TCL_ERROR;
+        }
+        RouteWrite(handle);
+        stmtPtr = PrepareStmt(interp, handle, Tcl_GetString(objv[3]));
+        if (stmtPtr == NULL) {
+            return TCL_ERROR;
+        }
+        rc = ExecuteStmt(interp, handle, stmtPtr, Tcl_GetString(objv[3]), valuesObj, null,
+                         opt == IRowsIdx);
+        ReleaseStmt((Context *) handle->context, stmtPtr);
+        CacheWrite(handle, Tcl_GetString(objv[3]));
+        return rc;
+    }
+
+    case IBulkInsertIdx: {
+        bool        ignore = NS_FALSE;
+        const char *onDup = NULL, *null = NULL;
+        int         i;
+
+        if (objc < 6) {
+            Tcl_WrongNumArgs(interp, 2, objv,
+                             "handle table columns rows ?-ignore? ?-ondup clause? ?-null marker?");
+            return TCL_ERROR;
+        }
+        for (i = 6; i < objc; i++) {
+            const char *option = Tcl_GetString(objv[i]);
+
+            if (STREQ(option, "-ignore")) {
+                ignore = NS_TRUE;
+            } else if (STREQ(option, "-ondup") && i + 1 < objc) {
+                onDup = Tcl_GetString(objv[++i]);
+            } else if (STREQ(option, "-null") && i + 1 < objc) {
+                null = Tcl_GetString(objv[++i]);
+            } else {
+                Tcl_WrongNumArgs(interp, 2, objv,
+                                 "handle table columns rows ?-ignore? ?-ondup clause? ?-null marker?");
+                return TCL_ERROR;
+            }
+        }
+        if (HandleBusy(interp, handle)) {
+            return TCL_ERROR;
+        }
+        return BulkInsert(interp, handle, objv[3], objv[4], objv[5], ignore, onDup, null);
+    }
+
+    case IBatchIdx:
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle sqlList");
+            return TCL_ERROR;
+        }
+        if (HandleBusy(interp, handle)) {
+            return TCL_ERROR;
+        }
+        return Batch(interp, handle, objv[3]);
+
+    case ISubmitIdx:
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle sql");
+            return TCL_ERROR;
+        }
+        return AsyncSubmit(interp, handle, Tcl_GetString(objv[3]));
+
+    case IWaitIdx: {
+        Ns_Time  timeout, *timeoutPtr = NULL;
+
+        if (objc == 5 && STREQ(Tcl_GetString(objv[3]), "-timeout")) {
+            if (Ns_TclGetTimeFromObj(interp, objv[4], &timeout) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            timeoutPtr = &timeout;
+        } else if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?-timeout time?");
+            return TCL_ERROR;
+        }
+        if (((Context *) handle->context)->asyncState == ASYNC_IDLE) {
+            Tcl_AppendResult(interp, "no query submitted", NULL);
+            return TCL_ERROR;
+        }
+        switch (AsyncWait(handle, timeoutPtr)) {
+        case NS_DML:
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("NS_DML", 6));
+            break;
+        case NS_ROWS:
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("NS_ROWS", 7));
+            break;
+        case NS_TIMEOUT:
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("NS_TIMEOUT", 10));
+            break;
+        default:
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_DStringValue(&handle->dsExceptionMsg),
+                                                      Tcl_DStringLength(&handle->dsExceptionMsg)));
+            return TCL_ERROR;
+        }
+        break;
+    }
+
+    case IFanoutIdx:
+    case IStatsIdx:
+    case IDigestIdx:
+    case IMemoryIdx:
+        /* Handled above. */
+        break;
+
+    case ICacheIdx: {
+        Context *ctx = (Context *) handle->context;
+
+        if (objc != 3 && objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?ttl?");
+            return TCL_ERROR;
+        }
+        ctx->cacheTtl = ctx->poolPtr->cacheTtl;
+        if (objc == 4 && Ns_TclGetTimeFromObj(interp, objv[3], &ctx->cacheTtl) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        ctx->cacheNext = NS_TRUE;
+        Tcl_SetObjResult(interp, Tcl_NewBooleanObj(ctx->poolPtr->cacheMax > 0u));
+        break;
+    }
+
+    case ICompressIdx: {
+        Context *ctx = (Context *) handle->context;
+
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle");
+            return TCL_ERROR;
+        }
+        ctx->compressNext = NS_TRUE;
+        Tcl_SetObjResult(interp, Tcl_NewBooleanObj(ctx->poolPtr->compression != NULL));
+        break;
+    }
+
+    case IPrimaryIdx: {
+        Context *ctx = (Context *) handle->context;
+        int      pin;
+
+        if (objc == 4) {
+            if (Tcl_GetBooleanFromObj(interp, objv[3], &pin) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            ctx->pinPrimary = (pin != 0);
+        } else if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?pin?");
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewBooleanObj(ctx->pinPrimary));
+        break;
+    }
+
+    case IFetchIdx: {
+        const MYSQL_FIELD *fields;
+        char             **values;
+        unsigned long     *lengths;
+        unsigned int       ncols;
+
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle varName");
+            return TCL_ERROR;
+        }
+        if (handle->fetchingRows == NS_FALSE) {
+            Tcl_AppendResult(interp, "no rows waiting to fetch", NULL);
+            return TCL_ERROR;
+        }
+        switch (FetchRow(handle, &fields, &ncols, &values, &lengths)) {
+        case NS_OK:
+            if (Tcl_ObjSetVar2(interp, objv[3], NULL, RowObj(fields, ncols, values, lengths),
+                               TCL_LEAVE_ERR_MSG) == NULL) {
+                return TCL_ERROR;
+            }
+            Tcl_SetObjResult(interp, Tcl_NewBooleanObj(1));
+            break;
+        case NS_END_DATA:
+            Tcl_SetObjResult(interp, Tcl_NewBooleanObj(0));
+            break;
+        default:
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_DStringValue(&handle->dsExceptionMsg),
+                                                      Tcl_DStringLength(&handle->dsExceptionMsg)));
+            return TCL_ERROR;
+        }
+        break;
+    }
+
+    case IExportIdx: {
+        Tcl_Channel chan = NULL;
+        Ns_Conn    *conn = NULL;
+        int         format = EXPORT_CSV, i, mode;
+
+        if (objc < 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle sql ?-format csv|tsv|json|ndjson? ?-channel chan|-conn?");
+            return TCL_ERROR;
+        }
+        for (i = 4; i < objc; i++) {
+            const char *option = Tcl_GetString(objv[i]);
+
+            if (STREQ(option, "-format") && i + 1 < objc) {
+                if (Tcl_GetIndexFromObj(interp, objv[++i], exportFormats, "format", 0, &format) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+            } else if (STREQ(option, "-channel") && i + 1 < objc) {
+                chan = Tcl_GetChannel(interp, Tcl_GetString(objv[++i]), &mode);
+                if (chan == NULL) {
+                    return TCL_ERROR;
+                }
+                if ((mode & TCL_WRITABLE) == 0) {
+                    Tcl_AppendResult(interp, "channel \"", Tcl_GetString(objv[i]),
+                                     "\" wasn't opened for writing", NULL);
+                    return TCL_ERROR;
+                }
+            } else if (STREQ(option, "-conn")) {
+                conn = Ns_GetConn();
+                if (conn == NULL) {
+                    Tcl_AppendResult(interp, "no current connection", NULL);
+                    return TCL_ERROR;
+                }
+            } else {
+                Tcl_WrongNumArgs(interp, 2, objv, "handle sql ?-format csv|tsv|json|ndjson? ?-channel chan|-conn?");
+                return TCL_ERROR;
+            }
+        }
+        if ((chan == NULL) == (conn == NULL)) {
+            Tcl_AppendResult(interp, "either -channel or -conn must be given", NULL);
+            return TCL_ERROR;
+        }
+        return Export(interp, handle, Tcl_GetString(objv[3]), (ExportFormat) format, chan, conn);
+    }
+
+    case ISelectJsonIdx: {
+        JsonShape shape = JSON_OBJECT;
+
+        if (objc == 5 && STREQ(Tcl_GetString(objv[4]), "-array")) {
+            shape = JSON_ARRAY;
+        } else if (objc == 5 && STREQ(Tcl_GetString(objv[4]), "-columnar")) {
+            shape = JSON_COLUMNAR;
+        } else if (objc != 4 && !(objc == 5 && STREQ(Tcl_GetString(objv[4]), "-object"))) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle sql ?-array|-object|-columnar?");
+            return TCL_ERROR;
+        }
+        return SelectJson(interp, handle, Tcl_GetString(objv[3]), shape);
+    }
+
+    case ISelectAllIdx: {
+        static const char *shapes[] = { "-rows", "-dicts", "-flat", "-columns", NULL };
+        int                shape = ALL_ROWS;
+
+        if (objc != 4 && objc != 5) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle sql ?-rows|-dicts|-flat|-columns?");
+            return TCL_ERROR;
+        }
+        if (objc == 5 && Tcl_GetIndexFromObj(interp, objv[4], shapes, "option", 0, &shape) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        return SelectAll(interp, handle, Tcl_GetString(objv[3]), (AllShape) shape);
+    }
+
+    case ILoadDataIdx: {
+        static const char *const usage =
+            "handle table -channel chan|-data bytes ?-format tsv|csv? ?-columns list?"
+            " ?-ignorelines n? ?-replace|-ignore? ?-charset charset? ?-lineend string?";
+        LoadOptions options;
+        Infile      infile;
+        Tcl_Obj    *dataObj = NULL;
+        Tcl_DString data;
+        int         i, mode, result;
+
+        memset(&options, 0, sizeof(options));
+        memset(&infile, 0, sizeof(infile));
+        if (objc < 5) {
+            Tcl_WrongNumArgs(interp, 2, objv, usage);
+            return TCL_ERROR;
+        }
+        for (i = 4; i < objc; i++) {
+            const char *option = Tcl_GetString(objv[i]);
+
+            if (STREQ(option, "-channel") && i + 1 < objc) {
+                infile.chan = Tcl_GetChannel(interp, Tcl_GetString(objv[++i]), &mode);
+                if (infile.chan == NULL) {
+                    return TCL_ERROR;
+                }
+                if ((mode & TCL_READABLE) == 0) {
+                    Tcl_AppendResult(interp, "channel \"", Tcl_GetString(objv[i]),
+                                     "\" wasn't opened for reading", NULL);
+                    return TCL_ERROR;
+                }
+            } else if (STREQ(option, "-data") && i + 1 < objc) {
+                dataObj = objv[++i];
+            } else if (STREQ(option, "-format") && i + 1 < objc) {
+                const char *format = Tcl_GetString(objv[++i]);
+
+                if (STREQ(format, "csv")) {
+                    options.csv = NS_TRUE;
+                } else if (!STREQ(format, "tsv")) {
+                    Tcl_AppendResult(interp, "invalid format \"", format, "\": must be tsv or csv", NULL);
+                    return TCL_ERROR;
+                }
+            } else if (STREQ(option, "-columns") && i + 1 < objc) {
+                options.columnsObj = objv[++i];
+            } else if (STREQ(option, "-ignorelines") && i + 1 < objc) {
+                if (Tcl_GetIntFromObj(interp, objv[++i], &options.ignoreLines) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+            } else if (STREQ(option, "-replace")) {
+                options.replace = NS_TRUE;
+            } else if (STREQ(option, "-ignore")) {
+                options.ignore = NS_TRUE;
+            } else if (STREQ(option, "-charset") && i + 1 < objc) {
+                options.charset = Tcl_GetString(objv[++i]);
+            } else if (STREQ(option, "-lineend") && i + 1 < objc) {
+                options.lineEnd = Tcl_GetString(objv[++i]);
+            } else {
+                Tcl_WrongNumArgs(interp, 2, objv, usage);
+                return TCL_ERROR;
+            }
+        }
+        if ((infile.chan == NULL) == (dataObj == NULL)) {
+            Tcl_AppendResult(interp, "either -channel or -data must be given", NULL);
+            return TCL_ERROR;
+        }
+        if (options.lineEnd == NULL) {
+            options.lineEnd = options.csv ? "\r\n" : "\n";
+        }
+        Tcl_DStringInit(&data);
+        if (dataObj != NULL && LoadBytes(interp, dataObj, options.charset, &data, &infile) != TCL_OK) {
+            result = TCL_ERROR;
+        } else {
+            result = LoadData(interp, handle, Tcl_GetString(objv[3]), &infile, &options);
+        }
+        Tcl_DStringFree(&data);
+        return result;
+    }
+
+    case IBinaryEncodingIdx: {
+        Context *ctx = (Context *) handle->context;
+        int      encoding;
+
+        if (objc > 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?none|hex|base64?");
+            return TCL_ERROR;
+        }
+        if (objc == 4) {
+            if (Tcl_GetIndexFromObj(interp, objv[3], binaryEncodings, "encoding", 0, &encoding) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            ctx->binaryEncoding = (BinaryEncoding) encoding;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(binaryEncodings[ctx->binaryEncoding], TCL_INDEX_NONE));
+        break;
+    }
+
+    case IResultCacheIdx: {
+        Pool    *poolPtr = ((Context *) handle->context)->poolPtr;
+        Tcl_Obj *dictObj;
+
+        if (objc == 4 && STREQ(Tcl_GetString(objv[3]), "-flush")) {
+            Ns_MutexLock(&poolPtr->cacheLock);
+            CacheFlush(poolPtr);
+            Ns_MutexUnlock(&poolPtr->cacheLock);
+            break;
+        }
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?-flush?");
+            return TCL_ERROR;
+        }
+        dictObj = Tcl_NewDictObj();
+        Ns_MutexLock(&poolPtr->cacheLock);
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("entries", 7),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->cache.numEntries));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("size", 4),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->cacheSize));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("capacity", 8),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->cacheMax));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("hits", 4),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->cacheHits));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("misses", 6),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->cacheMisses));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("stores", 6),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->cacheStores));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("evictions", 9),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->cacheEvictions));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("expired", 7),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->cacheExpired));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("invalidated", 11),
+                       Tcl_NewWideIntObj((Tcl_WideInt) poolPtr->cacheInvalidated));
+        Ns_MutexUnlock(&poolPtr->cacheLock);
+        Tcl_SetObjResult(interp, dictObj);
+        break;
+    }
+
+    case IStmtCacheIdx:
+    case ILayoutCacheIdx: {
+        Context *ctx = (Context *) handle->context, *cPtr;
+        Pool    *poolPtr = ctx->poolPtr;
+        Tcl_Obj *dictObj;
+        unsigned long hits, misses;
+        int      size = 0, capacity, i;
+
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle");
+            return TCL_ERROR;
+        }
+        Ns_MutexLock(&poolPtr->lock);
+        if (opt == IStmtCacheIdx) {
+            hits = poolPtr->stmtHits;
+            misses = poolPtr->stmtMisses;
+            for (cPtr = poolPtr->firstCtxPtr; cPtr != NULL; cPtr = cPtr->nextPtr) {
+                hits += cPtr->stmtHits;
+                misses += cPtr->stmtMisses;
+            }
+        } else {
+            hits = poolPtr->layoutHits;
+            misses = poolPtr->layoutMisses;
+            for (cPtr = poolPtr->firstCtxPtr; cPtr != NULL; cPtr = cPtr->nextPtr) {
+                hits += cPtr->layoutHits;
+                misses += cPtr->layoutMisses;
+            }
+        }
+        Ns_MutexUnlock(&poolPtr->lock);
+
+        if (opt == IStmtCacheIdx) {
+            size = ctx->stmts.numEntries;
+            capacity = poolPtr->stmtCacheSize;
+        } else {
+            for (i = 0; i < LAYOUT_CACHE_SIZE; i++) {
+                size += (ctx->layouts[i] != NULL);
+            }
+            capacity = LAYOUT_CACHE_SIZE;
+        }
+
+        dictObj = Tcl_NewDictObj();
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("size", 4),
+                       Tcl_NewWideIntObj((Tcl_WideInt) size));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("capacity", 8),
+                       Tcl_NewWideIntObj((Tcl_WideInt) capacity));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("hits", 4),
+                       Tcl_NewWideIntObj((Tcl_WideInt) (opt == IStmtCacheIdx ? ctx->stmtHits : ctx->layoutHits)));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("misses", 6),
+                       Tcl_NewWideIntObj((Tcl_WideInt) (opt == IStmtCacheIdx ? ctx->stmtMisses : ctx->layoutMisses)));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("poolhits", 8),
+                       Tcl_NewWideIntObj((Tcl_WideInt) hits));
+        Tcl_DictObjPut(NULL, dictObj, Tcl_NewStringObj("poolmisses", 10),
+                       Tcl_NewWideIntObj((Tcl_WideInt) misses));
+        Tcl_SetObjResult(interp, dictObj);
+        break;
+    }
     }
     
     return TCL_OK;
@@ -677,12 +9409,187 @@ static Ns_ReturnCode DbInterpInit(Tcl_Interp * interp, const void *UNUSED(ignore
     return NS_OK;
 }
 
-static Ns_ReturnCode DbServerInit(const char *server, const char *UNUSED(module), const char *UNUSED(driver))
+static Ns_ReturnCode DbServerInit(const char *server, const char *UNUSED(module), const char *driver)
 {
+    const char *pool;
+    WarmupJob **jobs;
+    int         njobs = 0, i;
+
     Ns_TclRegisterTrace(server, DbInterpInit, NULL, NS_TCL_TRACE_CREATE);
+
+    /*
+     * Warm up all pools of the server at the same time, so that the
+     * startup waits only for the slowest one.
+     */
+    pool = Ns_DbPoolList(server);
+    if (pool != NULL) {
+        const char *p;
+
+        for (p = pool; *p != '\0'; p += strlen(p) + 1u) {
+            njobs++;
+        }
+        jobs = ns_calloc((size_t) njobs + 1u, sizeof(WarmupJob *));
+        njobs = 0;
+        for (p = pool; *p != '\0'; p += strlen(p) + 1u) {
+            jobs[njobs] = WarmupStart(p, driver);
+            if (jobs[njobs] != NULL) {
+                njobs++;
+            }
+        }
+        for (i = 0; i < njobs; i++) {
+            WarmupWait(jobs[i]);
+        }
+        ns_free(jobs);
+    }
     return NS_OK;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * WarmupStart, WarmupWait --
+ *
+ *      Open the configured number of warm-up connections of a pool of
+ *      this driver, using up to warmupthreads threads, and wait for
+ *      them. Each connection runs the sessioninit statements once and
+ *      is handed to DbOpenDb when nsdb opens a handle.
+ *
+ * Results:
+ *      WarmupStart returns the running job or NULL when the pool has
+ *      no warm-up.
+ *
+ * Side effects:
+ *      Opens connections, logs the warm-up time of the pool.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static WarmupJob *
+WarmupStart(const char *poolname, const char *driver)
+{
+    WarmupJob  *jobPtr;
+    Pool       *poolPtr;
+    const char *path, *value;
+    int         i;
+
+    path = Ns_ConfigGetPath(NULL, NULL, "db", "pool", poolname, (char *)0L);
+    value = Ns_ConfigGetValue(path, "driver");
+    if (value == NULL || !STREQ(value, driver)) {
+        return NULL;
+    }
+    poolPtr = GetPool(poolname);
+
+    Ns_MutexLock(&poolPtr->lock);
+    if (poolPtr->warmup == 0 || poolPtr->warmConns != NULL) {
+        /*
+         * Off, or already done for a previous server sharing the pool.
+         */
+        Ns_MutexUnlock(&poolPtr->lock);
+        return NULL;
+    }
+    poolPtr->warmConns = ns_calloc((size_t) poolPtr->warmup, sizeof(MYSQL *));
+    Ns_MutexUnlock(&poolPtr->lock);
+
+    jobPtr = ns_calloc(1u, sizeof(WarmupJob));
+    jobPtr->poolPtr = poolPtr;
+    jobPtr->driver = driver;
+    jobPtr->datasource = Ns_ConfigGetValue(path, "datasource");
+    jobPtr->user = Ns_ConfigGetValue(path, "user");
+    jobPtr->password = Ns_ConfigGetValue(path, "password");
+    jobPtr->n = poolPtr->warmup;
+    jobPtr->nthreads = poolPtr->warmupThreads < jobPtr->n ? poolPtr->warmupThreads : jobPtr->n;
+    jobPtr->threads = ns_calloc((size_t) jobPtr->nthreads, sizeof(Ns_Thread));
+    poolPtr->warmSource = jobPtr->datasource;
+
+    Ns_GetTime(&jobPtr->start);
+    jobPtr->end = jobPtr->start;
+    if (jobPtr->datasource != NULL) {
+        for (i = 0; i < jobPtr->nthreads; i++) {
+            Ns_ThreadCreate(WarmupThread, jobPtr, 0, &jobPtr->threads[i]);
+        }
+    } else {
+        jobPtr->nthreads = 0;
+    }
+    return jobPtr;
+}
+
+static void
+WarmupWait(WarmupJob *jobPtr)
+{
+    Pool          *poolPtr = jobPtr->poolPtr;
+    Ns_Time        diff;
+    unsigned long  usec;
+    int            i, nwarm;
+
+    for (i = 0; i < jobPtr->nthreads; i++) {
+        Ns_ThreadJoin(&jobPtr->threads[i], NULL);
+    }
+    (void) Ns_DiffTime(&jobPtr->end, &jobPtr->start, &diff);
+    usec = (unsigned long) diff.sec * 1000000u + (unsigned long) diff.usec;
+
+    Ns_MutexLock(&poolPtr->lock);
+    poolPtr->retired.warmupTime += usec;
+    nwarm = poolPtr->nwarm;
+    Ns_MutexUnlock(&poolPtr->lock);
+
+    Ns_Log(Notice, "nsdbmysql: pool %s: warm-up opened %d of %d connections in %.3fs",
+           poolPtr->name, nwarm, jobPtr->n, (double) usec / 1e6);
+
+    ns_free(jobPtr->threads);
+    ns_free(jobPtr);
+}
+
+static void
+WarmupThread(void *arg)
+{
+    WarmupJob      *jobPtr = arg;
+    Pool           *poolPtr = jobPtr->poolPtr;
+    Ns_DbHandle     handle;
+    MYSQL          *mysql;
+    Ns_Time         start;
+    unsigned long   usec;
+
+    Ns_ThreadSetName("-nsdbmysql:warmup-");
+    InitThread();
+
+    memset(&handle, 0, sizeof(handle));
+    handle.driver = jobPtr->driver;
+    handle.datasource = jobPtr->datasource;
+    handle.user = jobPtr->user;
+    handle.password = jobPtr->password;
+    handle.poolname = poolPtr->name;
+    Tcl_DStringInit(&handle.dsExceptionMsg);
+
+    Ns_MutexLock(&poolPtr->lock);
+    while (jobPtr->next < jobPtr->n) {
+        jobPtr->next++;
+        Ns_MutexUnlock(&poolPtr->lock);
+
+        Ns_GetTime(&start);
+        mysql = Connect(&handle, handle.datasource, poolPtr->localInfile,
+                        poolPtr->compression != NULL && !poolPtr->compressBulk, poolPtr->warmupTimeout);
+        if (mysql != NULL && SessionInit(&handle, mysql) != NS_OK) {
+            mysql_close(mysql);
+            mysql = NULL;
+        }
+        usec = Elapsed(&start);
+
+        Ns_MutexLock(&poolPtr->lock);
+        if (mysql != NULL) {
+            HistogramAdd(SslResumed(mysql) ? &poolPtr->retired.connectResumed : &poolPtr->retired.connect,
+                         usec);
+            poolPtr->retired.warmups++;
+            poolPtr->warmConns[poolPtr->nwarm++] = mysql;
+        } else {
+            poolPtr->retired.connectErrors++;
+        }
+        Ns_GetTime(&jobPtr->end);
+    }
+    Ns_MutexUnlock(&poolPtr->lock);
+
+    Tcl_DStringFree(&handle.dsExceptionMsg);
+}
+
 static void
 Log(Ns_DbHandle *handle, MYSQL *mysql)
 {
@@ -698,7 +9605,7 @@ Log(Ns_DbHandle *handle, MYSQL *mysql)
         if (handle != NULL) {
             sprintf(handle->cExceptionCode, "%u", nErr);
             Tcl_DStringFree(&(handle->dsExceptionMsg));
-            Tcl_DStringAppend(&(handle->dsExceptionMsg, TCL_INDEX_NONE), msg);
+            Tcl_DStringAppend(&(handle->dsExceptionMsg), msg, TCL_INDEX_NONE);
         }
     }
 }
@@ -772,7 +9679,25 @@ CleanupThread(void *arg)
 static void
 AtExit(void *UNUSED(arg))
 {
+    Tcl_HashSearch  search;
+    Tcl_HashEntry  *hPtr;
+
     Ns_Log(Debug, "nsdbmysql: AtExit");
+
+    /*
+     * Close warm connections never taken by a handle.
+     */
+    Ns_MutexLock(&poolsLock);
+    for (hPtr = Tcl_FirstHashEntry(&pools, &search); hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+        Pool *poolPtr = Tcl_GetHashValue(hPtr);
+
+        Ns_MutexLock(&poolPtr->lock);
+        while (poolPtr->nwarm > 0) {
+            mysql_close(poolPtr->warmConns[--poolPtr->nwarm]);
+        }
+        Ns_MutexUnlock(&poolPtr->lock);
+    }
+    Ns_MutexUnlock(&poolsLock);
     mysql_library_end();
 }
 